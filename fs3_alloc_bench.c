@@ -0,0 +1,220 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_alloc_bench.c
+//  Description    : This is a microbenchmark of the FS3 sector allocator. It
+//                   fills an empty disk with runs for a number of growing
+//                   files and, for each tenth of the disk filled, reports the
+//                   cost of an allocation, how many runs of a file landed on
+//                   the track of its last run, and the cost of the
+//                   first-fit scan of a sector byte map from track 0 that it
+//                   replaced.
+//
+//  Author         : Sarah Babu
+//  Last Modified  : 11/19/2021
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_controller.h>
+
+//
+// Defines
+#define FS3_ALLOC_BENCH_ARGUMENTS "hf:w:s:"
+#define USAGE \
+	"USAGE: fs3_alloc_bench [-h] [-f <files>] [-w <sectors>] [-s <seed>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -f - files growing at the same time (default 40)\n" \
+	"    -w - most sectors asked for at once (default 3)\n" \
+	"    -s - random seed (default 1)\n" \
+	"\n"
+
+#define FS3_ALLOC_BENCH_MAX_FILES 1024 // most files growing at once
+#define FS3_ALLOC_BENCH_NEW_FILE 200   // one in this many allocations starts a new file
+#define FS3_ALLOC_BENCH_SECTORS (FS3_MAX_TRACKS * FS3_TRACK_SIZE)
+
+//
+// Driver internals the benchmark calls directly
+
+uint16_t get_free_sectors(int32_t last, uint16_t want, uint16_t *track, uint16_t *sector);
+	// Allocates a run of contiguous sectors on one track
+
+extern uint32_t sectors_used; // sectors allocated by the driver
+
+//
+// Global data
+
+// the byte map of the scan the bitmap allocator replaced, and the sectors
+// the driver handed out, to catch one given out twice
+uint8_t scan_usage[FS3_MAX_TRACKS][FS3_TRACK_SIZE];
+uint8_t bench_given[FS3_MAX_TRACKS][FS3_TRACK_SIZE];
+
+//
+// Functional Prototypes
+
+double bench_nanoseconds(void);
+	// Gives the current time in nanoseconds
+
+int scan_get_free_sector(uint16_t *track, uint16_t *sector);
+	// Allocates one sector by scanning the byte map from track 0
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 allocation benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+	int32_t last[FS3_ALLOC_BENCH_MAX_FILES];
+	uint32_t nfiles = 40, most = 3, seed = 1, allocated = 0, calls = 0, growing = 0, same_track = 0;
+	uint32_t scanned = 0, decile = 0, f = 0;
+	uint16_t want = 0, got = 0, track = 0, sector = 0, i = 0, t = 0, s = 0;
+	double start = 0, scan = 0, before = 0;
+	int ch;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, FS3_ALLOC_BENCH_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf(stderr, USAGE);
+			return(-1);
+
+		case 'f': // Set the files growing at once
+			if ((sscanf(optarg, "%u", &nfiles) != 1) || (nfiles == 0) || (nfiles > FS3_ALLOC_BENCH_MAX_FILES)) {
+				fprintf(stderr, "Bad number of files [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'w': // Set the most sectors asked for
+			if ((sscanf(optarg, "%u", &most) != 1) || (most == 0) || (most > FS3_TRACK_SIZE)) {
+				fprintf(stderr, "Bad number of sectors [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 's': // Set the random seed
+			if (sscanf(optarg, "%u", &seed) != 1) {
+				fprintf(stderr, "Bad seed [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return(-1);
+		}
+	}
+	initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+
+	for (f = 0; f < nfiles; f++) {
+		last[f] = -1;
+	}
+
+	// grow a random file until the disk is full, timing each tenth
+	printf("%8s %14s %14s %14s\n", "fill", "ns/alloc", "same track %", "scan ns/sector");
+	start = bench_nanoseconds();
+	while (allocated < FS3_ALLOC_BENCH_SECTORS) {
+		f = rand_r(&seed) % nfiles;
+		want = 1 + (rand_r(&seed) % most);
+		got = get_free_sectors(last[f], want, &track, &sector);
+		calls++;
+		if (got == 0) {
+			break;
+		}
+		if (last[f] >= 0) {
+			growing++;
+			same_track += (track == last[f] / FS3_TRACK_SIZE);
+		}
+		for (i = sector; i < sector + got; i++) {
+			if (bench_given[track][i]) {
+				fprintf(stderr, "Sector %u of track %u given out twice\n", i, track);
+				return(-1);
+			}
+			bench_given[track][i] = 1;
+		}
+		last[f] = track * FS3_TRACK_SIZE + sector + got - 1;
+		allocated += got;
+		if ((rand_r(&seed) % FS3_ALLOC_BENCH_NEW_FILE) == 0) {
+			last[f] = -1;
+		}
+
+		// the old scan for as many sectors, kept out of the driver's time
+		before = bench_nanoseconds();
+		for (i = 0; i < got; i++) {
+			scan_get_free_sector(&t, &s);
+		}
+		scan += bench_nanoseconds() - before;
+		scanned += got;
+
+		if ((allocated * 10) / FS3_ALLOC_BENCH_SECTORS > decile) {
+			decile = (allocated * 10) / FS3_ALLOC_BENCH_SECTORS;
+			printf("%7u%% %14.1f %14.2f %14.1f\n", decile * 10, (bench_nanoseconds() - start - scan) / calls,
+			       (growing > 0) ? (100.0 * same_track) / growing : 0.0, scan / scanned);
+			calls = 0;
+			growing = 0;
+			same_track = 0;
+			scan = 0;
+			scanned = 0;
+			start = bench_nanoseconds();
+		}
+	}
+
+	printf("allocated %u of %u sectors, the driver counts %u used\n", allocated, FS3_ALLOC_BENCH_SECTORS, sectors_used);
+	return(((allocated == FS3_ALLOC_BENCH_SECTORS) && (sectors_used == allocated)) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_nanoseconds
+// Description  : Gives the current time in nanoseconds
+//
+// Inputs       : none
+// Outputs      : the time
+
+double bench_nanoseconds(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((now.tv_sec * 1e9) + now.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scan_get_free_sector
+// Description  : Allocates one sector the way the driver did before the
+//                bitmap, the first free one of the byte map from track 0
+//
+// Inputs       : track - set to the track of the sector
+//                sector - set to the sector
+// Outputs      : 1 if a sector was found, 0 if the map is full
+
+int scan_get_free_sector(uint16_t *track, uint16_t *sector) {
+	uint16_t i = 0, j = 0;
+
+	for (i = 0; i < FS3_MAX_TRACKS; i++) {
+		for (j = 0; j < FS3_TRACK_SIZE; j++) {
+			if (!scan_usage[i][j]) {
+				scan_usage[i][j] = 1;
+				*track = i;
+				*sector = j;
+				return(1);
+			}
+		}
+	}
+	return(0);
+}
@@ -12,6 +12,9 @@
 #include <stdlib.h>
 #include <cmpsc311_log.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 // Project Includes
 #include <fs3_cache.h>
@@ -20,95 +23,873 @@
 //
 // support macros/data
 // cache structures
-typedef struct cache_node
+
+// per line metadata, kept apart from the sector payloads so that walking the
+// lists and the index never touches the 1 KB sector data.  Lines below
+// cache_capacity hold data in the arena, the ones above are ghost entries
+// (the sector id of a recently evicted line) used by the 2Q and ARC policies.
+typedef struct cache_line
 {
-	uint8_t sector_data[FS3_SECTOR_SIZE]; //sector data
 	uint32_t sector_id; // sector id
-	struct cache_node *next; // next pointer
-	struct cache_node *prev; // previous pointer
-} cache_node;
+	uint32_t next; // next line in the list
+	uint32_t prev; // previous line in the list
+	uint32_t dnext; // next line in the dirty list
+	uint32_t dprev; // previous line in the dirty list
+	uint8_t dirty; // line differs from the controller copy
+	uint8_t list; // policy list the line is on
+	uint8_t prefetched; // read ahead and not yet used
+	uint8_t writing; // a copy is being written back by the flusher
+	uint8_t doomed; // invalidated while pinned, freed by the last unpin
+	uint16_t pins; // outstanding pins, a pinned line is never evicted
+} cache_line;
+
+// a doubly linked list of lines, head is the oldest
+typedef struct cache_list
+{
+	uint32_t head; // first line
+	uint32_t tail; // last line
+	uint32_t count; // lines on the list
+} cache_list;
+
+// hash index slot, holds the key so probing does not need the line array
+typedef struct cache_slot
+{
+	uint32_t sector_id; // sector id of the line in the slot
+	uint32_t line; // line number, CACHE_NO_LINE if the slot is empty
+} cache_slot;
+
+// the replacement policy interface, it works on one shard
+struct cache_shard;
+typedef struct cache_policy
+{
+	const char *name; // name of the policy
+	void (*hit)(struct cache_shard *s, uint32_t line); // a resident line was accessed
+	void (*ghost_hit)(struct cache_shard *s, int ghost); // a missed sector was on a ghost list (NULL if not used)
+	int (*make_room)(struct cache_shard *s, int ghost); // free a line if full (ghost = list the missed sector was a ghost on)
+	void (*insert)(struct cache_shard *s, uint32_t line, int ghost); // place a newly filled line
+} cache_policy;
+
+// marks the end of a list / an empty index slot / no list
+#define CACHE_NO_LINE 0xffffffff
+#define CACHE_NO_LIST 0xff
+
+// the lists used by the policies
+#define CACHE_MAX_LISTS 4
+#define LRU_LIST 0
+#define TWOQ_A1IN 0
+#define TWOQ_AM 1
+#define TWOQ_A1OUT 2
+#define ARC_T1 0
+#define ARC_T2 1
+#define ARC_B1 2
+#define ARC_B2 3
+
+// calculating the sector id used as the cache key
+#define CACHE_SECTOR_ID(trk, sct) ((((uint32_t)(trk))*1024) + (sct))
+
+// the payload of a cache line of a shard in the arena
+#define CACHE_LINE_DATA(s, l) (&(s)->arena[((size_t)(l)) * FS3_SECTOR_SIZE])
+
+// is the line of a shard a ghost entry
+#define CACHE_IS_GHOST(s, l) ((l) >= (s)->capacity)
+
+// most shards, and fewest lines a shard is given when picking the number
+#define CACHE_MAX_SHARDS 16
+#define CACHE_SHARD_MIN_LINES 256
+
+// the metrics are counted from every shard at once
+#define CACHE_COUNT(c) __atomic_add_fetch(&(c), 1, __ATOMIC_RELAXED)
+
+// most dirty lines written back in one batch
+#define CACHE_WRITEBACK_BATCH 64
+
+// returned by eviction when the line it picked has to be written back first
+#define CACHE_EVICT_DIRTY -2
 
-//this link always point to first Link
-cache_node *cache_head = NULL;
+// returned by eviction when every line is pinned and some are being written
+#define CACHE_EVICT_BUSY -3
 
-//this link always point to tail Link 
-cache_node *cache_tail = NULL;
+// how cache_put treats a sector that is already cached
+#define CACHE_PUT_REPLACE 0 // copy the new contents in
+#define CACHE_PUT_KEEP 1 // leave the line alone
+#define CACHE_PUT_PREFETCH 2 // leave it alone, a new line is read ahead
+
+// huge page size used to round the arena when huge pages are requested
+#define CACHE_HUGE_PAGE_SIZE (2*1024*1024)
+
+// a shard of the cache, with its own lock, lines, index, lists and policy
+// state. Sectors are spread over the shards by a hash of their id so that
+// threads working on different sectors rarely wait on each other.
+typedef struct cache_shard
+{
+	pthread_mutex_t lock; // held while the shard is used
+	pthread_cond_t written; // signalled when a background write back is done
+	cache_line *lines; // line metadata, resident lines then ghosts
+	uint8_t *arena; // the shard's part of the arena
+	cache_list lists[CACHE_MAX_LISTS]; // the policy lists
+	uint32_t free; // stack of unused resident lines, linked through next
+	uint32_t ghost_free; // stack of unused ghost entries
+	cache_slot *index; // open addressing hash index over lines and ghosts
+	uint32_t index_bits;
+	uint32_t index_mask;
+	uint32_t size; // resident lines in use
+	uint32_t capacity; // resident lines allocated
+	uint32_t dirty_head; // dirty lines in the order they were first dirtied
+	uint32_t dirty_tail;
+	uint32_t dirty_count;
+	uint32_t writing; // lines being written back
+	uint32_t dirty_victim; // dirty line eviction picked, written back by cache_put
+	uint32_t twoq_kin, twoq_kout; // 2Q queue limits
+	uint32_t arc_p; // ARC target size of T1
+} cache_shard;
+
+// the arena holding the sector data of every resident line, each shard
+// owns a slice of it
+uint8_t *cache_arena = NULL;
+size_t cache_arena_size = 0;
+
+// back the arena with huge pages (set before fs3_init_cache)
+int fs3_cache_huge_pages = 0;
+
+// the shards, a power of two of them
+cache_shard *cache_shards = NULL;
+uint32_t cache_shard_count = 0;
+uint32_t cache_shard_bits = 0;
+uint32_t fs3_cache_shards = 0;
+
+// number of lines allocated over all the shards
+uint32_t cache_capacity = 0;
+
+// write policy, dirty byte high-water mark and the writeback function
+int fs3_cache_write_through = 0;
+uint32_t fs3_cache_dirty_high_water = 0;
+fs3_cache_writeback_t cache_writeback = NULL;
+fs3_cache_writeback_batch_t cache_writeback_batch = NULL;
+
+// the flusher thread, it writes back shards that went over the high-water
+// mark without holding up the writers
+pthread_mutex_t cache_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_flusher_work = PTHREAD_COND_INITIALIZER;
+pthread_t cache_flusher_thread;
+int cache_flusher_running = 0, cache_flusher_stop = 0, cache_flusher_wanted = 0;
+
+// replacement policy selected for fs3_init_cache and the one in use
+FS3CachePolicy fs3_cache_policy = FS3_CACHE_LRU;
+const cache_policy *cache_ops = NULL;
 
 //initlializing log metrics
 uint32_t fs3_put_cache_success = 0, fs3_put_cache_failure = 0, fs3_get_cache_success = 0, fs3_get_cache_failure = 0;
+uint32_t fs3_cache_dirty_writes = 0, fs3_cache_writebacks = 0, fs3_cache_writeback_failures = 0;
+uint32_t fs3_cache_background_writebacks = 0;
+uint32_t fs3_cache_evictions = 0, fs3_cache_ghost_hits = 0, fs3_cache_invalidations = 0;
+uint32_t fs3_cache_prefetches = 0, fs3_cache_prefetch_hits = 0, fs3_cache_prefetch_wasted = 0;
+uint32_t fs3_cache_readahead_windows = 0, fs3_cache_readahead_window_max = 0;
+uint64_t fs3_cache_readahead_window_total = 0;
 
 //
 // Implementation
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : is_cache_empty
-// Description  : checks if the cache is empty
+// Function     : cache_shard_of
+// Description  : finds the shard holding a sector (fibonacci hashing of the
+//                sector id, so neighbouring sectors go to different shards)
 //
-// Inputs       : none
-// Outputs      : True if empty, False otherwise
+// Inputs       : sector_id - the sector id
+// Outputs      : the shard
+
+cache_shard *cache_shard_of(uint32_t sector_id)
+{
+    if (cache_shard_bits == 0) {
+        return (&cache_shards[0]);
+    }
+    return (&cache_shards[(sector_id * 2654435761u) >> (32 - cache_shard_bits)]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_index_slot
+// Description  : computes the home slot of a sector id in the hash index of
+//                a shard (fibonacci hashing, so neighbouring sectors spread
+//                out, using the hash bits below the ones that picked the shard)
+//
+// Inputs       : s - the shard
+//                sector_id - the sector id to hash
+// Outputs      : slot number in the index
+
+uint32_t cache_index_slot(cache_shard *s, uint32_t sector_id)
+{
+    return (((sector_id * 2654435761u) << cache_shard_bits) >> (32 - s->index_bits)) & s->index_mask;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_index_insert
+// Description  : adds a line to the hash index (line must not be present)
+//
+// Inputs       : s - the shard
+//                line - the cache line to index
+// Outputs      : none
+
+void cache_index_insert(cache_shard *s, uint32_t line)
+{
+    uint32_t slot = cache_index_slot(s, s->lines[line].sector_id);
+
+    // linear probe to the first empty slot
+    while (s->index[slot].line != CACHE_NO_LINE) {
+        slot = (slot + 1) & s->index_mask;
+    }
+    s->index[slot].sector_id = s->lines[line].sector_id;
+    s->index[slot].line = line;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_index_remove
+// Description  : removes a line from the hash index, shifting back any
+//                entries of the probe run so no tombstones are needed
+//
+// Inputs       : s - the shard
+//                line - the cache line to remove
+// Outputs      : none
+
+void cache_index_remove(cache_shard *s, uint32_t line)
+{
+    uint32_t slot = cache_index_slot(s, s->lines[line].sector_id), next, home;
+
+    // find the slot holding the line
+    while (s->index[slot].line != line) {
+        if (s->index[slot].line == CACHE_NO_LINE) {
+            return;
+        }
+        slot = (slot + 1) & s->index_mask;
+    }
+    s->index[slot].line = CACHE_NO_LINE;
+
+    // move later entries of the run back into the hole if their home allows it
+    next = (slot + 1) & s->index_mask;
+    while (s->index[next].line != CACHE_NO_LINE) {
+        home = cache_index_slot(s, s->index[next].sector_id);
+        if (((next - home) & s->index_mask) >= ((next - slot) & s->index_mask)) {
+            s->index[slot] = s->index[next];
+            s->index[next].line = CACHE_NO_LINE;
+            slot = next;
+        }
+        next = (next + 1) & s->index_mask;
+    }
+}
 
-int is_cache_empty() 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_cache_arena
+// Description  : maps the arena for the sector data of all lines, using
+//                huge pages when asked for and available
+//
+// Inputs       : lines - number of lines to allocate payloads for
+// Outputs      : 0 if successful, -1 if failure
+
+int alloc_cache_arena(uint32_t lines)
 {
-   return (cache_head == NULL);
+    void *arena = MAP_FAILED;
+
+    cache_arena_size = ((size_t) lines) * FS3_SECTOR_SIZE;
+    if (fs3_cache_huge_pages) {
+        // round up to a whole number of huge pages and try the explicit pool
+        cache_arena_size = (cache_arena_size + CACHE_HUGE_PAGE_SIZE - 1) & ~((size_t) CACHE_HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        arena = mmap(NULL, cache_arena_size, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    }
+
+    // fall back to normal pages (transparent huge pages if enabled)
+    if (arena == MAP_FAILED) {
+        arena = mmap(NULL, cache_arena_size, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            cache_arena_size = 0;
+            return(-1);
+        }
+#ifdef MADV_HUGEPAGE
+        if (fs3_cache_huge_pages) {
+            madvise(arena, cache_arena_size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    cache_arena = (uint8_t *) arena;
+    return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : insert_node_to_tail
-// Description  : inserts a node to the tail of the cache
+// Function     : list_append
+// Description  : appends a line to the tail (most recent end) of a list
 //
-// Inputs       : pointer to the cache node
+// Inputs       : s - the shard
+//                list - the list number
+//                line - the cache line
 // Outputs      : none
 
-void insert_node_to_tail(cache_node *node) 
+void list_append(cache_shard *s, int list, uint32_t line)
 {
-    if (is_cache_empty()) {
-        // Cache is empty head and tail point to the same node
-        cache_head = node;
-		cache_tail = node;
+    cache_list *l = &s->lists[list];
+
+    s->lines[line].list = list;
+    s->lines[line].next = CACHE_NO_LINE;
+    s->lines[line].prev = l->tail;
+    if (l->tail == CACHE_NO_LINE) {
+        // list is empty head and tail point to the same line
+        l->head = line;
     } else {
-        // add new code as next of last
-        cache_tail->next = (struct cache_node*) node;     
+        // add new line as next of last
+        s->lines[l->tail].next = line;
+    }
 
-        // new nodes previous pointer points to the old tail node
-        node->prev = (struct cache_node*) cache_tail;
+    // new line is now the tail
+    l->tail = line;
+    l->count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_remove
+// Description  : takes a line out of the list it is on
+//
+// Inputs       : s - the shard
+//                line - the cache line
+// Outputs      : none
+
+void list_remove(cache_shard *s, uint32_t line)
+{
+    cache_list *l = &s->lists[s->lines[line].list];
+
+    if (line == l->head) {
+        // change first to point to next line
+        l->head = s->lines[line].next;
+    } else {
+        // bypass the line
+        s->lines[s->lines[line].prev].next = s->lines[line].next;
+    }
+
+    if (line == l->tail) {
+        // change last to point to prev line
+        l->tail = s->lines[line].prev;
+    } else {
+        s->lines[s->lines[line].next].prev = s->lines[line].prev;
     }
+    s->lines[line].list = CACHE_NO_LIST;
+    l->count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_move_to_tail
+// Description  : moves a line to the tail of a list
+//
+// Inputs       : s - the shard
+//                list - the list number
+//                line - the cache line
+// Outputs      : none
 
-    // new node is not the tail
-    cache_tail = (struct cache_node*) node;
-	cache_tail->next = NULL;
+void list_move_to_tail(cache_shard *s, int list, uint32_t line)
+{
+    // nothing to do if it already is the most recent
+    if ((s->lines[line].list == list) && (s->lists[list].tail == line)) {
+        return;
+    }
+    list_remove(s, line);
+    list_append(s, list, line);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : move_node_to_tail
-// Description  : moves a given node to the end of cache
+// Function     : mark_line_dirty
+// Description  : marks a line dirty, appending it to the dirty list
 //
-// Inputs       : pointer to the cache node
+// Inputs       : s - the shard
+//                line - the cache line
 // Outputs      : none
 
-void move_node_to_tail(cache_node* node) {
-   // Delete node from cache
-    if (node == cache_head) {
-        // change first to point to next node
-        cache_head = cache_head->next;
+void mark_line_dirty(cache_shard *s, uint32_t line)
+{
+    if (s->lines[line].dirty) {
+        return;
+    }
+    s->lines[line].dirty = 1;
+    s->lines[line].dnext = CACHE_NO_LINE;
+    s->lines[line].dprev = s->dirty_tail;
+    if (s->dirty_tail == CACHE_NO_LINE) {
+        s->dirty_head = line;
     } else {
-        // bypass the node
-        node->prev->next = node->next;
-    }    
+        s->lines[s->dirty_tail].dnext = line;
+    }
+    s->dirty_tail = line;
+    s->dirty_count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mark_line_clean
+// Description  : clears the dirty state of a line, taking it off the dirty list
+//
+// Inputs       : s - the shard
+//                line - the cache line
+// Outputs      : none
 
-    if (node == cache_tail) {
-        // change last to point to prev node
-        cache_tail = node->prev;
+void mark_line_clean(cache_shard *s, uint32_t line)
+{
+    if (!s->lines[line].dirty) {
+        return;
+    }
+    if (line == s->dirty_head) {
+        s->dirty_head = s->lines[line].dnext;
     } else {
-        node->next->prev = node->prev;
+        s->lines[s->lines[line].dprev].dnext = s->lines[line].dnext;
+    }
+    if (line == s->dirty_tail) {
+        s->dirty_tail = s->lines[line].dprev;
+    } else {
+        s->lines[s->lines[line].dnext].dprev = s->lines[line].dprev;
+    }
+    s->lines[line].dirty = 0;
+    s->dirty_count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_sectors
+// Description  : writes sectors to the controller in one batch (or one at
+//                a time without a batch function)
+//
+// Inputs       : ids - the sector ids
+//                bufs - the contents of the sectors
+//                n - the number of sectors
+// Outputs      : 0 if successful, -1 if failure
+
+int send_sectors(uint32_t *ids, void **bufs, uint32_t n)
+{
+    uint32_t i = 0;
+
+    if (NULL != cache_writeback_batch) {
+        if (0 != cache_writeback_batch(ids, bufs, n)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed writing back %u cached sectors", n);
+            CACHE_COUNT(fs3_cache_writeback_failures);
+            return(-1);
+        }
+        return(0);
+    }
+    for (i = 0; i < n; i++) {
+        if ((NULL == cache_writeback) || (0 != cache_writeback(ids[i] / 1024, ids[i] % 1024, bufs[i]))) {
+            logMessage(LOG_ERROR_LEVEL, "Failed writing back cached sector %u", ids[i]);
+            CACHE_COUNT(fs3_cache_writeback_failures);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_lines
+// Description  : writes back a batch of a shard's dirty lines with the shard
+//                lock released. The lines are copied out, marked clean,
+//                flagged as writing and pinned under the lock (so they are
+//                neither evicted nor sent twice), the lock is dropped for
+//                the send and taken again to unpin them; a failed batch goes
+//                back on the dirty list. The caller holds the lock.
+//
+// Inputs       : s - the shard
+//                first - a line to write ahead of the oldest ones (or
+//                        CACHE_NO_LINE)
+//                buf - room for a batch of sectors
+//                background - count the lines as background write backs
+// Outputs      : lines written back (0 if all dirty lines are already being
+//                written), -1 if failure
+
+int writeback_lines(cache_shard *s, uint32_t first, uint8_t *buf, int background)
+{
+    uint32_t ids[CACHE_WRITEBACK_BATCH], lines[CACHE_WRITEBACK_BATCH];
+    void *bufs[CACHE_WRITEBACK_BATCH];
+    uint32_t line = s->dirty_head, n = 0, i = 0;
+    int ret = 0;
+
+    if ((first != CACHE_NO_LINE) && s->lines[first].dirty && !s->lines[first].writing) {
+        lines[n++] = first;
+    }
+    for (; (n < CACHE_WRITEBACK_BATCH) && (line != CACHE_NO_LINE); line = s->lines[line].dnext) {
+        if ((line != first) && !s->lines[line].writing) {
+            lines[n++] = line;
+        }
+    }
+    if (0 == n) {
+        return(0);
+    }
+    for (i = 0; i < n; i++) {
+        line = lines[i];
+        ids[i] = s->lines[line].sector_id;
+        bufs[i] = &buf[((size_t) i) * FS3_SECTOR_SIZE];
+        memcpy(bufs[i], CACHE_LINE_DATA(s, line), FS3_SECTOR_SIZE);
+        mark_line_clean(s, line);
+        s->lines[line].writing = 1;
+        s->lines[line].pins++;
+    }
+    s->writing += n;
+    pthread_mutex_unlock(&s->lock);
+
+    ret = send_sectors(ids, bufs, n);
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < n; i++) {
+        s->lines[lines[i]].writing = 0;
+        s->lines[lines[i]].pins--;
+        if (ret == -1) {
+            mark_line_dirty(s, lines[i]);
+        } else {
+            CACHE_COUNT(fs3_cache_writebacks);
+            if (background) {
+                CACHE_COUNT(fs3_cache_background_writebacks);
+            }
+        }
+    }
+    s->writing -= n;
+    pthread_cond_broadcast(&s->written);
+    return((ret == -1) ? -1 : (int) n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shard_high_water
+// Description  : gives a shard's share of the dirty byte high-water mark
+//
+// Inputs       : s - the shard
+// Outputs      : the high-water mark in bytes
+
+uint32_t shard_high_water(cache_shard *s)
+{
+    uint32_t high_water = fs3_cache_dirty_high_water / cache_shard_count;
+
+    if (0 == high_water) {
+        high_water = (s->capacity / 2) * FS3_SECTOR_SIZE;
+    }
+    return(high_water);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_shard_background
+// Description  : writes back the oldest dirty lines of a shard until it is
+//                down to half of its high-water mark
+//
+// Inputs       : s - the shard
+//                buf - room for a batch of sectors
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_shard_background(cache_shard *s, uint8_t *buf)
+{
+    uint32_t high_water = 0;
+    int ret = 1;
+
+    pthread_mutex_lock(&s->lock);
+    high_water = shard_high_water(s);
+    while ((ret > 0) && ((s->dirty_count * FS3_SECTOR_SIZE) > (high_water / 2))) {
+        ret = writeback_lines(s, CACHE_NO_LINE, buf, 1);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return((ret == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flusher_main
+// Description  : the flusher thread, it writes back the shards over their
+//                high-water mark each time it is woken
+//
+// Inputs       : arg - not used
+// Outputs      : NULL
+
+void *cache_flusher_main(void *arg)
+{
+    uint8_t *buf = malloc(CACHE_WRITEBACK_BATCH * FS3_SECTOR_SIZE);
+    uint32_t i = 0;
+
+    pthread_mutex_lock(&cache_flusher_lock);
+    while (!cache_flusher_stop) {
+        if (!cache_flusher_wanted) {
+            pthread_cond_wait(&cache_flusher_work, &cache_flusher_lock);
+            continue;
+        }
+        cache_flusher_wanted = 0;
+        pthread_mutex_unlock(&cache_flusher_lock);
+        // writers are held up by eviction if this cannot keep up
+        for (i = 0; (NULL != buf) && (i < cache_shard_count); i++) {
+            flush_shard_background(&cache_shards[i], buf);
+        }
+        pthread_mutex_lock(&cache_flusher_lock);
+    }
+    pthread_mutex_unlock(&cache_flusher_lock);
+    free(buf);
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_flusher_wake
+// Description  : asks the flusher thread for a pass
+//
+// Inputs       : none
+// Outputs      : none
+
+void cache_flusher_wake(void)
+{
+    pthread_mutex_lock(&cache_flusher_lock);
+    cache_flusher_wanted = 1;
+    pthread_cond_signal(&cache_flusher_work);
+    pthread_mutex_unlock(&cache_flusher_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : note_prefetch_use
+// Description  : counts the first use of a line that was read ahead
+//
+// Inputs       : s - the shard
+//                line - the cache line
+// Outputs      : none
+
+void note_prefetch_use(cache_shard *s, uint32_t line)
+{
+    if (s->lines[line].prefetched) {
+        s->lines[line].prefetched = 0;
+        CACHE_COUNT(fs3_cache_prefetch_hits);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_line
+// Description  : drops a resident line or ghost entry from its list and the
+//                index, returning it to its free stack
+//
+// Inputs       : s - the shard
+//                line - the cache line
+// Outputs      : none
+
+void release_line(cache_shard *s, uint32_t line)
+{
+    list_remove(s, line);
+    cache_index_remove(s, line);
+    if (CACHE_IS_GHOST(s, line)) {
+        s->lines[line].next = s->ghost_free;
+        s->ghost_free = line;
+    } else {
+        s->lines[line].next = s->free;
+        s->free = line;
+        s->size--;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : evict_line
+// Description  : evicts a clean resident line, optionally remembering its
+//                sector id on a ghost list
+//
+// Inputs       : s - the shard
+//                line - the cache line to evict
+//                ghost - ghost list to remember the sector on (or CACHE_NO_LIST)
+// Outputs      : 0 if successful
+
+int evict_line(cache_shard *s, uint32_t line, int ghost)
+{
+    uint32_t entry = s->ghost_free;
+
+    if (s->lines[line].prefetched) {
+        CACHE_COUNT(fs3_cache_prefetch_wasted);
+    }
+
+    // keep the sector id on the ghost list if there is a free entry
+    if ((ghost != CACHE_NO_LIST) && (entry != CACHE_NO_LINE)) {
+        s->ghost_free = s->lines[entry].next;
+        s->lines[entry].sector_id = s->lines[line].sector_id;
+        s->lines[entry].dirty = 0;
+        release_line(s, line);
+        cache_index_insert(s, entry);
+        list_append(s, ghost, entry);
+    } else {
+        release_line(s, line);
+    }
+    CACHE_COUNT(fs3_cache_evictions);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : evict_first
+// Description  : evicts the oldest unpinned line of a list, falling back to
+//                a second list if every line of the first one is pinned. A
+//                dirty line is left for cache_put to write back without the
+//                shard lock, the controller must have it before it is reused.
+//
+// Inputs       : s - the shard
+//                list, ghost - list to evict from and ghost list to use
+//                alt, alt_ghost - fallback list and its ghost list
+// Outputs      : 0 if successful, CACHE_EVICT_DIRTY if the line picked
+//                (s->dirty_victim) is dirty, CACHE_EVICT_BUSY if the lines
+//                being written back are the only ones to wait for, -1 if
+//                nothing could be evicted
+
+int evict_first(cache_shard *s, int list, int ghost, int alt, int alt_ghost)
+{
+    uint32_t line = s->lists[list].head;
+
+    // skip over pinned lines
+    while ((line != CACHE_NO_LINE) && (s->lines[line].pins > 0)) {
+        line = s->lines[line].next;
+    }
+    if ((line != CACHE_NO_LINE) && s->lines[line].dirty) {
+        s->dirty_victim = line;
+        return(CACHE_EVICT_DIRTY);
+    }
+    if (line != CACHE_NO_LINE) {
+        return(evict_line(s, line, ghost));
+    }
+    if (alt != CACHE_NO_LIST) {
+        return(evict_first(s, alt, alt_ghost, CACHE_NO_LIST, CACHE_NO_LIST));
+    }
+    if (s->writing > 0) {
+        return(CACHE_EVICT_BUSY);
+    }
+    logMessage(LOG_ERROR_LEVEL, "Cache eviction failed, all lines pinned");
+    return(-1);
+}
+
+//
+// LRU policy, one list in recency order
+
+void lru_hit(cache_shard *s, uint32_t line)
+{
+    list_move_to_tail(s, LRU_LIST, line);
+}
+
+int lru_make_room(cache_shard *s, int ghost)
+{
+    if (s->size < s->capacity) {
+        return(0);
+    }
+    return(evict_first(s, LRU_LIST, CACHE_NO_LIST, CACHE_NO_LIST, CACHE_NO_LIST));
+}
+
+void lru_insert(cache_shard *s, uint32_t line, int ghost)
+{
+    list_append(s, LRU_LIST, line);
+}
+
+//
+// 2Q policy (Johnson and Shasha), new sectors go through the A1in FIFO and
+// only sectors seen again after leaving it (found on the A1out ghost list)
+// are promoted to the Am LRU list, so a scan cannot flush the hot set
+
+void twoq_hit(cache_shard *s, uint32_t line)
+{
+    // hits in A1in are correlated references and do not promote
+    if (s->lines[line].list == TWOQ_AM) {
+        list_move_to_tail(s, TWOQ_AM, line);
+    }
+}
+
+int twoq_make_room(cache_shard *s, int ghost)
+{
+    if (s->size < s->capacity) {
+        return(0);
+    }
+
+    // A1in over its share gives up its oldest line to the A1out ghost list
+    if ((s->lists[TWOQ_A1IN].count > s->twoq_kin) || (s->lists[TWOQ_AM].count == 0)) {
+        if (s->lists[TWOQ_A1OUT].count >= s->twoq_kout) {
+            release_line(s, s->lists[TWOQ_A1OUT].head);
+        }
+        return(evict_first(s, TWOQ_A1IN, TWOQ_A1OUT, TWOQ_AM, CACHE_NO_LIST));
+    }
+    return(evict_first(s, TWOQ_AM, CACHE_NO_LIST, TWOQ_A1IN, TWOQ_A1OUT));
+}
+
+void twoq_insert(cache_shard *s, uint32_t line, int ghost)
+{
+    list_append(s, (ghost == TWOQ_A1OUT) ? TWOQ_AM : TWOQ_A1IN, line);
+}
+
+//
+// ARC policy (Megiddo and Modha), T1 holds sectors seen once and T2 sectors
+// seen again, the ghost lists B1/B2 adapt the target size (arc_p) of T1
+
+int arc_replace(cache_shard *s, int ghost)
+{
+    uint32_t t1 = s->lists[ARC_T1].count;
+
+    if ((t1 > 0) && ((t1 > s->arc_p) || ((ghost == ARC_B2) && (t1 == s->arc_p)))) {
+        return(evict_first(s, ARC_T1, ARC_B1, ARC_T2, ARC_B2));
+    }
+    return(evict_first(s, ARC_T2, ARC_B2, ARC_T1, ARC_B1));
+}
+
+void arc_hit(cache_shard *s, uint32_t line)
+{
+    list_move_to_tail(s, ARC_T2, line);
+}
+
+void arc_ghost_hit(cache_shard *s, int ghost)
+{
+    uint32_t b1 = s->lists[ARC_B1].count, b2 = s->lists[ARC_B2].count, delta = 0;
+
+    // a ghost hit adapts the target, the ghost entry itself is already gone
+    if (ghost == ARC_B1) {
+        delta = ((b2 / (b1 + 1)) > 1) ? (b2 / (b1 + 1)) : 1;
+        s->arc_p = ((s->arc_p + delta) > s->capacity) ? s->capacity : s->arc_p + delta;
+    } else if (ghost == ARC_B2) {
+        delta = ((b1 / (b2 + 1)) > 1) ? (b1 / (b2 + 1)) : 1;
+        s->arc_p = (delta > s->arc_p) ? 0 : s->arc_p - delta;
+    }
+}
+
+int arc_make_room(cache_shard *s, int ghost)
+{
+    uint32_t b1 = s->lists[ARC_B1].count, b2 = s->lists[ARC_B2].count;
+    uint32_t t1 = s->lists[ARC_T1].count;
+
+    // a ghost hit has adapted the target already (arc_ghost_hit) and its
+    // entry is gone, a miss keeps L1 and the directory in bounds
+    if ((ghost != ARC_B1) && (ghost != ARC_B2)) {
+        if ((t1 + b1) >= s->capacity) {
+            // L1 is full, drop its oldest ghost or (if there is none) its oldest line
+            if (b1 > 0) {
+                release_line(s, s->lists[ARC_B1].head);
+            } else {
+                return(evict_first(s, ARC_T1, CACHE_NO_LIST, ARC_T2, CACHE_NO_LIST));
+            }
+        } else if (((s->size + b1 + b2) >= (2 * s->capacity)) && (b2 > 0)) {
+            release_line(s, s->lists[ARC_B2].head);
+        }
     }
 
-    // Insert node to the tail
-    insert_node_to_tail(node);
+    if (s->size < s->capacity) {
+        return(0);
+    }
+    return(arc_replace(s, ghost));
+}
+
+void arc_insert(cache_shard *s, uint32_t line, int ghost)
+{
+    list_append(s, (ghost == CACHE_NO_LIST) ? ARC_T1 : ARC_T2, line);
 }
 
+// the policy table, indexed by FS3CachePolicy
+const cache_policy cache_policies[FS3_CACHE_MAXPOLICY] = {
+    { "lru", lru_hit, NULL, lru_make_room, lru_insert },
+    { "2q", twoq_hit, NULL, twoq_make_room, twoq_insert },
+    { "arc", arc_hit, arc_ghost_hit, arc_make_room, arc_insert },
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_cache_size
@@ -117,139 +898,323 @@ void move_node_to_tail(cache_node* node) {
 // Inputs       : none
 // Outputs      : length of the given cache
 int get_cache_size() {
-   int length = 0;
-   struct cache_node *current;
-    // moves down the cache and increments lenght by 1 for every node 
-   for(current = cache_head; current != NULL; current = current->next){
-      length++;
-   }
-   return length;
+    uint32_t i = 0, size = 0;
+
+    for (i = 0; i < cache_shard_count; i++) {
+        size += __atomic_load_n(&cache_shards[i].size, __ATOMIC_RELAXED);
+    }
+    return (size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_get_cache_node
-// Description  : gives us the size of the cache
+// Function     : fs3_get_cache_line
+// Description  : looks up the cache line holding a sector through the hash
+//                index of its shard (this may be a ghost entry), the shard
+//                lock is held
 //
-// Inputs       : track sector
-// Outputs      : pointer to cache
+// Inputs       : s - the shard of the sector
+//                sector_id - the sector id
+// Outputs      : line number, CACHE_NO_LINE if not cached
 
-struct cache_node* fs3_get_cache_node(FS3TrackIndex trk, FS3SectorIndex sct)  {
-    // intitialize cache node structure.
-    struct cache_node* current = cache_head;
-	uint32_t sector_id = 0;
-    //calculating sector index based on position.
-	sector_id = ((trk)*1024) + sct;
+uint32_t fs3_get_cache_line(cache_shard *s, uint32_t sector_id)  {
+    uint32_t slot = 0;
 
-    // if cache is empty
-    if (is_cache_empty()) {
-        return(NULL);
-    }
-
-    // navigate through cache
-    while(current != NULL) {
-        if (current->sector_id == sector_id) {
-            return current;
+    // probe the index until the sector or an empty slot is found
+    slot = cache_index_slot(s, sector_id);
+    while (s->index[slot].line != CACHE_NO_LINE) {
+        if (s->index[slot].sector_id == sector_id) {
+            return(s->index[slot].line);
         }
-		current = current->next;
+        slot = (slot + 1) & s->index_mask;
     }
 
-    return(NULL);
+    return(CACHE_NO_LINE);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_get_cache_node
-// Description  : deletes the head of the cache
+// Function     : cache_lock
+// Description  : finds the shard of a sector and locks it, setting the
+//                cache up first if it never was
 //
-// Inputs       : track sector
-// Outputs      : deleted the pointer from cache
+// Inputs       : sector_id - the sector id
+// Outputs      : the locked shard, NULL if there is no cache
 
-struct cache_node* delete_head() {
+cache_shard *cache_lock(uint32_t sector_id) {
+    cache_shard *s = NULL;
 
-    // save reference to first node
-    struct cache_node *tempLink = cache_head;
-	
-    if (is_cache_empty()) {
-        return NULL;
+    if ((NULL == cache_shards) && (-1 == fs3_init_cache(0))) {
+        return(NULL);
     }
+    s = cache_shard_of(sector_id);
+    pthread_mutex_lock(&s->lock);
+    return(s);
+}
 
-    // if only one node
-    if (cache_head->next == NULL){
-        cache_tail = NULL;
-    } else {
-        cache_head->next->prev = NULL;
-    }
-	//points to next pointer
-    cache_head = cache_head->next;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_policy_by_name
+// Description  : Find the replacement policy with the given name
+//
+// Inputs       : name - the policy name (lru, 2q, arc)
+// Outputs      : the policy, -1 if unknown
+
+int fs3_cache_policy_by_name(const char *name) {
+    int i = 0;
 
-    // return the deleted node
-    return tempLink;
+    for (i = 0; i < FS3_CACHE_MAXPOLICY; i++) {
+        if (0 == strcasecmp(name, cache_policies[i].name)) {
+            return(i);
+        }
+    }
+    return(-1);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : insert_tail
-// Description  : inserts a tail to the cache
+// Function     : init_cache_shard
+// Description  : Sets up a shard over its lines and slice of the arena
 //
-// Inputs       : track sector
-// Outputs      : insert pointer tail to the cache node
+// Inputs       : s - the shard
+//                capacity - resident lines of the shard
+//                arena - the shard's part of the arena
+// Outputs      : 0 if successful, -1 if failure
 
-int insert_tail(uint32_t sector_id, uint8_t *sector_data) {
+int init_cache_shard(cache_shard *s, uint32_t capacity, uint8_t *arena) {
+    uint32_t i = 0, slots = 2, lines = capacity * 2;
 
-    //create a node
-    struct cache_node *node = (struct cache_node*) calloc(1,sizeof(struct cache_node));
+    s->capacity = capacity;
+    s->arena = arena;
 
-    if (NULL == node) {
-        return(1);
+    // the index covers lines and ghosts and is at least twice their number
+    s->index_bits = 1;
+    while (slots < (lines * 2)) {
+        slots <<= 1;
+        s->index_bits++;
     }
-    
-    node->sector_id = sector_id;
-    memcpy(node->sector_data, sector_data, FS3_SECTOR_SIZE);
+    s->index_mask = slots - 1;
 
-    insert_node_to_tail(node);
-    return(0);
+    // allocate all of the lines up front, nothing is allocated after this
+    s->lines = (cache_line *) calloc(lines, sizeof(cache_line));
+    s->index = (cache_slot *) malloc(slots * sizeof(cache_slot));
+    if ((NULL == s->lines) || (NULL == s->index)) {
+        return(-1);
+    }
+    memset(s->index, 0xff, slots * sizeof(cache_slot));
+
+    // every line and ghost entry starts on its free stack
+    for (i = 0; i < lines; i++) {
+        s->lines[i].next = ((i + 1 < lines) && (i + 1 != capacity)) ? i + 1 : CACHE_NO_LINE;
+        s->lines[i].list = CACHE_NO_LIST;
+    }
+    s->free = 0;
+    s->ghost_free = capacity;
+    for (i = 0; i < CACHE_MAX_LISTS; i++) {
+        s->lists[i].head = CACHE_NO_LINE;
+        s->lists[i].tail = CACHE_NO_LINE;
+        s->lists[i].count = 0;
+    }
+    s->size = 0;
+    s->dirty_head = CACHE_NO_LINE;
+    s->dirty_tail = CACHE_NO_LINE;
+    s->dirty_count = 0;
 
+    // 2Q uses a quarter of the cache for A1in and remembers half as ghosts
+    s->twoq_kin = (capacity / 4 > 0) ? capacity / 4 : 1;
+    s->twoq_kout = (capacity / 2 > 0) ? capacity / 2 : 1;
+    s->arc_p = 0;
+    return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_init_cache
-// Description  : Initialize the cache with a fixed number of cache lines
+// Description  : Initialize the cache with a fixed number of cache lines,
+//                split over the shards
 //
 // Inputs       : cachelines - the number of cache lines to include in cache
 // Outputs      : 0 if successful, -1 if failure
 
-int fs3_init_cache(uint16_t cachelines) {
-	cache_head = NULL;
-	cache_tail = NULL;
+int fs3_init_cache(uint32_t cachelines) {
+    uint32_t i = 0, shards = 1, first = 0, capacity = 0;
+
+    // start from scratch if the cache was already set up
+    if (NULL != cache_shards) {
+        fs3_close_cache();
+    }
+    cache_capacity = (cachelines == 0) ? FS3_DEFAULT_CACHE_SIZE : cachelines;
+    cache_ops = &cache_policies[(fs3_cache_policy < FS3_CACHE_MAXPOLICY) ? fs3_cache_policy : FS3_CACHE_LRU];
+
+    // as many shards as asked for, or enough that each has a useful share
+    cache_shard_bits = 0;
+    while (((fs3_cache_shards > 0) && (shards * 2 <= fs3_cache_shards) && (shards * 2 <= cache_capacity)) ||
+           ((fs3_cache_shards == 0) && (shards * 2 <= CACHE_MAX_SHARDS) &&
+            (cache_capacity / (shards * 2) >= CACHE_SHARD_MIN_LINES))) {
+        shards *= 2;
+        cache_shard_bits++;
+    }
+    cache_shard_count = shards;
+
+    cache_shards = (cache_shard *) calloc(shards, sizeof(cache_shard));
+    if ((NULL == cache_shards) || (-1 == alloc_cache_arena(cache_capacity))) {
+        logMessage(LOG_ERROR_LEVEL, "Failed allocating cache of %u lines", cache_capacity);
+        fs3_close_cache();
+        return(-1);
+    }
+
+    // the lines are dealt out evenly, each shard gets its run of the arena
+    for (i = 0; i < shards; i++) {
+        capacity = (cache_capacity / shards) + ((i < cache_capacity % shards) ? 1 : 0);
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+        pthread_cond_init(&cache_shards[i].written, NULL);
+        if (-1 == init_cache_shard(&cache_shards[i], capacity, &cache_arena[((size_t) first) * FS3_SECTOR_SIZE])) {
+            logMessage(LOG_ERROR_LEVEL, "Failed allocating cache of %u lines", cache_capacity);
+            fs3_close_cache();
+            return(-1);
+        }
+        first += capacity;
+    }
+
+    // the flusher is only needed when lines are held dirty
+    if (!fs3_cache_write_through) {
+        cache_flusher_stop = 0;
+        cache_flusher_wanted = 0;
+        if (0 != pthread_create(&cache_flusher_thread, NULL, cache_flusher_main, NULL)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed starting the cache flusher");
+            fs3_close_cache();
+            return(-1);
+        }
+        cache_flusher_running = 1;
+    }
     return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_close_cache
-// Description  : Close the cache, freeing any buffers held in it
+// Description  : Close the cache, freeing any buffers held in it (dirty
+//                lines must have been flushed before, they are dropped)
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_close_cache(void)  {
-    struct cache_node* node_to_free = NULL;
-    struct cache_node* current = cache_head;
+    uint32_t i = 0, dirty = 0;
+
+    // the flusher goes first, it works on the shards
+    if (cache_flusher_running) {
+        pthread_mutex_lock(&cache_flusher_lock);
+        cache_flusher_stop = 1;
+        pthread_cond_signal(&cache_flusher_work);
+        pthread_mutex_unlock(&cache_flusher_lock);
+        pthread_join(cache_flusher_thread, NULL);
+        cache_flusher_running = 0;
+    }
 
-    // navigate through cache
-    while(current != NULL) {
-        node_to_free = current;
-		current = current->next;
-        free(node_to_free);
+    // release the lines and the index of every shard
+    for (i = 0; (NULL != cache_shards) && (i < cache_shard_count); i++) {
+        dirty += cache_shards[i].dirty_count;
+        free(cache_shards[i].lines);
+        free(cache_shards[i].index);
+        pthread_mutex_destroy(&cache_shards[i].lock);
+        pthread_cond_destroy(&cache_shards[i].written);
     }
+    if (dirty > 0) {
+        logMessage(LOG_WARNING_LEVEL, "Closing cache with %u dirty lines", dirty);
+    }
+    free(cache_shards);
+    cache_shards = NULL;
+    cache_shard_count = 0;
+    cache_shard_bits = 0;
 
-	cache_head = NULL;
-	cache_tail = NULL;
+    // and the arena
+    if (NULL != cache_arena) {
+        munmap(cache_arena, cache_arena_size);
+    }
+    cache_arena = NULL;
+    cache_arena_size = 0;
+	cache_capacity = 0;
     return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_put
+// Description  : Puts a sector in a locked shard. A dirty line picked for
+//                eviction is written back with the lock released (and lines
+//                others are writing back are waited for), so the lookup is
+//                done again once it is back.
+//
+// Inputs       : s - the shard
+//                sector_id - the sector id
+//                buf - the contents of the sector
+//                keep - what to do if the sector is already cached
+//                       (CACHE_PUT_REPLACE, CACHE_PUT_KEEP, CACHE_PUT_PREFETCH)
+// Outputs      : the line, CACHE_NO_LINE if not inserted
+
+uint32_t cache_put(cache_shard *s, uint32_t sector_id, void *buf, int keep) {
+    uint32_t line = CACHE_NO_LINE;
+    uint8_t *wbuf = NULL;
+    int ghost = CACHE_NO_LIST, ret = 0;
+
+    do {
+        // already resident, copy the data in and let the policy know
+        line = fs3_get_cache_line(s, sector_id);
+        if ((CACHE_NO_LINE != line) && !CACHE_IS_GHOST(s, line)) {
+            if (keep == CACHE_PUT_REPLACE) {
+                memcpy(CACHE_LINE_DATA(s, line), buf, FS3_SECTOR_SIZE);
+                cache_ops->hit(s, line);
+            }
+            free(wbuf);
+            CACHE_COUNT(fs3_put_cache_success);
+            return(line);
+        }
+
+        // a ghost hit tells the policy the sector was evicted recently
+        if (CACHE_NO_LINE != line) {
+            ghost = s->lines[line].list;
+            release_line(s, line);
+            if (NULL != cache_ops->ghost_hit) {
+                cache_ops->ghost_hit(s, ghost);
+            }
+            CACHE_COUNT(fs3_cache_ghost_hits);
+        }
+
+        // evict a line if the cache is full, writing a dirty one back first
+        if (CACHE_EVICT_DIRTY == (ret = cache_ops->make_room(s, ghost))) {
+            if ((NULL == wbuf) && (NULL == (wbuf = malloc(CACHE_WRITEBACK_BATCH * FS3_SECTOR_SIZE)))) {
+                ret = -1;
+            } else if (-1 == writeback_lines(s, s->dirty_victim, wbuf, 0)) {
+                ret = -1;
+            }
+        } else if (CACHE_EVICT_BUSY == ret) {
+            pthread_cond_wait(&s->written, &s->lock);
+        }
+    } while ((CACHE_EVICT_DIRTY == ret) || (CACHE_EVICT_BUSY == ret));
+    free(wbuf);
+
+    // then fill a free line
+    if ((-1 == ret) || (CACHE_NO_LINE == (line = s->free))) {
+        CACHE_COUNT(fs3_put_cache_failure);
+        return (CACHE_NO_LINE);
+    }
+    s->free = s->lines[line].next;
+    s->lines[line].sector_id = sector_id;
+    s->lines[line].dirty = 0;
+    s->lines[line].prefetched = (keep == CACHE_PUT_PREFETCH);
+    s->lines[line].pins = 0;
+    memcpy(CACHE_LINE_DATA(s, line), buf, FS3_SECTOR_SIZE);
+    cache_index_insert(s, line);
+    cache_ops->insert(s, line, ghost);
+    s->size++;
+    if (keep == CACHE_PUT_PREFETCH) {
+        CACHE_COUNT(fs3_cache_prefetches);
+    }
+    CACHE_COUNT(fs3_put_cache_success);
+    return(line);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_put_cache
@@ -260,53 +1225,456 @@ int fs3_close_cache(void)  {
 // Outputs      : 0 if inserted, -1 if not inserted
 
 int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
-    struct cache_node* node = NULL;
-    uint32_t sector_id = 0;
-    //  as long there is a track/sector available, we can delete the head
-    if (NULL == (node = fs3_get_cache_node(trk, sct)))  {
-        if (get_cache_size() >= FS3_DEFAULT_CACHE_SIZE) {
-            if ((node = delete_head()) != NULL) {
-                free(node); 
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+
+    if (NULL == (s = cache_lock(CACHE_SECTOR_ID(trk, sct)))) {
+        CACHE_COUNT(fs3_put_cache_failure);
+        return (-1);
+    }
+    line = cache_put(s, CACHE_SECTOR_ID(trk, sct), buf, CACHE_PUT_REPLACE);
+    pthread_mutex_unlock(&s->lock);
+    return((line == CACHE_NO_LINE) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_put_cache_fill
+// Description  : Put a sector just read from the controller in the cache. A
+//                sector that is already cached is left alone, it is never
+//                older than the controller copy and others may be reading it.
+//
+// Inputs       : trk - the track number of the sector to put in cache
+//                sct - the sector number of the sector to put in cache
+//                buf - the contents of the sector
+// Outputs      : 0 if inserted (or already cached), -1 if not inserted
+
+int fs3_put_cache_fill(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+
+    if (NULL == (s = cache_lock(CACHE_SECTOR_ID(trk, sct)))) {
+        CACHE_COUNT(fs3_put_cache_failure);
+        return (-1);
+    }
+    line = cache_put(s, CACHE_SECTOR_ID(trk, sct), buf, CACHE_PUT_KEEP);
+    pthread_mutex_unlock(&s->lock);
+    return((line == CACHE_NO_LINE) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_put_cache_dirty
+// Description  : Put a sector written by the driver in the cache, the line
+//                is held dirty until it is written back
+//
+// Inputs       : trk - the track number of the sector to put in cache
+//                sct - the sector number of the sector to put in cache
+//                buf - the new contents of the sector
+// Outputs      : 0 if inserted, -1 if not inserted
+
+int fs3_put_cache_dirty(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+    int over = 0;
+
+    if (NULL == (s = cache_lock(CACHE_SECTOR_ID(trk, sct)))) {
+        CACHE_COUNT(fs3_put_cache_failure);
+        return (-1);
+    }
+    if (CACHE_NO_LINE == (line = cache_put(s, CACHE_SECTOR_ID(trk, sct), buf, CACHE_PUT_REPLACE))) {
+        pthread_mutex_unlock(&s->lock);
+        return(-1);
+    }
+    mark_line_dirty(s, line);
+    CACHE_COUNT(fs3_cache_dirty_writes);
+
+    // past the shard's share of the high-water mark, the flusher writes
+    // back the oldest half of its dirty data
+    over = ((s->dirty_count * FS3_SECTOR_SIZE) > shard_high_water(s));
+    pthread_mutex_unlock(&s->lock);
+    if (over) {
+        cache_flusher_wake();
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_put_cache_prefetch
+// Description  : Put a sector read ahead of use in the cache, a sector that
+//                is already cached is left alone (it may be dirty)
+//
+// Inputs       : trk - the track number of the sector to put in cache
+//                sct - the sector number of the sector to put in cache
+//                buf - the contents of the sector
+// Outputs      : 0 if inserted (or already cached), -1 if not inserted
+
+int fs3_put_cache_prefetch(FS3TrackIndex trk, FS3SectorIndex sct, void *buf) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+
+    if (NULL == (s = cache_lock(CACHE_SECTOR_ID(trk, sct)))) {
+        CACHE_COUNT(fs3_put_cache_failure);
+        return (-1);
+    }
+    line = cache_put(s, CACHE_SECTOR_ID(trk, sct), buf, CACHE_PUT_PREFETCH);
+    pthread_mutex_unlock(&s->lock);
+    return((line == CACHE_NO_LINE) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_contains
+// Description  : Check if a sector is in the cache, without counting it as
+//                an access
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : 1 if cached, 0 otherwise
+
+int fs3_cache_contains(FS3TrackIndex trk, FS3SectorIndex sct) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+    int found = 0;
+
+    if (NULL == cache_shards) {
+        return(0);
+    }
+    s = cache_shard_of(CACHE_SECTOR_ID(trk, sct));
+    pthread_mutex_lock(&s->lock);
+    line = fs3_get_cache_line(s, CACHE_SECTOR_ID(trk, sct));
+    found = (CACHE_NO_LINE != line) && !CACHE_IS_GHOST(s, line);
+    pthread_mutex_unlock(&s->lock);
+    return(found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_readahead_window
+// Description  : Record the size of a read-ahead window issued by the driver
+//
+// Inputs       : sectors - the number of sectors in the window
+// Outputs      : none
+
+void fs3_cache_readahead_window(uint32_t sectors) {
+    uint32_t max = __atomic_load_n(&fs3_cache_readahead_window_max, __ATOMIC_RELAXED);
+
+    CACHE_COUNT(fs3_cache_readahead_windows);
+    __atomic_add_fetch(&fs3_cache_readahead_window_total, sectors, __ATOMIC_RELAXED);
+    while ((sectors > max) &&
+           (!__atomic_compare_exchange_n(&fs3_cache_readahead_window_max, &max, sectors, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_cache_sector
+// Description  : Write back a sector if it is dirty in the cache
+//
+// Inputs       : trk - the track number of the sector to flush
+//                sct - the sector number of the sector to flush
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_flush_cache_sector(FS3TrackIndex trk, FS3SectorIndex sct) {
+    uint32_t id = CACHE_SECTOR_ID(trk, sct);
+
+    return(fs3_flush_cache_sectors(&id, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_cache_sectors
+// Description  : Write back the dirty ones of a list of sectors in one batch.
+//                They are copied out, marked clean and pinned under their
+//                shard locks and written with no lock held; a line dirtied
+//                again meanwhile goes back on the dirty list.
+//
+// Inputs       : ids - the sector ids (trk*1024+sct)
+//                n - the number of sectors, at most a batch
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_flush_cache_sectors(uint32_t *ids, uint16_t n) {
+    uint32_t send_ids[CACHE_WRITEBACK_BATCH], lines[CACHE_WRITEBACK_BATCH];
+    void *bufs[CACHE_WRITEBACK_BATCH];
+    cache_shard *s = NULL;
+    uint8_t *buf = NULL;
+    uint32_t line = CACHE_NO_LINE, i = 0, j = 0, k = 0;
+    int ret = 0;
+
+    if ((NULL == cache_shards) || (0 == n)) {
+        return(0);
+    }
+    if ((n > CACHE_WRITEBACK_BATCH) || (NULL == (buf = malloc(((size_t) n) * FS3_SECTOR_SIZE)))) {
+        return(-1);
+    }
+    for (i = 0; i < n; i++) {
+        // a sector listed twice is already on its way
+        for (j = 0; (j < k) && (send_ids[j] != ids[i]); j++);
+        if (j < k) {
+            continue;
+        }
+        s = cache_shard_of(ids[i]);
+        pthread_mutex_lock(&s->lock);
+        while ((CACHE_NO_LINE != (line = fs3_get_cache_line(s, ids[i]))) && (s->lines[line].writing)) {
+            pthread_cond_wait(&s->written, &s->lock);
+        }
+        if ((CACHE_NO_LINE != line) && (!CACHE_IS_GHOST(s, line)) && (s->lines[line].dirty)) {
+            send_ids[k] = ids[i];
+            lines[k] = line;
+            bufs[k] = &buf[((size_t) k) * FS3_SECTOR_SIZE];
+            memcpy(bufs[k], CACHE_LINE_DATA(s, line), FS3_SECTOR_SIZE);
+            mark_line_clean(s, line);
+            s->lines[line].writing = 1;
+            s->lines[line].pins++;
+            s->writing++;
+            k++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (k > 0) {
+        ret = send_sectors(send_ids, bufs, k);
+    }
+
+    for (i = 0; i < k; i++) {
+        s = cache_shard_of(send_ids[i]);
+        pthread_mutex_lock(&s->lock);
+        s->lines[lines[i]].writing = 0;
+        s->lines[lines[i]].pins--;
+        if (ret == -1) {
+            mark_line_dirty(s, lines[i]);
+        } else {
+            CACHE_COUNT(fs3_cache_writebacks);
+        }
+        s->writing--;
+        pthread_cond_broadcast(&s->written);
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(buf);
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_invalidate
+// Description  : Drop a sector from the cache without writing it back, the
+//                driver no longer has a use for its contents. A pinned
+//                line is taken out of the index and freed by its last unpin.
+//
+// Inputs       : trk - the track number of the sector to drop
+//                sct - the sector number of the sector to drop
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_cache_invalidate(FS3TrackIndex trk, FS3SectorIndex sct) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+
+    if (NULL == cache_shards) {
+        return(0);
+    }
+    s = cache_shard_of(CACHE_SECTOR_ID(trk, sct));
+    pthread_mutex_lock(&s->lock);
+    // the flusher's write of the old contents lands before the sector is
+    // given out again
+    while ((CACHE_NO_LINE != (line = fs3_get_cache_line(s, CACHE_SECTOR_ID(trk, sct)))) &&
+           (s->lines[line].writing)) {
+        pthread_cond_wait(&s->written, &s->lock);
+    }
+    if (CACHE_NO_LINE != line) {
+        mark_line_clean(s, line);
+        if (CACHE_IS_GHOST(s, line) || (0 == s->lines[line].pins)) {
+            release_line(s, line);
+        } else {
+            // a pinned line leaves the index now, the sector can be cached
+            // again at once, and the last unpin frees it
+            list_remove(s, line);
+            cache_index_remove(s, line);
+            s->lines[line].doomed = 1;
+        }
+        CACHE_COUNT(fs3_cache_invalidations);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_cache
+// Description  : Write back every dirty line in the cache, a batch at a time
+//                with its shard lock released
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_flush_cache(void) {
+    cache_shard *s = NULL;
+    uint8_t *buf = NULL;
+    uint32_t i = 0;
+    int ret = 0;
+
+    if ((0 == cache_shard_count) || (NULL == (buf = malloc(CACHE_WRITEBACK_BATCH * FS3_SECTOR_SIZE)))) {
+        return((0 == cache_shard_count) ? 0 : -1);
+    }
+    for (i = 0; (i < cache_shard_count) && (ret != -1); i++) {
+        s = &cache_shards[i];
+        pthread_mutex_lock(&s->lock);
+        while (((s->dirty_head != CACHE_NO_LINE) || (s->writing > 0)) && (ret != -1)) {
+            // lines already on their way are waited for, not sent again
+            if (0 == (ret = writeback_lines(s, CACHE_NO_LINE, buf, 0))) {
+                pthread_cond_wait(&s->written, &s->lock);
             }
         }
-        // calculating the sector index
-	    sector_id = ((trk)*1024) + sct;
-        // return -1 if we are able to insert cache to the end of the cache node
-        if (1 == insert_tail(sector_id, buf)) {
-            fs3_put_cache_failure++;
-            return (-1);
-        } // else return 0
-        fs3_put_cache_success++;
-        return (0);
-    }
-    // copy the data from the buffer to the cache pointer in use
-    memcpy(node->sector_data ,buf, FS3_SECTOR_SIZE);
-    // moves the cache pointer to the tail of the cache node
-	move_node_to_tail(node);
-    fs3_put_cache_success++;
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(buf);
+    return((ret == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_writeback
+// Description  : Set the function used to write dirty lines to the controller
+//
+// Inputs       : fn - the writeback function
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_writeback(fs3_cache_writeback_t fn) {
+    cache_writeback = fn;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_set_cache_writeback_batch
+// Description  : Set the function used to write a batch of dirty lines back
+//                to the controller when flushing
+//
+// Inputs       : fn - the batch write back function (NULL to write back a
+//                     line at a time)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_set_cache_writeback_batch(fs3_cache_writeback_batch_t fn) {
+    cache_writeback_batch = fn;
     return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : fs3_get_cache
-// Description  : Get an element from the cache (
+// Description  : Get an element from the cache (the line can be evicted by
+//                another thread once this returns, use fs3_cache_pin when
+//                the cache is shared)
 //
 // Inputs       : trk - the track number of the sector to find
 //                sct - the sector number of the sector to find
 // Outputs      : returns NULL if not found or failed, pointer to buffer if found
 
 void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
-    struct cache_node* node = NULL;
-    // as long as the cache isn't empty, the cache will be allowed to get current set of cache pointers
-    if (NULL == (node = fs3_get_cache_node(trk, sct)))  {
-        fs3_get_cache_failure++;
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+    void *data = NULL;
+
+    if (NULL == cache_shards) {
+        CACHE_COUNT(fs3_get_cache_failure);
+        return (NULL);
+    }
+    s = cache_shard_of(CACHE_SECTOR_ID(trk, sct));
+    pthread_mutex_lock(&s->lock);
+    // ghost entries have no data, they count as misses
+    line = fs3_get_cache_line(s, CACHE_SECTOR_ID(trk, sct));
+    if ((CACHE_NO_LINE == line) || CACHE_IS_GHOST(s, line))  {
+        pthread_mutex_unlock(&s->lock);
+        CACHE_COUNT(fs3_get_cache_failure);
+        return (NULL);
+    }
+
+	cache_ops->hit(s, line);
+    note_prefetch_use(s, line);
+    data = CACHE_LINE_DATA(s, line);
+    pthread_mutex_unlock(&s->lock);
+    CACHE_COUNT(fs3_get_cache_success);
+    return(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_pin
+// Description  : Get a read-only reference to a cached sector, the line
+//                stays in the cache until it is unpinned
+//
+// Inputs       : trk - the track number of the sector to find
+//                sct - the sector number of the sector to find
+// Outputs      : returns NULL if not found, pointer to the sector data if
+//                found (it is given back to fs3_cache_unpin)
+
+const void * fs3_cache_pin(FS3TrackIndex trk, FS3SectorIndex sct) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE;
+    void *data = NULL;
+
+    if (NULL == cache_shards) {
+        CACHE_COUNT(fs3_get_cache_failure);
+        return (NULL);
+    }
+    s = cache_shard_of(CACHE_SECTOR_ID(trk, sct));
+    pthread_mutex_lock(&s->lock);
+    line = fs3_get_cache_line(s, CACHE_SECTOR_ID(trk, sct));
+    if ((CACHE_NO_LINE == line) || CACHE_IS_GHOST(s, line))  {
+        pthread_mutex_unlock(&s->lock);
+        CACHE_COUNT(fs3_get_cache_failure);
         return (NULL);
     }
 
-	move_node_to_tail(node);
-    fs3_get_cache_success++;
-    return(node->sector_data);
+    cache_ops->hit(s, line);
+    note_prefetch_use(s, line);
+    s->lines[line].pins++;
+    data = CACHE_LINE_DATA(s, line);
+    pthread_mutex_unlock(&s->lock);
+    CACHE_COUNT(fs3_get_cache_success);
+    return(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_cache_unpin
+// Description  : Release a reference taken with fs3_cache_pin, the line is
+//                found from where its data is in the arena so a line
+//                invalidated meanwhile is released and not a newer one
+//
+// Inputs       : data - the sector data fs3_cache_pin gave
+// Outputs      : 0 if successful, -1 if the sector was not pinned
+
+int fs3_cache_unpin(const void *data) {
+    cache_shard *s = NULL;
+    uint32_t line = CACHE_NO_LINE, i = 0;
+    int ret = 0;
+
+    if ((NULL == cache_shards) || (NULL == data)) {
+        return(-1);
+    }
+    for (i = 0; i < cache_shard_count; i++) {
+        s = &cache_shards[i];
+        if (((const uint8_t *) data >= s->arena) &&
+            ((const uint8_t *) data < s->arena + ((size_t) s->capacity) * FS3_SECTOR_SIZE)) {
+            line = ((const uint8_t *) data - s->arena) / FS3_SECTOR_SIZE;
+            break;
+        }
+    }
+    if (CACHE_NO_LINE == line) {
+        return(-1);
+    }
+    pthread_mutex_lock(&s->lock);
+    if (0 == s->lines[line].pins) {
+        ret = -1;
+    } else if ((0 == --s->lines[line].pins) && (s->lines[line].doomed)) {
+        // the last pin of an invalidated line, it can be used again
+        s->lines[line].doomed = 0;
+        s->lines[line].next = s->free;
+        s->free = line;
+        s->size--;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return(ret);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -318,8 +1686,29 @@ void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct)  {
 // Outputs      : 0 if successful, -1 if failure
 
 int fs3_log_cache_metrics(void) {
+    uint32_t gets = fs3_get_cache_success + fs3_get_cache_failure;
+
+    printf("fs3_cache policy: %s, lines: %u, shards: %u \n", (cache_ops != NULL) ? cache_ops->name : "none",
+           cache_capacity, cache_shard_count);
     printf("fs3_get_cache hits count: %d \n",fs3_get_cache_success);
     printf("fs3_get_cache misses count: %d \n",fs3_get_cache_failure);
+    printf("fs3_get_cache hit ratio: %.2f%% \n", (gets > 0) ? (100.0 * fs3_get_cache_success) / gets : 0.0);
+    printf("fs3_cache evictions count: %d, ghost hits count: %d, invalidations count: %d \n",
+           fs3_cache_evictions, fs3_cache_ghost_hits, fs3_cache_invalidations);
+    printf("fs3_cache %s, dirty writes count: %d \n",
+           (fs3_cache_write_through) ? "write-through" : "write-back", fs3_cache_dirty_writes);
+    printf("fs3_cache writebacks count: %d, in the background count: %d \n",
+           fs3_cache_writebacks, fs3_cache_background_writebacks);
+    printf("fs3_cache writebacks avoided count: %d \n",
+           (fs3_cache_dirty_writes > fs3_cache_writebacks) ? fs3_cache_dirty_writes - fs3_cache_writebacks : 0);
+    printf("fs3_cache prefetches count: %d, prefetch hits count: %d, wasted prefetches count: %d \n",
+           fs3_cache_prefetches, fs3_cache_prefetch_hits, fs3_cache_prefetch_wasted);
+    printf("fs3_cache read-ahead windows count: %d, average window: %.2f, max window: %d \n",
+           fs3_cache_readahead_windows,
+           (fs3_cache_readahead_windows > 0) ? ((double) fs3_cache_readahead_window_total) / fs3_cache_readahead_windows : 0.0,
+           fs3_cache_readahead_window_max);
+    if (fs3_cache_writeback_failures > 0) {
+        printf("fs3_cache writeback failures count: %d \n",fs3_cache_writeback_failures);
+    }
     return(0); // returns 0 if the metrics return is successful
 }
-
@@ -17,11 +17,35 @@
 // Defines
 #define FS3_DEFAULT_CACHE_SIZE 2048 // 256 cache entries, by default
 
+// Cache replacement policies
+typedef enum {
+
+	FS3_CACHE_LRU      = 0, // Least recently used
+	FS3_CACHE_2Q       = 1, // 2Q (scan resistant FIFO + LRU with ghost list)
+	FS3_CACHE_ARC      = 2, // Adaptive replacement cache
+	FS3_CACHE_MAXPOLICY = 3 // Number of policies
+
+} FS3CachePolicy;
+
+// Function used to write a dirty sector back to the controller
+typedef int (*fs3_cache_writeback_t)(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+
+// Function used to write a batch of dirty sectors back to the controller
+typedef int (*fs3_cache_writeback_batch_t)(uint32_t *ids, void **bufs, uint16_t n);
+
+// Global data
+extern FS3CachePolicy fs3_cache_policy; // Replacement policy used by fs3_init_cache
+extern int fs3_cache_huge_pages;    // Back the cache arena with huge pages
+extern int fs3_cache_write_through; // Driver writes go straight to the controller
+extern uint32_t fs3_cache_dirty_high_water; // Dirty bytes before flushing (0 = half the cache)
+extern uint32_t fs3_cache_shards;   // Shards the cache is split into (0 = by size)
+
 //
 // Cache Functions
 
-int fs3_init_cache(uint16_t cachelines);
-    // Initialize the cache with a fixed number of cache lines
+int fs3_init_cache(uint32_t cachelines);
+    // Initialize the cache with a fixed number of cache lines (all lines are
+    // allocated here, 0 selects FS3_DEFAULT_CACHE_SIZE)
 
 int fs3_close_cache(void);
     // Close the cache, freeing any buffers held in it
@@ -30,7 +54,51 @@ int fs3_put_cache(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
     // Put an element in the cache
 
 void * fs3_get_cache(FS3TrackIndex trk, FS3SectorIndex sct);
-    // Get an element from the cache (returns NULL if not found)
+    // Get an element from the cache (returns NULL if not found, the data
+    // is only stable while no other thread uses the cache)
+
+const void * fs3_cache_pin(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Get a read-only reference to an element, it is not evicted until
+    // unpinned (returns NULL if not found)
+
+int fs3_cache_unpin(const void *data);
+    // Release a reference taken with fs3_cache_pin, given the data it returned
+
+int fs3_put_cache_fill(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+    // Put an element read from the controller in the cache (kept if already cached)
+
+int fs3_put_cache_dirty(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+    // Put a written element in the cache, held dirty until written back
+
+int fs3_put_cache_prefetch(FS3TrackIndex trk, FS3SectorIndex sct, void *buf);
+    // Put an element read ahead of use in the cache (kept if already cached)
+
+int fs3_cache_contains(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Check if an element is cached, without counting an access
+
+void fs3_cache_readahead_window(uint32_t sectors);
+    // Record the size of a read-ahead window for the metrics
+
+int fs3_flush_cache_sector(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Write back an element if it is dirty
+
+int fs3_flush_cache_sectors(uint32_t *ids, uint16_t n);
+    // Write back the dirty ones of a list of elements in one batch
+
+int fs3_cache_invalidate(FS3TrackIndex trk, FS3SectorIndex sct);
+    // Drop an element without writing it back (its sector is no longer used)
+
+int fs3_flush_cache(void);
+    // Write back all dirty elements
+
+int fs3_set_cache_writeback(fs3_cache_writeback_t fn);
+    // Set the function used to write dirty elements to the controller
+
+int fs3_set_cache_writeback_batch(fs3_cache_writeback_batch_t fn);
+    // Set the function used to write a batch of dirty elements when flushing
+
+int fs3_cache_policy_by_name(const char *name);
+    // Find a replacement policy by name (lru, 2q, arc), -1 if unknown
 
 int fs3_log_cache_metrics(void);
     // Log the metrics for the cache 
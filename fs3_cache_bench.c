@@ -0,0 +1,206 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_cache_bench.c
+//  Description    : This is a microbenchmark of the FS3 sector cache. For
+//                   cache sizes from 256 lines up to the given number it
+//                   runs read-through lookups over a working set twice the
+//                   size of the cache, then inserts that each evict a line,
+//                   and reports the throughput, hit rate and the cost of an
+//                   eviction.
+//
+//  Author         : Sarah Babu
+//  Last Modified  : 11/19/2021
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_controller.h>
+#include <fs3_cache.h>
+
+//
+// Defines
+#define FS3_CACHE_BENCH_ARGUMENTS "hn:o:e:k:"
+#define USAGE \
+	"USAGE: fs3_cache_bench [-h] [-n <lines>] [-o <operations>] [-e <policy>] [-k <shards>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -n - largest cache size in lines, sizes go up by four times from 256 (default 65536)\n" \
+	"    -o - lookups run at each size (default 2000000)\n" \
+	"    -e - cache replacement policy (lru, 2q or arc)\n" \
+	"    -k - number of cache shards, a power of two (0 sizes them by the cache)\n" \
+	"\n"
+
+#define FS3_CACHE_BENCH_SMALLEST 256 // first cache size run
+#define FS3_CACHE_BENCH_WORKING_SET 2 // working set over the cache size
+
+// the sector of a sector id, the cache key is trk*1024+sct
+#define BENCH_TRACK(id) ((FS3TrackIndex) ((id) / FS3_TRACK_SIZE))
+#define BENCH_SECTOR(id) ((FS3SectorIndex) ((id) % FS3_TRACK_SIZE))
+
+//
+// Functional Prototypes
+
+double bench_seconds(struct timespec *start);
+	// Gives the seconds since start
+
+int bench_size(uint32_t lines, uint32_t ops);
+	// Runs the benchmark on one cache size
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 cache benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+	int ch, policy = 0;
+	uint32_t most = 65536, ops = 2000000, lines = 0;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, FS3_CACHE_BENCH_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf(stderr, USAGE);
+			return(-1);
+
+		case 'n': // Set the largest cache size
+			if ((sscanf(optarg, "%u", &most) != 1) || (most < FS3_CACHE_BENCH_SMALLEST)) {
+				fprintf(stderr, "Bad cache size [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'o': // Set the lookups at each size
+			if ((sscanf(optarg, "%u", &ops) != 1) || (ops == 0)) {
+				fprintf(stderr, "Bad number of operations [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'e': // Set the cache replacement policy
+			if ((policy = fs3_cache_policy_by_name(optarg)) == -1) {
+				fprintf(stderr, "Unknown cache policy [%s]\n", optarg);
+				return(-1);
+			}
+			fs3_cache_policy = (FS3CachePolicy) policy;
+			break;
+
+		case 'k': // Set the number of cache shards
+			if ((sscanf(optarg, "%u", &fs3_cache_shards) != 1) ||
+			    ((fs3_cache_shards & (fs3_cache_shards - 1)) != 0)) {
+				fprintf(stderr, "Bad number of cache shards [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return(-1);
+		}
+	}
+	initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+
+	printf("%10s %12s %8s %14s %14s\n", "lines", "ops/sec", "hit %", "evict ns/put", "update ns/put");
+	for (lines = FS3_CACHE_BENCH_SMALLEST; lines <= most; lines *= 4) {
+		if (-1 == bench_size(lines, ops)) {
+			return(-1);
+		}
+		// the largest size is run even if it is not a step
+		if ((lines < most) && (lines * 4 > most)) {
+			lines = most / 4;
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_seconds
+// Description  : Gives the seconds since a start time
+//
+// Inputs       : start - the start time
+// Outputs      : the seconds
+
+double bench_seconds(struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return((end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_size
+// Description  : Runs the benchmark on one cache size. The lookups are
+//                read-through, a miss puts the sector in the cache. Then
+//                sectors never seen are put in, each evicting a line, and
+//                the sectors left cached are put again, updating in place.
+//
+// Inputs       : lines - the cache size in lines
+//                ops - the number of lookups
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_size(uint32_t lines, uint32_t ops) {
+	uint8_t buf[FS3_SECTOR_SIZE];
+	uint32_t i = 0, id = 0, hits = 0, seed = lines;
+	uint32_t working = lines * FS3_CACHE_BENCH_WORKING_SET;
+	uint32_t fresh = working; // first sector id never used
+	struct timespec start;
+	double lookup = 0, evict = 0, update = 0;
+
+	if (-1 == fs3_init_cache(lines)) {
+		return(-1);
+	}
+	memset(buf, 'c', sizeof(buf));
+
+	// warm the cache, then look up over the working set
+	for (i = 0; i < lines; i++) {
+		fs3_put_cache(BENCH_TRACK(i), BENCH_SECTOR(i), buf);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ops; i++) {
+		id = rand_r(&seed) % working;
+		if (NULL != fs3_get_cache(BENCH_TRACK(id), BENCH_SECTOR(id))) {
+			hits++;
+		} else if (-1 == fs3_put_cache(BENCH_TRACK(id), BENCH_SECTOR(id), buf)) {
+			fs3_close_cache();
+			return(-1);
+		}
+	}
+	lookup = bench_seconds(&start);
+
+	// every put of a new sector evicts one
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lines; i++) {
+		id = fresh + i;
+		fs3_put_cache(BENCH_TRACK(id), BENCH_SECTOR(id), buf);
+	}
+	evict = bench_seconds(&start);
+
+	// those sectors are all cached now, put them again
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lines; i++) {
+		id = fresh + i;
+		fs3_put_cache(BENCH_TRACK(id), BENCH_SECTOR(id), buf);
+	}
+	update = bench_seconds(&start);
+
+	printf("%10u %12.0f %8.2f %14.1f %14.1f\n", lines, (lookup > 0) ? ops / lookup : 0.0,
+	       (100.0 * hits) / ops, (evict * 1e9) / lines, (update * 1e9) / lines);
+	fs3_close_cache();
+	return(0);
+}
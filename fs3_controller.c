@@ -0,0 +1,243 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_controller.c
+//  Description    : This is an implementation of the FS3 controller over a
+//                   memory mapped disk image. It runs the MOUNT, TSEEK,
+//                   RDSECT, WRSECT and UMOUNT commands the way the controller
+//                   server does, so the filesystem can run without it, and
+//                   the multi-sector RDSECTS, WRSECTS and RDTRACK commands.
+//
+//  Author         : Sarah Babu
+//  Last Modified  : 11/19/2021
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_controller.h>
+#include <fs3_common.h>
+
+//
+// Defines
+
+// size of the whole disk
+#define FS3_DISK_SIZE ((size_t) FS3_MAX_TRACKS * FS3_TRACK_SIZE * FS3_SECTOR_SIZE)
+
+// fields of a command block
+#define CMD_OP(c) ((uint8_t) (((c) >> 60) & 0xf))
+#define CMD_SEC(c) ((uint16_t) (((c) >> 44) & 0xffff))
+#define CMD_TRK(c) ((uint32_t) (((c) >> 12) & 0xffffffff))
+#define CMD_RET_BIT (((FS3CmdBlk) 1) << 11)
+#define CMD_COUNT(c) ((uint16_t) ((c) & FS3_CMD_COUNT_MASK))
+
+//
+// Global data
+
+char *fs3_controller_image = FS3_DEFAULT_IMAGE; // disk image file, NULL for memory only
+uint8_t *fs3_disk = NULL; // the mapped disk
+int fs3_disk_fd = -1;
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_controller_open
+// Description  : Maps the disk image, creating it (or growing it to the disk
+//                size) if needed
+//
+// Inputs       : image - the disk image file, NULL for an anonymous disk
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_controller_open(const char *image) {
+    struct stat st;
+
+    if (fs3_disk != NULL) {
+        return(0);
+    }
+
+    if (image == NULL) {
+        fs3_disk = mmap(NULL, FS3_DISK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        if (-1 == (fs3_disk_fd = open(image, O_RDWR | O_CREAT, 0644))) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 controller failed to open disk image [%s]", image);
+            return(-1);
+        }
+        if ((-1 == fstat(fs3_disk_fd, &st)) ||
+            ((st.st_size < (off_t) FS3_DISK_SIZE) && (-1 == ftruncate(fs3_disk_fd, FS3_DISK_SIZE)))) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 controller failed to size disk image [%s]", image);
+            close(fs3_disk_fd);
+            fs3_disk_fd = -1;
+            return(-1);
+        }
+        fs3_disk = mmap(NULL, FS3_DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fs3_disk_fd, 0);
+    }
+
+    if (fs3_disk == MAP_FAILED) {
+        logMessage(LOG_ERROR_LEVEL, "FS3 controller failed to map the disk");
+        fs3_disk = NULL;
+        if (fs3_disk_fd != -1) {
+            close(fs3_disk_fd);
+            fs3_disk_fd = -1;
+        }
+        return(-1);
+    }
+    logMessage(FS3ControllerLLevel, "FS3 controller mapped disk [%s]", (image != NULL) ? image : "memory");
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_controller_close
+// Description  : Unmaps the disk image
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_controller_close(void) {
+    int ret = 0;
+
+    if (fs3_disk == NULL) {
+        return(0);
+    }
+    if (-1 == munmap(fs3_disk, FS3_DISK_SIZE)) {
+        ret = -1;
+    }
+    fs3_disk = NULL;
+    if (fs3_disk_fd != -1) {
+        close(fs3_disk_fd);
+        fs3_disk_fd = -1;
+    }
+    return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_controller_execute
+// Description  : Runs one command against the disk. The reply is the
+//                command block with the return bit set on failure. A
+//                failed seek leaves the client on no track, so the sector
+//                commands pipelined behind it fail too until the next
+//                seek instead of landing on the old track.
+//
+// Inputs       : ctx - the state of the client sending the command
+//                cmd - the command block
+//                buf - the sector to read into or write from
+// Outputs      : the reply command block
+
+FS3CmdBlk fs3_controller_execute(FS3ControllerContext *ctx, FS3CmdBlk cmd, void *buf) {
+    uint8_t op = CMD_OP(cmd);
+    uint16_t sec = CMD_SEC(cmd);
+    uint32_t trk = CMD_TRK(cmd);
+    uint16_t count = CMD_COUNT(cmd);
+    uint8_t *sector = NULL;
+
+    cmd &= ~CMD_RET_BIT;
+
+    // tagged commands run in any order, so each sector command seeks itself
+    if ((ctx->tagged) && (op != FS3_OP_TSEEK) && (op != FS3_OP_RDTRACK) && (fs3_controller_cmd_sectors(cmd) > 0)) {
+        ctx->track = (trk < FS3_MAX_TRACKS) ? trk : FS3_NO_TRACK;
+    }
+
+    switch (op) {
+    case FS3_OP_MOUNT:
+        if ((ctx->mounted) || (fs3_disk == NULL)) {
+            return(cmd | CMD_RET_BIT);
+        }
+        ctx->mounted = 1;
+        ctx->track = FS3_NO_TRACK;
+        ctx->tagged = (cmd & FS3_MOUNT_TAGGED) ? 1 : 0;
+        // the multi-sector opcodes and tags are always there, so the flags are echoed
+        return(cmd & (~(FS3CmdBlk) FS3_CMD_COUNT_MASK | FS3_MOUNT_MULTISECTOR | FS3_MOUNT_TAGGED));
+
+    case FS3_OP_TSEEK:
+        if ((!ctx->mounted) || (trk >= FS3_MAX_TRACKS)) {
+            ctx->track = FS3_NO_TRACK;
+            return(cmd | CMD_RET_BIT);
+        }
+        ctx->track = trk;
+        return(cmd);
+
+    case FS3_OP_RDSECT:
+    case FS3_OP_WRSECT:
+        if ((!ctx->mounted) || (ctx->track == FS3_NO_TRACK) || (sec >= FS3_TRACK_SIZE) || (buf == NULL)) {
+            return(cmd | CMD_RET_BIT);
+        }
+        sector = &fs3_disk[((size_t) ctx->track * FS3_TRACK_SIZE + sec) * FS3_SECTOR_SIZE];
+        if (op == FS3_OP_RDSECT) {
+            memcpy(buf, sector, FS3_SECTOR_SIZE);
+        } else {
+            memcpy(sector, buf, FS3_SECTOR_SIZE);
+        }
+        return(cmd);
+
+    case FS3_OP_RDSECTS:
+    case FS3_OP_WRSECTS:
+        if ((!ctx->mounted) || (ctx->track == FS3_NO_TRACK) || (count == 0) ||
+            (sec + count > FS3_TRACK_SIZE) || (buf == NULL)) {
+            return(cmd | CMD_RET_BIT);
+        }
+        sector = &fs3_disk[((size_t) ctx->track * FS3_TRACK_SIZE + sec) * FS3_SECTOR_SIZE];
+        if (op == FS3_OP_RDSECTS) {
+            memcpy(buf, sector, (size_t) count * FS3_SECTOR_SIZE);
+        } else {
+            memcpy(sector, buf, (size_t) count * FS3_SECTOR_SIZE);
+        }
+        return(cmd);
+
+    case FS3_OP_RDTRACK:
+        if ((!ctx->mounted) || (trk >= FS3_MAX_TRACKS) || (buf == NULL)) {
+            ctx->track = FS3_NO_TRACK;
+            return(cmd | CMD_RET_BIT);
+        }
+        ctx->track = trk;
+        memcpy(buf, &fs3_disk[(size_t) trk * FS3_TRACK_SIZE * FS3_SECTOR_SIZE], (size_t) FS3_TRACK_SIZE * FS3_SECTOR_SIZE);
+        return(cmd);
+
+    case FS3_OP_UMOUNT:
+        if (!ctx->mounted) {
+            return(cmd | CMD_RET_BIT);
+        }
+        ctx->mounted = 0;
+        ctx->tagged = 0;
+        ctx->track = FS3_NO_TRACK;
+        return(cmd);
+
+    default:
+        return(cmd | CMD_RET_BIT);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_controller_cmd_sectors
+// Description  : Gives the number of sectors of data a command moves, they
+//                follow the command for writes and the reply for reads
+//
+// Inputs       : cmd - the command block
+// Outputs      : number of sectors
+
+uint32_t fs3_controller_cmd_sectors(FS3CmdBlk cmd) {
+    switch (CMD_OP(cmd)) {
+    case FS3_OP_RDSECT:
+    case FS3_OP_WRSECT:
+        return(1);
+
+    case FS3_OP_RDSECTS:
+    case FS3_OP_WRSECTS:
+        return(CMD_COUNT(cmd));
+
+    case FS3_OP_RDTRACK:
+        return(FS3_TRACK_SIZE);
+
+    default:
+        return(0);
+    }
+}
@@ -19,6 +19,16 @@
 #define FS3_TRACK_SIZE 1024
 #define FS3_SECTOR_SIZE 1024
 #define FS3_NO_TRACK (FS3_MAX_TRACKS+0xff)
+#define FS3_DEFAULT_IMAGE "fs3_disk.img"
+
+// The low bits of a command block hold the sector count of RDSECTS and
+// WRSECTS. On MOUNT the client sets FS3_MOUNT_MULTISECTOR to ask for the
+// multi-sector opcodes, and a controller that has them echoes it back.
+// FS3_MOUNT_TAGGED asks for tagged commands: every command and reply
+// after the MOUNT starts with a tag, and sector commands carry their track.
+#define FS3_CMD_COUNT_MASK 0x7ff
+#define FS3_MOUNT_MULTISECTOR 0x1
+#define FS3_MOUNT_TAGGED 0x2
 
 // Type definitions
 typedef uint64_t FS3CmdBlk;                 // The command block base data type
@@ -36,12 +46,38 @@ typedef enum {
 	FS3_OP_RDSECT = 2,  // Read a sector from the disk
 	FS3_OP_WRSECT = 3,  // Write a sector to the disk
 	FS3_OP_UMOUNT = 4,  // Unmount the ffilesystem
-	FS3_OP_MAXVAL = 5   // Maximum opcode value
+	FS3_OP_RDSECTS = 5, // Read a run of sectors from the current track
+	FS3_OP_WRSECTS = 6, // Write a run of sectors to the current track
+	FS3_OP_RDTRACK = 7, // Seek to a track and read all of it (the driver does not send it)
+	FS3_OP_MAXVAL = 8   // Maximum opcode value
 
 } FS3OpCodes;
 
+// The state the controller keeps for each client
+typedef struct {
+	uint32_t track;   // Current track, FS3_NO_TRACK until a seek
+	uint8_t mounted;  // The client has mounted the disk
+	uint8_t tagged;   // Commands are tagged, sector commands carry their track
+} FS3ControllerContext;
+
+//
+// Global data
+extern char *fs3_controller_image; // Disk image of the local controller (NULL for memory)
+
 //
 // Functional Prototypes
 
+int fs3_controller_open(const char *image);
+	// Map the disk image of the local controller
+
+int fs3_controller_close(void);
+	// Unmap the disk image of the local controller
+
+FS3CmdBlk fs3_controller_execute(FS3ControllerContext *ctx, FS3CmdBlk cmd, void *buf);
+	// Run one command on the local controller, returns the reply block
+
+uint32_t fs3_controller_cmd_sectors(FS3CmdBlk cmd);
+	// Number of sectors of data a command moves
+
 
 #endif
@@ -0,0 +1,590 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_controller_server.c
+//  Description    : This is the FS3 controller server. It serves the disk
+//                   (a memory mapped image file) to any number of clients
+//                   over the same wire protocol as the network client: a
+//                   big-endian 64-bit command block, followed by the
+//                   sectors of a write, answered by a command block,
+//                   followed by the sectors of a read. On a connection that
+//                   mounted with tags, each command and reply starts with
+//                   the tag of the request. All connections are handled by one
+//                   epoll loop, each with its own mount state and track.
+//
+//  Author         : Sarah Babu
+//  Last Modified  : 11/19/2021
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_controller.h>
+#include <fs3_common.h>
+#include <fs3_network.h>
+
+//
+// Defines
+#define FS3_SERVER_ARGUMENTS "hvp:d:r:l:"
+#define USAGE \
+	"USAGE: fs3_controller_server [-h] [-v] [-p <port>] [-d <disk image>] [-r <seconds>] [-l <logfile>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -p - port number to listen on (default 22887)\n" \
+	"    -d - disk image file (default fs3_disk.img)\n" \
+	"    -r - print the statistics every <seconds> (default only at exit)\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"\n"
+
+#define FS3_SERVER_BACKLOG 128      // pending connections on the listen socket
+#define FS3_SERVER_EVENTS 64        // events taken per epoll_wait
+#define FS3_SERVER_INBUF (64*1024)  // first size of the buffers of a client
+#define FS3_SERVER_OUTMAX (1024*1024) // stop reading a client with this much unsent
+
+#define htonll64(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
+#define ntohll64(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
+
+// A client connection
+typedef struct fs3_connection {
+	int fd;
+	FS3ControllerContext ctx;    // mount state and track of the client
+	uint8_t *in;                 // bytes read and not yet run
+	uint32_t in_len, in_cap;
+	uint8_t *out;                // replies not yet sent
+	uint32_t out_off, out_len, out_cap;
+	uint32_t events;             // events the connection is registered for
+} fs3_connection;
+
+// Statistics of an opcode
+typedef struct {
+	uint64_t count;
+	uint64_t failures;
+	uint64_t total_ns;  // time spent running the commands
+	uint64_t max_ns;
+} fs3_op_stats;
+
+//
+// Global data
+int epoll_fd = -1;
+volatile sig_atomic_t server_stop = 0;
+fs3_op_stats op_interval[FS3_OP_MAXVAL]; // since the last report
+fs3_op_stats op_totals[FS3_OP_MAXVAL];   // since the server started
+uint64_t clients_served = 0;
+uint32_t clients_connected = 0;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : now_ns
+// Description  : Reads the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in nanoseconds
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : print_stats
+// Description  : Prints the operations per second and latency of each
+//                opcode
+//
+// Inputs       : op_stats - the statistics to print
+//                elapsed_ns - time covered by the statistics
+//                final - this is the report at exit
+// Outputs      : none
+
+void print_stats(fs3_op_stats *op_stats, uint64_t elapsed_ns, int final) {
+	static const char *names[FS3_OP_MAXVAL] = { "MOUNT", "TSEEK", "RDSECT", "WRSECT", "UMOUNT",
+		"RDSECTS", "WRSECTS", "RDTRACK" };
+	double secs = (elapsed_ns > 0) ? elapsed_ns / 1e9 : 1.0;
+	uint64_t total = 0;
+	int i = 0;
+
+	printf("fs3_controller_server %s: %.2f sec, clients connected: %u, served: %lu \n",
+	       (final) ? "totals" : "interval", secs, clients_connected, (unsigned long) clients_served);
+	for (i = 0; i < FS3_OP_MAXVAL; i++) {
+		if (op_stats[i].count == 0) {
+			continue;
+		}
+		total += op_stats[i].count;
+		printf("  %-7s count: %lu, failures: %lu, ops/sec: %.0f, avg latency: %.2f us, max latency: %.2f us \n",
+		       names[i], (unsigned long) op_stats[i].count, (unsigned long) op_stats[i].failures,
+		       op_stats[i].count / secs, op_stats[i].total_ns / 1e3 / op_stats[i].count, op_stats[i].max_ns / 1e3);
+	}
+	printf("  all     count: %lu, ops/sec: %.0f \n", (unsigned long) total, total / secs);
+	fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : record_op
+// Description  : Adds a command to the statistics of its opcode
+//
+// Inputs       : stats - the statistics
+//                took - time spent running the command
+//                ret - the reply command block
+// Outputs      : none
+
+void record_op(fs3_op_stats *stats, uint64_t took, FS3CmdBlk ret) {
+	stats->count++;
+	stats->total_ns += took;
+	if (took > stats->max_ns) {
+		stats->max_ns = took;
+	}
+	if (ret & (((FS3CmdBlk) 1) << 11)) {
+		stats->failures++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_server
+// Description  : Signal handler, asks the event loop to stop
+//
+// Inputs       : sig - the signal
+// Outputs      : none
+
+void stop_server(int sig) {
+	server_stop = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : update_events
+// Description  : Registers a connection for reading unless too many replies
+//                are waiting, and for writing when there are any
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 if successful, -1 if failure
+
+int update_events(fs3_connection *conn) {
+	struct epoll_event ev;
+	uint32_t pending = conn->out_len - conn->out_off;
+
+	ev.events = ((pending < FS3_SERVER_OUTMAX) ? EPOLLIN : 0) | ((pending > 0) ? EPOLLOUT : 0);
+	if (ev.events == conn->events) {
+		return(0);
+	}
+	ev.data.ptr = conn;
+	conn->events = ev.events;
+	return(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_connection
+// Description  : Drops a client
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void close_connection(fs3_connection *conn) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	logMessage(FS3ControllerLLevel, "FS3 server closed connection %d", conn->fd);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+	clients_connected--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : grow_buffer
+// Description  : Makes a connection buffer hold at least size bytes
+//
+// Inputs       : buf - the buffer
+//                cap - its size
+//                size - bytes needed
+// Outputs      : 0 if successful, -1 if failure
+
+int grow_buffer(uint8_t **buf, uint32_t *cap, uint32_t size) {
+	uint8_t *grown = NULL;
+	uint32_t new_cap = (*cap == 0) ? FS3_SERVER_INBUF : *cap;
+
+	if (size <= *cap) {
+		return(0);
+	}
+	while (new_cap < size) {
+		new_cap *= 2;
+	}
+	if (NULL == (grown = realloc(*buf, new_cap))) {
+		return(-1);
+	}
+	*buf = grown;
+	*cap = new_cap;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reserve_reply
+// Description  : Makes room for a reply behind the ones waiting for a client
+//
+// Inputs       : conn - the connection
+//                len - number of bytes of the reply
+// Outputs      : where to put the reply, NULL if failure
+
+uint8_t *reserve_reply(fs3_connection *conn, uint32_t len) {
+	uint8_t *reply = NULL;
+
+	// move what is left to the front before growing
+	if ((conn->out_off > 0) && (conn->out_len + len > conn->out_cap)) {
+		memmove(conn->out, &conn->out[conn->out_off], conn->out_len - conn->out_off);
+		conn->out_len -= conn->out_off;
+		conn->out_off = 0;
+	}
+	if (-1 == grow_buffer(&conn->out, &conn->out_cap, conn->out_len + len)) {
+		return(NULL);
+	}
+	reply = &conn->out[conn->out_len];
+	conn->out_len += len;
+	return(reply);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_replies
+// Description  : Sends as much of the waiting replies as the socket takes
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 if successful, -1 if the connection failed
+
+int flush_replies(fs3_connection *conn) {
+	ssize_t sent = 0;
+
+	while (conn->out_off < conn->out_len) {
+		sent = write(conn->fd, &conn->out[conn->out_off], conn->out_len - conn->out_off);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			return(-1);
+		}
+		conn->out_off += sent;
+	}
+	if (conn->out_off == conn->out_len) {
+		conn->out_off = 0;
+		conn->out_len = 0;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_commands
+// Description  : Runs every complete command read from a client and
+//                queues the replies
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 if successful, -1 if failure
+
+int run_commands(fs3_connection *conn) {
+	uint32_t off = 0, need = 0, data = 0, header = 0;
+	uint64_t wire = 0, tag = 0, start = 0, took = 0;
+	FS3CmdBlk cmd = 0, ret = 0;
+	uint8_t op = 0, writing = 0, reading = 0;
+	uint8_t *reply = NULL;
+	void *buf = NULL;
+
+	while (conn->out_len - conn->out_off < FS3_SERVER_OUTMAX) {
+		// the tag comes first once the client mounted with tags
+		header = FS3_NET_HEADER_SIZE + ((conn->ctx.tagged) ? FS3_NET_TAG_SIZE : 0);
+		if (conn->in_len - off < header) {
+			break;
+		}
+		memcpy(&tag, &conn->in[off], (conn->ctx.tagged) ? FS3_NET_TAG_SIZE : 0);
+		memcpy(&wire, &conn->in[off + header - FS3_NET_HEADER_SIZE], sizeof(wire));
+		cmd = (FS3CmdBlk) ntohll64(wire);
+		op = (uint8_t) ((cmd >> 60) & 0xf);
+		data = fs3_controller_cmd_sectors(cmd) * FS3_SECTOR_SIZE;
+		writing = (op == FS3_OP_WRSECT) || (op == FS3_OP_WRSECTS);
+		reading = (op == FS3_OP_RDSECT) || (op == FS3_OP_RDSECTS) || (op == FS3_OP_RDTRACK);
+
+		// a write carries its sectors behind the command block
+		need = header + ((writing) ? data : 0);
+		if (conn->in_len - off < need) {
+			if ((off == 0) && (-1 == grow_buffer(&conn->in, &conn->in_cap, need))) {
+				return(-1);
+			}
+			break;
+		}
+
+		// a read goes straight into its reply
+		if (NULL == (reply = reserve_reply(conn, header + ((reading) ? data : 0)))) {
+			return(-1);
+		}
+		buf = (writing) ? (void *) &conn->in[off + header] : (void *) &reply[header];
+
+		start = now_ns();
+		ret = fs3_controller_execute(&conn->ctx, cmd, buf);
+		took = now_ns() - start;
+		if (op < FS3_OP_MAXVAL) {
+			record_op(&op_interval[op], took, ret);
+			record_op(&op_totals[op], took, ret);
+		}
+
+		// the reply (with the tag of the command), a failed read sends no sectors
+		wire = htonll64(ret);
+		memcpy(reply, &tag, header - FS3_NET_HEADER_SIZE);
+		memcpy(&reply[header - FS3_NET_HEADER_SIZE], &wire, sizeof(wire));
+		if ((reading) && (ret & (((FS3CmdBlk) 1) << 11))) {
+			conn->out_len -= data;
+		}
+		off += need;
+	}
+
+	// keep the partial command for the next read
+	if (off > 0) {
+		memmove(conn->in, &conn->in[off], conn->in_len - off);
+		conn->in_len -= off;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : handle_connection
+// Description  : Services the events of a client
+//
+// Inputs       : conn - the connection
+//                events - the epoll events
+// Outputs      : 0 if successful, -1 if the connection should be closed
+
+int handle_connection(fs3_connection *conn, uint32_t events) {
+	ssize_t got = 0;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		return(-1);
+	}
+
+	if ((events & EPOLLIN) && (conn->in_len < conn->in_cap)) {
+		got = read(conn->fd, &conn->in[conn->in_len], conn->in_cap - conn->in_len);
+		if (got == 0) {
+			return(-1);
+		}
+		if (got < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				return(-1);
+			}
+			got = 0;
+		}
+		conn->in_len += got;
+	}
+
+	// run what arrived (or was held back by unsent replies) and send the replies
+	if (-1 == run_commands(conn)) {
+		return(-1);
+	}
+	if (-1 == flush_replies(conn)) {
+		return(-1);
+	}
+	if ((conn->in_len > 0) && (conn->out_len - conn->out_off < FS3_SERVER_OUTMAX) && (-1 == run_commands(conn))) {
+		return(-1);
+	}
+	return(update_events(conn));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : accept_connections
+// Description  : Accepts the waiting clients and adds them to the loop
+//
+// Inputs       : listen_fd - the listen socket
+// Outputs      : none
+
+void accept_connections(int listen_fd) {
+	struct epoll_event ev;
+	fs3_connection *conn = NULL;
+	int fd = -1, nodelay = 1;
+
+	while (-1 != (fd = accept(listen_fd, NULL, NULL))) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		if ((NULL == (conn = calloc(1, sizeof(fs3_connection)))) ||
+		    (-1 == grow_buffer(&conn->in, &conn->in_cap, FS3_SERVER_INBUF))) {
+			free(conn);
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->ctx.track = FS3_NO_TRACK;
+		conn->events = EPOLLIN;
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(conn->in);
+			free(conn);
+			continue;
+		}
+		clients_connected++;
+		clients_served++;
+		logMessage(FS3ControllerLLevel, "FS3 server accepted connection %d", fd);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 controller server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+	struct sockaddr_in address;
+	struct epoll_event ev, events[FS3_SERVER_EVENTS];
+	struct sigaction sa;
+	unsigned short port = FS3_DEFAULT_PORT;
+	uint64_t start = 0, last = 0, report_ns = 0, now = 0;
+	int ch, i, n, listen_fd = -1, reuse = 1, log_initialized = 0, verbose = 0;
+	unsigned int report = 0;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, FS3_SERVER_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf(stderr, USAGE);
+			return(-1);
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'p': // Set the port to listen on
+			if (sscanf(optarg, "%hu", &port) != 1) {
+				fprintf(stderr, "Bad port number [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'd': // Set the disk image
+			fs3_controller_image = optarg;
+			break;
+
+		case 'r': // Set the report interval
+			if (sscanf(optarg, "%u", &report) != 1) {
+				fprintf(stderr, "Bad report interval [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename(optarg);
+			log_initialized = 1;
+			break;
+
+		default:  // Default (unknown)
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return(-1);
+		}
+	}
+
+	// Setup the log as needed
+	if (!log_initialized) {
+		initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+	}
+	FS3ControllerLLevel = registerLogLevel("FS3_CONTROLLER", 0);
+	if (verbose) {
+		enableLogLevels(FS3ControllerLLevel);
+	}
+
+	// Map the disk
+	if (-1 == fs3_controller_open(fs3_controller_image)) {
+		return(-1);
+	}
+
+	// Stop cleanly on a signal, and survive clients that go away
+	memset(&sa, 0x0, sizeof(sa));
+	sa.sa_handler = stop_server;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Listen for clients
+	if (-1 == (listen_fd = socket(AF_INET, SOCK_STREAM, 0))) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed to create socket [%s]", strerror(errno));
+		return(-1);
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	memset(&address, 0x0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if ((-1 == bind(listen_fd, (struct sockaddr *) &address, sizeof(address))) ||
+	    (-1 == listen(listen_fd, FS3_SERVER_BACKLOG))) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed to listen on port %u [%s]", port, strerror(errno));
+		return(-1);
+	}
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+	if (-1 == (epoll_fd = epoll_create1(0))) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 server failed to create epoll [%s]", strerror(errno));
+		return(-1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // the listen socket
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	logMessage(LOG_INFO_LEVEL, "FS3 server listening on port %u, disk [%s]", port,
+	           (fs3_controller_image != NULL) ? fs3_controller_image : "memory");
+
+	// The event loop
+	start = last = now_ns();
+	report_ns = (uint64_t) report * 1000000000ULL;
+	while (!server_stop) {
+		n = epoll_wait(epoll_fd, events, FS3_SERVER_EVENTS, (report > 0) ? 1000 : -1);
+		if ((n == -1) && (errno != EINTR)) {
+			logMessage(LOG_ERROR_LEVEL, "FS3 server epoll failed [%s]", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) {
+				accept_connections(listen_fd);
+			} else if (-1 == handle_connection(events[i].data.ptr, events[i].events)) {
+				close_connection(events[i].data.ptr);
+			}
+		}
+
+		// the interval report
+		now = now_ns();
+		if ((report_ns > 0) && (now - last >= report_ns)) {
+			print_stats(op_interval, now - last, 0);
+			memset(op_interval, 0x0, sizeof(op_interval));
+			last = now;
+		}
+	}
+
+	print_stats(op_totals, now_ns() - start, 1);
+	close(listen_fd);
+	close(epoll_fd);
+	fs3_controller_close();
+	return(0);
+}
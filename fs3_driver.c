@@ -15,6 +15,8 @@
 #include <cmpsc311_log.h> 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 #include <fs3_network.h>
 
 // Project Includes 
@@ -38,68 +40,616 @@
 //max files we can store 
 #define MAX_FILES (FS3_MAX_TRACKS*FS3_TRACK_SIZE) 
 
+// handles in a chunk of the handle table, and first size of a file's extent list
+#define FILE_HANDLERS_START 64
+#define FILE_EXTENTS_START 4
+
+// chunks of the handle table and the file of a handle
+#define FILE_CHUNKS ((MAX_FILES + FILE_HANDLERS_START - 1) / FILE_HANDLERS_START)
+#define FILE_HANDLER(fd) (&file_chunks[(fd) / FILE_HANDLERS_START][(fd) % FILE_HANDLERS_START])
+
+// words of the per-track allocation bitmap
+#define BITMAP_WORDS (FS3_TRACK_SIZE/64)
+
+// starting number of buckets in the path index (a power of two)
+#define PATH_INDEX_START 256
+
+// most sectors sent to the controller in one batch
+#define BATCH_SECTORS 64
+
+// clean segments the cleaner keeps ready for the log, and the time between
+// its passes (ms)
+#define LOG_FREE_SEGMENTS 4
+#define LOG_CLEAN_MS 100
+
+// time between passes of the background defragmenter (ms)
+#define DEFRAG_TICK_MS 10
+
+// the owner of a sector, the file and the index of the sector in it
+#define SECTOR_OWNER(fd, index) ((((uint64_t) (fd)) << 32) | (index))
+
+// first read-ahead window once a stream is seen
+#define READAHEAD_START_WINDOW 4
+
+// most queued requests the engine runs as one group
+#define ENGINE_GROUP 16
+
+// the state of a request of the engine's group
+#define ENGINE_HELD 0x1 // it has sectors held dirty until the group is done
+#define ENGINE_FAILED 0x2 // writing back those sectors failed
+
+// tracks between the places threads start allocating from
+#define ALLOC_THREAD_SPREAD 8
+
+// metrics are counted from any thread
+#define DRIVER_COUNT(c, n) __atomic_add_fetch(&(c), (n), __ATOMIC_RELAXED)
+
+//
+// Functional Prototypes
+
+int fs3_net_write(FS3TrackIndex track, FS3SectorIndex sector, void *buf);
+	// Writes a whole sector to the controller
+
+int fs3_net_writeback(uint32_t *ids, void **bufs, uint16_t n);
+	// Writes a batch of whole sectors to the controller
+
+int fs3_net_seek(int32_t *head, uint16_t track);
+	// Moves the controller to a track
+
+int fs3_net_rdsect(int32_t *head, uint16_t sector, void *buf);
+	// Reads a sector from the current track
+
+void fs3_readahead_reset(int16_t fd);
+	// Forgets the read pattern of a file
+
 //defining logical statements so our code is easier to understand
 #define FALSE 0   
 #define TRUE 1
  
+// a run of sectors in a row on the disk holding part of a file
+typedef struct file_extent {
+    uint32_t first; // index in the file of the first sector
+    uint32_t start; // sector id of the first sector
+    uint32_t length; // sectors in the run
+} file_extent;
+
 //making file handlers structure
 typedef struct file_info { 
-    uint32_t sector_id[512];
-    uint16_t num_sectors;
+    file_extent *extents; // the sector map, in file order
+    uint32_t num_extents;
+    uint32_t max_extents;
+    uint32_t cur_extent; // extent of the last lookup
+    uint32_t num_sectors;
     uint64_t len;
     uint64_t pos;
     char *path;
+    uint32_t path_hash; // hash of the path
+    int32_t path_next; // next file in the path index bucket, -1 if last
     int file_state;
+    pthread_rwlock_t lock; // shared for reads and flushes, exclusive otherwise
+    pthread_mutex_t meta; // position and read-ahead state under a shared lock
+    // read-ahead state, a stream is reads with the same gap between them
+    uint64_t ra_end; // end of the previous read
+    int64_t ra_gap; // gap before the previous read, -1 if none
+    uint32_t ra_len; // length of the previous read
+    uint16_t ra_window; // read-ahead window in sectors, 0 if not streaming
+    uint32_t ra_start; // first sector index of the read-ahead range
+    uint32_t ra_next; // sector index past the read-ahead range
+    uint16_t ra_used; // reads of the range that found the sector cached
+    uint16_t ra_missed; // reads of the range where it had been evicted
+    // write buffer, small writes one after the other gather here until their
+    // sector is done, it never holds bytes of more than one sector
+    uint8_t *wb; // a sector of bytes, allocated on the first small write
+    uint64_t wb_pos; // file position of the first buffered byte
+    uint16_t wb_len; // bytes buffered, 0 if empty
+    uint64_t wb_time; // when the first byte was buffered (ms)
+    uint32_t frag_checked; // extents when the defragmenter last found no better layout
+    uint64_t last_ticket; // ticket of the last request queued on the file
 } file_t;
 
-
-//define array of file handlers
-file_t file_handlers[MAX_FILES] = {0}; 
-// indicates sector usage
-uint8_t sector_usage[FS3_MAX_TRACKS][FS3_TRACK_SIZE] = {0}; 
+file_t *file_lock(int16_t fd, int exclusive);
+	// Locks an open file, NULL if the handle is bad or the file is not open
+
+void file_unlock(file_t *file);
+	// Unlocks a file
+
+int file_buffer_flush(int16_t fd, file_t *file);
+	// Writes out the write buffer of a file locked alone
+
+int file_buffer_sync(int16_t fd);
+	// Writes out the write buffer of a file not yet locked
+
+void file_buffer_background(void);
+	// A pass of the thread writing out old write buffers
+
+void log_clean_background(void);
+	// A pass of the segment cleaner thread
+
+void defrag_background(void);
+	// A pass of the background defragmenter
+
+void defrag_cancel(void);
+	// Drops the defragmenter's plan, giving back the sectors not moved to
+
+// a thread making a pass every interval ms, or sooner when woken
+typedef struct fs3_worker {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // wakes the thread for a pass
+    pthread_t thread;
+    int running, stop;
+    uint32_t interval;
+    void (*pass)(void);
+} fs3_worker;
+
+int worker_start(fs3_worker *w);
+	// Starts a background thread
+
+void worker_wake(fs3_worker *w);
+	// Wakes a background thread for a pass
+
+void worker_finish(fs3_worker *w);
+	// Stops a background thread
+
+// the new layout of the file the defragmenter is moving, a run at a time
+typedef struct defrag_plan {
+    int32_t fd; // -1 if no file is being moved
+    file_extent *runs; // where the sectors go, in file order
+    uint32_t num_runs;
+    uint32_t cur_run; // the run being filled
+    uint32_t next; // index in the file of the next sector to move
+    uint32_t tracks, seeks; // the layout of the file before it moved
+} defrag_plan;
+
+// a sector operation in the request scheduler
+typedef struct sched_op {
+    uint64_t key; // place in the sweep over the tracks
+    uint32_t sector_id;
+    uint8_t op; // FS3_OP_RDSECT or FS3_OP_WRSECT
+    void *buf;
+} sched_op;
+
+// a piece of a read waiting on a sector from the controller
+typedef struct read_piece {
+    uint32_t sector_id;
+    uint32_t to; // offset in the caller's buffer
+    uint16_t from; // offset in the sector
+    uint16_t len;
+} read_piece;
+
+// a piece of a write going into one sector
+typedef struct write_piece {
+    uint32_t sector_id;
+    uint32_t source; // sector holding the old contents, the same one unless it is moving
+    uint8_t *data; // the bytes to write
+    uint16_t offset; // offset in the sector
+    uint16_t len;
+    uint8_t fresh; // the sector was just allocated (has no contents)
+    uint8_t read; // the old contents were read into the batch buffer
+} write_piece;
+
+
+//define table of file handlers, it grows a chunk at a time as files are
+//created and a chunk never moves, so handles are used without a table lock
+file_t *file_chunks[FILE_CHUNKS] = {NULL};
+// sector allocation bitmap (a set bit is a used sector) and used counts per
+// track, the bitmap of a track is guarded by the lock of the track
+uint64_t sector_bitmap[FS3_MAX_TRACKS][BITMAP_WORDS] = {0};
+uint16_t track_used[FS3_MAX_TRACKS] = {0};
+pthread_mutex_t track_locks[FS3_MAX_TRACKS] = { [0 ... FS3_MAX_TRACKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+// next-fit cursor of a thread, new files start on the track of its last
+// allocation (-1 until it first allocates, threads start apart)
+__thread int32_t alloc_cursor = -1;
+uint32_t alloc_threads = 0;
 uint32_t sectors_used = 0;
+// the file and index of each used sector, the cleaner needs it so it is
+// only kept while mounted in log-structured mode
+uint64_t *sector_owner = NULL;
+// log-structured mode, the log head is the next sector of the open segment
+// (a track); the victim is the segment being cleaned, it is not opened
+uint8_t fs3_log_structured = 0;
+uint8_t fs3_log_clean_live = FS3_DEFAULT_CLEAN_LIVE;
+pthread_mutex_t fs3_log_lock = PTHREAD_MUTEX_INITIALIZER;
+int32_t fs3_log_track = -1, fs3_log_victim = -1;
+uint16_t fs3_log_sector = 0;
+// the segment cleaner, a pass at a time
+pthread_mutex_t fs3_clean_lock = PTHREAD_MUTEX_INITIALIZER;
+fs3_worker fs3_cleaner = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                           .interval = LOG_CLEAN_MS, .pass = log_clean_background };
+// the defragmenter, the background mode moves at most fs3_defrag_rate
+// sectors a second (0 turns it off); the lock keeps it and fs3_defrag apart
+uint32_t fs3_defrag_rate = 0;
+pthread_mutex_t fs3_defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+defrag_plan fs3_defrag_plan = { .fd = -1 };
+fs3_worker fs3_defragger = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                             .interval = DEFRAG_TICK_MS, .pass = defrag_background };
+uint16_t fs3_readahead_max = FS3_DEFAULT_READAHEAD;
+// the multi-sector commands are asked for, and were agreed to at mount
+uint8_t fs3_use_multisector = 1;
+uint8_t fs3_multisector = 0;
+// the track the controller is on, -1 if not known, and the lock held while
+// a connection that takes one thread at a time is used
+int32_t fs3_cur_track = -1;
+pthread_mutex_t fs3_net_lock = PTHREAD_MUTEX_INITIALIZER;
+// a connection that takes commands from any thread keeps a track per
+// thread, it is forgotten when the disk is mounted again
+__thread int32_t fs3_thread_track = -1;
+__thread uint32_t fs3_thread_mount = 0;
+uint32_t fs3_mount_count = 0;
+// driver metrics
+uint32_t fs3_write_reads = 0, fs3_write_reads_avoided = 0;
+uint32_t fs3_seeks_issued = 0, fs3_seeks_elided = 0;
+uint32_t fs3_multi_cmds = 0, fs3_multi_sectors = 0;
+uint32_t fs3_coalesced_writes = 0, fs3_coalesce_flushes = 0;
+uint64_t fs3_coalesced_bytes = 0;
+uint32_t fs3_log_segments = 0, fs3_log_cleaned = 0;
+uint32_t fs3_log_written = 0, fs3_log_moved = 0;
+uint64_t fs3_log_clean_us = 0;
+uint32_t fs3_sched_batches = 0, fs3_sched_ops = 0, fs3_sched_seeks = 0;
+uint32_t fs3_sched_reordered = 0, fs3_sched_depth_max = 0;
+uint32_t fs3_defrag_files = 0, fs3_defrag_sectors = 0;
+uint32_t fs3_defrag_tracks_before = 0, fs3_defrag_tracks_after = 0;
+uint32_t fs3_defrag_seeks_before = 0, fs3_defrag_seeks_after = 0;
+uint32_t fs3_engine_groups = 0, fs3_engine_batched = 0;
+// small writes are buffered until this many bytes are (0 turns it off) or
+// the first of them is this old
+uint16_t fs3_write_coalesce = FS3_DEFAULT_COALESCE;
+uint32_t fs3_write_coalesce_ms = FS3_DEFAULT_COALESCE_MS;
+// files with bytes in their write buffer, and the thread writing out the
+// buffers that get old with no write after them (it runs while mounted)
+uint32_t fs3_buffered_files = 0;
+fs3_worker fs3_buffer_flusher = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                                  .pass = file_buffer_background };
+// sectors of a batch are staged here on their way to or from the controller
+__thread uint8_t batch_buf[BATCH_SECTORS][FS3_SECTOR_SIZE];
+// path index, bucket heads of a chained hash of the file paths, it and the
+// making of files are guarded by the open lock
+int32_t *path_index = NULL;
+uint32_t path_index_size = 0;
+pthread_mutex_t fs3_open_lock = PTHREAD_MUTEX_INITIALIZER;
+// handles are never given back (files are not deleted), so the free list
+// of handles is everything from here on
+uint32_t next_free_handle = 0;
+// the request engine, the queue lock guards the queue, pending counts the
+// requests queued or running
+pthread_mutex_t fs3_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fs3_queue_work = PTHREAD_COND_INITIALIZER; // a request was queued
+pthread_cond_t fs3_queue_done = PTHREAD_COND_INITIALIZER; // a request is done
+fs3_request *fs3_queue_head = NULL, *fs3_queue_tail = NULL;
+pthread_t fs3_engine_thread;
+int fs3_engine_running = 0, fs3_engine_stop = 0;
+uint32_t fs3_engine_pending = 0;
+uint32_t fs3_async_requests = 0, fs3_queue_depth = 0, fs3_queue_depth_max = 0;
+// tickets number the requests in the order they are queued, every request
+// up to the done ticket is finished
+uint64_t fs3_queue_tickets = 0, fs3_queue_done_ticket = 0;
+// the group the engine is running; with write-through the sectors it
+// writes are held dirty in the cache and sent together when it is done
+uint16_t engine_group_size = 0, engine_group_cur = 0;
+uint8_t engine_group_state[ENGINE_GROUP];
+uint32_t engine_held[BATCH_SECTORS];
+uint16_t engine_held_count = 0;
+__thread uint8_t engine_hold_writes = 0;
 
 //
 // Implementation:
-int get_free_sector(uint16_t *track, uint16_t *sector) {
-	// initliazing found_free_sector and other variables 
-    int found_free_sector = FALSE;
-    int retval= FALSE;
-	uint16_t i = 0, j = 0;
-	// checking whether there is a free track/sector using for loop
-	while((i<FS3_MAX_TRACKS) && (found_free_sector == FALSE)) {
-		while((j<FS3_TRACK_SIZE) && (found_free_sector == FALSE)){
-			if (sector_usage[i][j] == FALSE) 
-			{
-				//breaks when there is a sector available
-				found_free_sector = TRUE;
-				continue;
-				i++;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_run_at
+// Description  : Counts the free sectors in a row starting at a sector (the
+//                caller holds the lock of the track)
+//
+// Inputs       : track - the track to look in
+//                sector - the first sector of the run
+//                want - stop counting at this many
+// Outputs      : length of the free run (0 if the sector is used)
+
+uint16_t free_run_at(uint16_t track, uint16_t sector, uint16_t want) {
+	uint16_t run = 0;
+	uint64_t used = 0;
+	uint16_t bits = 0;
+
+	while ((run < want) && (sector < FS3_TRACK_SIZE)) {
+		// the used bits from this sector to the end of its word
+		used = sector_bitmap[track][sector / 64] >> (sector % 64);
+		bits = 64 - (sector % 64);
+		if (used != 0) {
+			bits = (__builtin_ctzll(used) < bits) ? __builtin_ctzll(used) : bits;
+			run += bits;
+			break;
+		}
+		run += bits;
+		sector += bits;
+	}
+	return ((run < want) ? run : want);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_free_run
+// Description  : Finds the first free run on a track that is at least
+//                "want" long, or else the longest run on it (the caller
+//                holds the lock of the track)
+//
+// Inputs       : track - the track to look in
+//                want - the run length wanted
+//                sector - set to the start of the run
+// Outputs      : length of the run (0 if the track is full)
+
+uint16_t find_free_run(uint16_t track, uint16_t want, uint16_t *sector) {
+	uint16_t i = 0, w = 0, run = 0, best = 0;
+	uint64_t used = 0;
+
+	while (w < BITMAP_WORDS) {
+		// skip to the first free sector from word w on
+		used = sector_bitmap[track][w];
+		if (i > w * 64) {
+			used |= (((uint64_t) 1) << (i % 64)) - 1;
+		}
+		if (used == ~((uint64_t) 0)) {
+			w++;
+			continue;
+		}
+		i = w * 64 + __builtin_ctzll(~used);
+		run = free_run_at(track, i, want);
+		if (run > best) {
+			best = run;
+			*sector = i;
+			if (best == want) {
+				break;
 			}
-			if (found_free_sector == TRUE) 
-			{
-				//if free sector found, continue with program
-				continue;
+		}
+		// carry on after the run
+		i += run;
+		w = i / 64;
+	}
+	return (best);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mark_sectors_used
+// Description  : Marks a run of sectors as allocated (the caller holds the
+//                lock of the track)
+//
+// Inputs       : track - the track of the run
+//                sector - the first sector of the run
+//                count - the length of the run
+// Outputs      : none
+
+void mark_sectors_used(uint16_t track, uint16_t sector, uint16_t count) {
+	uint16_t i = 0;
+
+	for (i = sector; i < sector + count; i++) {
+		sector_bitmap[track][i / 64] |= ((uint64_t) 1) << (i % 64);
+	}
+	__atomic_add_fetch(&track_used[track], count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sectors_used, count, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_sector
+// Description  : Frees a sector no file uses any more, its cached copy is
+//                dropped first so it is never written back
+//
+// Inputs       : id - the sector id
+// Outputs      : none
+
+void release_sector(uint32_t id) {
+	uint16_t track = id / FS3_TRACK_SIZE, sector = id % FS3_TRACK_SIZE;
+
+	fs3_cache_invalidate(track, sector);
+	pthread_mutex_lock(&track_locks[track]);
+	sector_bitmap[track][sector / 64] &= ~(((uint64_t) 1) << (sector % 64));
+	pthread_mutex_unlock(&track_locks[track]);
+	__atomic_sub_fetch(&track_used[track], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&sectors_used, 1, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : track_free
+// Description  : Gives the free sectors of a track, a hint as other threads
+//                may be allocating on it
+//
+// Inputs       : track - the track
+// Outputs      : number of free sectors
+
+uint16_t track_free(uint16_t track) {
+	return (FS3_TRACK_SIZE - __atomic_load_n(&track_used[track], __ATOMIC_RELAXED));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_on_track
+// Description  : Allocates a run on a track under its lock, right at a
+//                sector if one is given, else the first fitting run
+//
+// Inputs       : track - the track
+//                at - the sector the run has to start at, -1 for anywhere
+//                want - the run length wanted
+//                sector - set to the start of the run
+// Outputs      : length of the run allocated (0 if none)
+
+uint16_t alloc_on_track(uint16_t track, int32_t at, uint16_t want, uint16_t *sector) {
+	uint16_t run = 0;
+
+	pthread_mutex_lock(&track_locks[track]);
+	if (at >= 0) {
+		run = free_run_at(track, at, want);
+		*sector = at;
+	} else {
+		run = find_free_run(track, want, sector);
+	}
+	if (run > 0) {
+		mark_sectors_used(track, *sector, run);
+	}
+	pthread_mutex_unlock(&track_locks[track]);
+	return (run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_free_sectors
+// Description  : Allocates a run of contiguous sectors on one track. The run
+//                continues the file right after its last sector if it can,
+//                then stays on the file's track, then goes next-fit over the
+//                tracks with free sectors.
+//
+// Inputs       : last - the sector id of the file's last sector, -1 if none
+//                want - the number of sectors wanted
+//                track - set to the track of the run
+//                sector - set to the first sector of the run
+// Outputs      : number of sectors allocated (0 if the disk is full)
+
+uint16_t get_free_sectors(int32_t last, uint16_t want, uint16_t *track, uint16_t *sector) {
+	uint16_t run = 0, i = 0, trk = 0;
+
+	if (want == 0) {
+		return (0);
+	}
+
+	if (last >= 0) {
+		// right behind the file keeps its sectors in a row
+		trk = last / FS3_TRACK_SIZE;
+		if ((last % FS3_TRACK_SIZE) + 1 < FS3_TRACK_SIZE) {
+			run = alloc_on_track(trk, (last % FS3_TRACK_SIZE) + 1, want, sector);
+		}
+		// anywhere else on the file's track
+		if ((run == 0) && (track_free(trk) > 0)) {
+			run = alloc_on_track(trk, -1, want, sector);
+		}
+	}
+
+	// next-fit from the cursor of this thread, preferring a track the whole
+	// run fits on; threads start apart so they rarely share a track
+	if (run == 0) {
+		if (alloc_cursor < 0) {
+			alloc_cursor = (__atomic_fetch_add(&alloc_threads, 1, __ATOMIC_RELAXED) * ALLOC_THREAD_SPREAD) % FS3_MAX_TRACKS;
+		}
+		for (i = 0; (i < FS3_MAX_TRACKS) && (run == 0); i++) {
+			trk = (alloc_cursor + i) % FS3_MAX_TRACKS;
+			if (track_free(trk) >= want) {
+				run = alloc_on_track(trk, -1, want, sector);
+			}
+		}
+		for (i = 0; (i < FS3_MAX_TRACKS) && (run == 0); i++) {
+			trk = (alloc_cursor + i) % FS3_MAX_TRACKS;
+			if (track_free(trk) > 0) {
+				run = alloc_on_track(trk, -1, want, sector);
 			}
-                        j++;
+		}
+		if (run == 0) {
+			return (0);
+		}
+		alloc_cursor = trk;
+	}
+
+	*track = trk;
+	return (run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_free_sector
+// Description  : Finds the first free sector of a track at or after a
+//                sector (the caller holds the lock of the track)
+//
+// Inputs       : track - the track
+//                sector - where to start looking
+// Outputs      : the free sector, FS3_TRACK_SIZE if there is none
+
+uint16_t next_free_sector(uint16_t track, uint16_t sector) {
+	uint64_t free_bits = 0;
+
+	while (sector < FS3_TRACK_SIZE) {
+		free_bits = (~sector_bitmap[track][sector / 64]) >> (sector % 64);
+		if (free_bits != 0) {
+			return (sector + __builtin_ctzll(free_bits));
+		}
+		sector = (sector / 64 + 1) * 64;
+	}
+	return (FS3_TRACK_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_open_segment
+// Description  : Opens the segment with the most free sectors (the first
+//                one after the current one on a tie), and wakes the cleaner
+//                when clean segments run low (the caller holds the log lock)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the disk is full
 
+int log_open_segment(void) {
+	int32_t best = -1;
+	uint16_t i = 0, trk = 0, free = 0, most = 0, clean = 0;
+
+	for (i = 1; i <= FS3_MAX_TRACKS; i++) {
+		trk = (fs3_log_track + i) % FS3_MAX_TRACKS;
+		if (trk == fs3_log_victim) {
+			continue;
+		}
+		free = track_free(trk);
+		if (free == FS3_TRACK_SIZE) {
+			clean++;
 		}
-		if (found_free_sector == FALSE) {
-		    i++;
-                    j = 0;
+		if (free > most) {
+			most = free;
+			best = trk;
 		}
 	}
-	// return sector and track if free sector 
-    if (found_free_sector == TRUE) {
-        retval = TRUE;
-        *track = i;
-        *sector = j;
-        sectors_used++;
-    } else {
-        retval = FALSE;
-    }
+	if (best == -1) {
+		return (-1);
+	}
+	fs3_log_track = best;
+	fs3_log_sector = 0;
+	DRIVER_COUNT(fs3_log_segments, 1);
 
-    return(retval);
+	if (clean <= LOG_FREE_SEGMENTS) {
+		worker_wake(&fs3_cleaner);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_alloc
+// Description  : Allocates a run of sectors at the head of the log, moving
+//                on to a new segment when the open one is full
+//
+// Inputs       : want - the number of sectors wanted
+//                id - set to the sector id of the first sector of the run
+// Outputs      : number of sectors allocated (0 if the disk is full)
+
+uint16_t log_alloc(uint16_t want, uint32_t *id) {
+	uint16_t run = 0, sector = 0;
+
+	pthread_mutex_lock(&fs3_log_lock);
+	while (run == 0) {
+		if (fs3_log_track >= 0) {
+			// the open segment can have live sectors, the head skips them
+			pthread_mutex_lock(&track_locks[fs3_log_track]);
+			sector = next_free_sector(fs3_log_track, fs3_log_sector);
+			if (sector < FS3_TRACK_SIZE) {
+				run = free_run_at(fs3_log_track, sector, want);
+				mark_sectors_used(fs3_log_track, sector, run);
+			}
+			pthread_mutex_unlock(&track_locks[fs3_log_track]);
+			if (run > 0) {
+				*id = fs3_log_track * FS3_TRACK_SIZE + sector;
+				fs3_log_sector = sector + run;
+				break;
+			}
+		}
+		if (-1 == log_open_segment()) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs3_log_lock);
+	return (run);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -140,555 +690,3329 @@ int deconstruct_fs3_cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uin
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_mount_disk
+// Function     : sector_owner_build
+// Description  : Makes the owner map of the sectors from the sector maps of
+//                the files, the files outlive an unmount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int sector_owner_build(void) {
+	file_extent *ext = NULL;
+	uint32_t fd = 0, i = 0, j = 0;
+
+	free(sector_owner);
+	if (NULL == (sector_owner = calloc(FS3_MAX_TRACKS * FS3_TRACK_SIZE, sizeof(uint64_t)))) {
+		return(-1);
+	}
+	for (fd = 0; fd < next_free_handle; fd++) {
+		for (i = 0; i < FILE_HANDLER(fd)->num_extents; i++) {
+			ext = &FILE_HANDLER(fd)->extents[i];
+			for (j = 0; j < ext->length; j++) {
+				sector_owner[ext->start + j] = SECTOR_OWNER(fd, ext->first + j);
+			}
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_mount_disk
 // Description  : FS3 interface, mount/initialize filesystem
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t fs3_mount_disk(void) { 
+int32_t fs3_do_mount_disk(void) { 
 	//initializing variables that we are going to use in the function
 	FS3CmdBlk cmd_blk = 0; 
 	FS3CmdBlk ret_cmd_blk = 0;
 	uint32_t trk = 0;
 	uint8_t op = 0, ret = 0;
 	uint16_t sec = 0;
+	// dirty cache lines are written back through the driver
+	fs3_set_cache_writeback(fs3_net_write);
+	fs3_set_cache_writeback_batch(fs3_net_writeback);
+	// a new mount starts with the controller on an unknown track
+	fs3_cur_track = -1;
+	__atomic_add_fetch(&fs3_mount_count, 1, __ATOMIC_RELEASE);
 	//constructing the cmdblock to mount
 	cmd_blk = construct_fs3_cmdblock(FS3_OP_MOUNT, 0, 0, 0); 
+	// ask for the multi-sector commands, an older controller does not echo it
+	if (fs3_use_multisector) {
+		cmd_blk |= FS3_MOUNT_MULTISECTOR;
+	}
 	// pass the cmdblock to the mount file system using fs3syscall
 	network_fs3_syscall(cmd_blk, &ret_cmd_blk, NULL);
 	// extract return value using the command block that outputs from the syscall
 	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret); 
+	fs3_multisector = (ret == SUCCESS) && (fs3_use_multisector) && (ret_cmd_blk & FS3_MOUNT_MULTISECTOR);
+	// the log starts on a new segment, the cleaner keeps it supplied
+	fs3_log_track = -1;
+	if ((ret == SUCCESS) && (fs3_log_structured) &&
+	    ((-1 == sector_owner_build()) || (-1 == worker_start(&fs3_cleaner)))) {
+		return(-1);
+	}
+	if ((ret == SUCCESS) && (fs3_defrag_rate > 0) && (-1 == worker_start(&fs3_defragger))) {
+		return(-1);
+	}
+	// buffered writes go out once old even if no write comes after them,
+	// a pass every half of that age
+	fs3_buffer_flusher.interval = (fs3_write_coalesce_ms > 1) ? fs3_write_coalesce_ms / 2 : 1;
+	if ((ret == SUCCESS) && (fs3_write_coalesce > 0) && (fs3_write_coalesce_ms > 0) &&
+	    (-1 == worker_start(&fs3_buffer_flusher))) {
+		return(-1);
+	}
 	// if the mounting is success, we get ret=0
 	return(ret==SUCCESS); 
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_unmount_disk
+// Function     : fs3_do_unmount_disk
 // Description  : FS3 interface, unmount the disk, close all files
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t fs3_unmount_disk(void) {
+int32_t fs3_do_unmount_disk(void) {
 	//initializing variables that we are going to use in the function
 	FS3CmdBlk cmd_blk = 0; 
 	FS3CmdBlk ret_cmd_blk = 0;
 	uint8_t op = 0, ret = 0;
 	uint32_t trk = 0;
 	uint16_t sec = 0;
+	uint32_t i = 0;
+	file_t *file = NULL;
+	int failed = 0;
+
+	worker_finish(&fs3_buffer_flusher);
+	worker_finish(&fs3_defragger);
+	worker_finish(&fs3_cleaner);
+	defrag_cancel();
+	// buffered writes go to the cache first
+	for (i = 0; i < next_free_handle; i++) {
+		if (NULL != (file = file_lock(i, TRUE))) {
+			failed = (-1 == file_buffer_flush(i, file));
+			file_unlock(file);
+			if (failed) {
+				return(-1);
+			}
+		}
+	}
+	// the controller needs every dirty sector before it goes away
+	if (-1 == fs3_flush_cache()) {
+		return(-1);
+	}
+	fs3_cur_track = -1;
 	//constructing the cmdblock to unmount
 	cmd_blk = construct_fs3_cmdblock(FS3_OP_UMOUNT, 0, 0, 0);
 	// pass the cmdblock to the mount file system using fs3syscall
 	network_fs3_syscall(cmd_blk,&ret_cmd_blk, NULL);
 	// extract return value using the command block that outputs from the syscall
 	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret); 
+	// the owner map is made again at the next mount
+	free(sector_owner);
+	sector_owner = NULL;
 	// if the mounting is success, we get ret=0
 	return(ret==SUCCESS);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_open
-// Description  : This function opens the file and returns a file handle
+// Function     : file_sector_id
+// Description  : Looks up the sector id of a sector of a file. The lookup
+//                starts at the extent of the last one, so going through a
+//                file in order does not search. Readers share the cursor, it
+//                is only a hint.
 //
-// Inputs       : path - filename of the file to open
-// Outputs      : file handle if successful, -1 if failure
+// Inputs       : fd - the file handle
+//                index - the index of the sector in the file
+// Outputs      : the sector id, -1 if the file has no such sector
+
+int32_t file_sector_id(int16_t fd, uint32_t index) {
+	file_t *file = FILE_HANDLER(fd);
+	file_extent *ext = NULL;
+	uint32_t lo = 0, hi = 0, mid = 0;
+	uint32_t cur = __atomic_load_n(&file->cur_extent, __ATOMIC_RELAXED);
+
+	if (index >= file->num_sectors) {
+		return (-1);
+	}
 
-int16_t fs3_open(char *path) {
-	// declaring the variables that we are using for this function
-	uint64_t i = 0;
-	int16_t free_handle = -1;
+	// the cursor extent or the one after it
+	ext = &file->extents[cur];
+	if (index >= ext->first) {
+		if (index < ext->first + ext->length) {
+			return (ext->start + (index - ext->first));
+		}
+		if ((cur + 1 < file->num_extents) && (index < ext[1].first + ext[1].length)) {
+			__atomic_store_n(&file->cur_extent, cur + 1, __ATOMIC_RELAXED);
+			return (ext[1].start + (index - ext[1].first));
+		}
+	}
 
-	// looping through all the file handlers  
-	for(i=0; i < MAX_FILES; i++) { 
-		// check whether file exists in the file system
-		if ((file_handlers[i].path != NULL) && (0==strcmp(path, file_handlers[i].path))) { 
-			//if the file is open, we return -1 
-			if (file_handlers[i].file_state == FILE_OPEN) { 
-				return(-1);
-			} else { 
-				// otherwise reset the read/write pointer and file state
-				file_handlers[i].pos = 0; 
-				file_handlers[i].file_state = FILE_OPEN;
-				//return filehandler as output
-				return(i); 
-			}
+	// binary search for the last extent starting at or before the index
+	lo = 0;
+	hi = file->num_extents - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (file->extents[mid].first <= index) {
+			lo = mid;
 		} else {
-			//remember the first free file handler
-			if (file_handlers[i].path == NULL) { 
-				if (free_handle == -1) {
-					free_handle = i;
-				}
-			}
+			hi = mid - 1;
 		}
 	}
-	// returns -1 if no free file handler is found 
-	if (free_handle == -1) {
-		return(-1);
-	}
-
-	//saving the details of the file in the file handlers array and reset the position/length of the file
-	file_handlers[free_handle].num_sectors = 0;
-	file_handlers[free_handle].len = 0;
-	file_handlers[free_handle].pos = 0;
-	file_handlers[free_handle].path = calloc(strlen(path)+1, sizeof(char));
-	strcpy(file_handlers[free_handle].path, path);
-	file_handlers[free_handle].file_state = FILE_OPEN;
-
-	//returns the file handle 
-	return (free_handle);
+	__atomic_store_n(&file->cur_extent, lo, __ATOMIC_RELAXED);
+	ext = &file->extents[lo];
+	return (ext->start + (index - ext->first));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_close
-// Description  : This function closes the file
+// Function     : file_add_sectors
+// Description  : Adds a run of sectors to the end of a file's sector map,
+//                growing the last extent when the run continues it
 //
-// Inputs       : fd - the file descriptor
+// Inputs       : fd - the file handle
+//                start - the sector id of the first sector of the run
+//                count - the length of the run
 // Outputs      : 0 if successful, -1 if failure
 
-int16_t fs3_close(int16_t fd) {
-	// check if file handle is valid
-	if ((fd < 0) || (fd >= MAX_FILES)) {
-		return(-1);
+int file_add_sectors(int16_t fd, uint32_t start, uint32_t count) {
+	file_t *file = FILE_HANDLER(fd);
+	file_extent *ext = NULL;
+	uint32_t size = 0, i = 0;
+
+	for (i = 0; (NULL != sector_owner) && (i < count); i++) {
+		__atomic_store_n(&sector_owner[start + i], SECTOR_OWNER(fd, file->num_sectors + i), __ATOMIC_RELAXED);
 	}
-	//checks if the file is open
-	if (file_handlers[fd].file_state != FILE_OPEN) {
-		return(-1);
+	if (file->num_extents > 0) {
+		ext = &file->extents[file->num_extents - 1];
+		if (ext->start + ext->length == start) {
+			ext->length += count;
+			file->num_sectors += count;
+			return (0);
+		}
 	}
-	//resets file read/write pointer and file state
-	file_handlers[fd].pos = 0;
-	file_handlers[fd].file_state = FILE_CLOSE;
 
-	//return 0 if function is successful
+	if (file->num_extents == file->max_extents) {
+		size = (file->max_extents == 0) ? FILE_EXTENTS_START : file->max_extents * 2;
+		if (NULL == (ext = realloc(file->extents, size * sizeof(file_extent)))) {
+			return (-1);
+		}
+		file->extents = ext;
+		file->max_extents = size;
+	}
+	ext = &file->extents[file->num_extents++];
+	ext->first = file->num_sectors;
+	ext->start = start;
+	ext->length = count;
+	file->num_sectors += count;
 	return (0);
 }
 
-uint32_t fs3_net_read( uint16_t track, uint16_t sector, void *buf) {
-	uint16_t sec = 0;
-	uint8_t op = 0, ret = 0;
-	FS3CmdBlk cmd_blk = 0;
-	FS3CmdBlk ret_cmd_blk = 0;
-	uint32_t trk = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_append
+// Description  : Adds an extent to the end of a sector map being built,
+//                growing the last one when it continues it
+//
+// Inputs       : exts - the extents
+//                n - the number of extents, updated
+//                first, start, length - the extent
+// Outputs      : none
 
-    	//creates command block to seek to the given track/sector
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_TSEEK, 0, track, 0);
-    
-    	// passes the command block to the fs3syscall
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, NULL);
-    
-    	//deconstructs the return value from command block after being passed through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fail
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-    	// constructs command block to read from given sector associated with the file
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_RDSECT, sector, 0, 0);
-    
-    	// passes the command block to fs3syscall 
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, buf);
-    
-    	// deconstructs the command block to get the return values after passed through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fail
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
+void extent_append(file_extent *exts, uint32_t *n, uint32_t first, uint32_t start, uint32_t length) {
+	file_extent *last = (*n > 0) ? &exts[*n - 1] : NULL;
 
-	return 1;
+	if ((last != NULL) && (last->first + last->length == first) && (last->start + last->length == start)) {
+		last->length += length;
+		return;
+	}
+	exts[*n].first = first;
+	exts[*n].start = start;
+	exts[*n].length = length;
+	(*n)++;
 }
 
-int32_t fs3_read_first_twenty(int16_t fd, void *buf, int32_t count) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_remap_sectors
+// Description  : Points sectors of a file's sector map at a new run, the
+//                caller has the file locked alone
+//
+// Inputs       : fd - the file handle
+//                index - the index of the first sector moved
+//                start - the sector id of the first sector of the new run
+//                count - the length of the run (the sectors are in the map)
+// Outputs      : 0 if successful, -1 if failure
 
-	//initialising the variables of the function
-	FS3CmdBlk cmd_blk = 0;
-	FS3CmdBlk ret_cmd_blk = 0;
-	uint8_t op = 0, ret = 0;
-	uint16_t sec = 0;
-	uint32_t trk = 0;
-	//intialising the temp buffer 
-	uint8_t temp_buf[FS3_SECTOR_SIZE*512];
+int file_remap_sectors(int16_t fd, uint32_t index, uint32_t start, uint32_t count) {
+	file_t *file = FILE_HANDLER(fd);
+	file_extent *exts = NULL, *ext = NULL;
+	uint32_t i = 0, n = 0, skip = 0, size = file->num_extents + 2;
+	uint32_t end = index + count;
 
-	// check if file handle is valid
-	if ((fd < 0) || (fd >= MAX_FILES)) {
-		return(-1);
+	// the map is built again, an extent the run falls in is split around it
+	if (NULL == (exts = malloc(size * sizeof(file_extent)))) {
+		return (-1);
 	}
-	//checks if the file is open
-	if (file_handlers[fd].file_state != FILE_OPEN) {
-		return(-1);
+	for (i = 0; i < file->num_extents; i++) {
+		ext = &file->extents[i];
+		if (ext->first < index) {
+			extent_append(exts, &n, ext->first, ext->start,
+			              (ext->length < index - ext->first) ? ext->length : index - ext->first);
+		}
+		if ((index >= ext->first) && (index < ext->first + ext->length)) {
+			extent_append(exts, &n, index, start, count);
+		}
+		if (ext->first + ext->length > end) {
+			skip = (end > ext->first) ? end - ext->first : 0;
+			extent_append(exts, &n, ext->first + skip, ext->start + skip, ext->length - skip);
+		}
 	}
-	// reset count if the data to be written is more than the free space in the sector 
-	// initializing the variables used 
-    uint32_t cur_pos = file_handlers[fd].pos;
-    uint32_t remaining_count = count;
-    uint32_t read_index = 0;
-    uint8_t sector_buf[FS3_SECTOR_SIZE];
-    int16_t sector_index = 0;
-	uint32_t bytes_to_read = 0;
-    void* cache_data = NULL;
-	uint16_t track = 0, sector = 0;
-
-	// checking if there is any more bytes to read
-    while (remaining_count > 0) {
-		// checking if there is enough space in the sector to write to cache
-        if (((cur_pos % FS3_SECTOR_SIZE) + remaining_count) > FS3_SECTOR_SIZE) {
-            bytes_to_read = FS3_SECTOR_SIZE - (cur_pos % FS3_SECTOR_SIZE);
-        } else {
-            bytes_to_read = remaining_count; // holds the remaining bytes
-        }
-		// calculates the final index in sector
-        sector_index = cur_pos / FS3_SECTOR_SIZE; 
-		// calculating the track and sector based on file_handlers
- 		track = file_handlers[fd].sector_id[sector_index] / FS3_TRACK_SIZE;
- 		sector = file_handlers[fd].sector_id[sector_index] % FS3_TRACK_SIZE;
-
-		//check whether pre-existing cache data
-        if (NULL != (cache_data = fs3_get_cache(track, sector))) 
-		{	
-			// we store the cache in temp buffer
-    	    memcpy(&temp_buf[read_index], cache_data, bytes_to_read);\
-			// remove the read portion to remaining count
-            remaining_count -= bytes_to_read;
-			// add to current position/read index
-            cur_pos += bytes_to_read;
-            read_index += bytes_to_read;
-            continue;
-        }
+	free(file->extents);
+	file->extents = exts;
+	file->num_extents = n;
+	file->max_extents = size;
+	__atomic_store_n(&file->cur_extent, 0, __ATOMIC_RELAXED);
+
+	for (i = 0; (NULL != sector_owner) && (i < count); i++) {
+		__atomic_store_n(&sector_owner[start + i], SECTOR_OWNER(fd, index + i), __ATOMIC_RELAXED);
+	}
+	return (0);
+}
 
-    	// constructs command block to seek to the sector/track of the given file
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_TSEEK, 0, track, 0);
-    
-    	// passing command block to fs3syscall 
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, NULL);
-    
-    	//deconstruct the return values from the command block after passing through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fs3syscall failed
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-    	//constructs command block to read from the given track/sector
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_RDSECT, sector, 0, 0);
-    	
-    	//passes the command block to fs3 syscall
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, sector_buf);
-    
-    	// deconstructs the return values from the command block after it is passed through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    	
-    	// returns -1 if fs3syscall fails
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-		// store the sector index as a buffer
-    	memcpy(&temp_buf[read_index], &(sector_buf[cur_pos % FS3_SECTOR_SIZE]),bytes_to_read);
-
-		// inputting current track/sector/sector buffer to cache
-        fs3_put_cache(track, sector, sector_buf);
-		// modifying our cache counts based on read values
-        remaining_count -= bytes_to_read;
-        cur_pos += bytes_to_read;
-        read_index += bytes_to_read;
-    }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : path_hash
+// Description  : Hashes a path for the path index (FNV-1a)
+//
+// Inputs       : path - the path
+// Outputs      : the hash
 
-    // extract data based on what is returned by fs3syscall 
-    memcpy(buf, temp_buf, count);
+uint32_t path_hash(const char *path) {
+	uint32_t hash = 2166136261u;
 
-	// returns the number of bytes that has been read
-	return (count);
+	while (*path != '\0') {
+		hash = (hash ^ (uint8_t) *path++) * 16777619u;
+	}
+	return (hash);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_read
-// Description  : Reads "count" bytes from the file handle "fh" into the 
-//                buffer "buf"
+// Function     : path_index_find
+// Description  : Looks up the file handle of a path (the caller holds the
+//                open lock)
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
-
-int32_t fs3_read(int16_t fd, void *buf, int32_t count) {
+// Inputs       : path - the path
+//                hash - the hash of the path
+// Outputs      : the file handle, -1 if the path has no file
 
-	//initialising the variables of the function
-	FS3CmdBlk cmd_blk = 0;
-	FS3CmdBlk ret_cmd_blk = 0;
-	uint8_t op = 0, ret = 0;
-	uint16_t sec = 0;
-	uint32_t trk = 0;
-	//intialising the temp buffer 
-	uint8_t temp_buf[FS3_SECTOR_SIZE*512];
+int32_t path_index_find(const char *path, uint32_t hash) {
+	int32_t fd = -1;
 
-	// check if file handle is valid
-	if ((fd < 0) || (fd >= MAX_FILES)) {
-		return(-1);
+	if (path_index == NULL) {
+		return (-1);
+	}
+	for (fd = path_index[hash & (path_index_size - 1)]; fd != -1; fd = FILE_HANDLER(fd)->path_next) {
+		if ((FILE_HANDLER(fd)->path_hash == hash) && (0 == strcmp(path, FILE_HANDLER(fd)->path))) {
+			return (fd);
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : path_index_add
+// Description  : Adds a file to the path index, doubling the buckets when
+//                there are more files than buckets (the caller holds the
+//                open lock)
+//
+// Inputs       : fd - the newest file handle (path and path_hash are set)
+// Outputs      : 0 if successful, -1 if failure
+
+int path_index_add(int32_t fd) {
+	uint32_t size = 0, i = 0, bucket = 0;
+	int32_t *index = NULL;
+
+	if ((uint32_t) fd + 1 > path_index_size) {
+		// rehash every file into a bigger table
+		size = (path_index_size == 0) ? PATH_INDEX_START : path_index_size * 2;
+		if (NULL == (index = malloc(size * sizeof(int32_t)))) {
+			return (-1);
+		}
+		memset(index, 0xff, size * sizeof(int32_t));
+		for (i = 0; i < (uint32_t) fd; i++) {
+			bucket = FILE_HANDLER(i)->path_hash & (size - 1);
+			FILE_HANDLER(i)->path_next = index[bucket];
+			index[bucket] = i;
+		}
+		free(path_index);
+		path_index = index;
+		path_index_size = size;
+	}
+
+	bucket = FILE_HANDLER(fd)->path_hash & (path_index_size - 1);
+	FILE_HANDLER(fd)->path_next = path_index[bucket];
+	path_index[bucket] = fd;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_lock
+// Description  : Locks an open file, shared for reads and flushes and
+//                exclusive for anything that changes it
+//
+// Inputs       : fd - the file handle
+//                exclusive - take the lock exclusive
+// Outputs      : the file, NULL if the handle is bad or the file not open
+
+file_t *file_lock(int16_t fd, int exclusive) {
+	file_t *file = NULL;
+
+	// check if file handle is valid
+	if ((fd < 0) || ((uint32_t) fd >= __atomic_load_n(&next_free_handle, __ATOMIC_ACQUIRE))) {
+		return (NULL);
+	}
+	file = FILE_HANDLER(fd);
+	if (exclusive) {
+		pthread_rwlock_wrlock(&file->lock);
+	} else {
+		pthread_rwlock_rdlock(&file->lock);
 	}
 	//checks if the file is open
-	if (file_handlers[fd].file_state != FILE_OPEN) {
+	if (file->file_state != FILE_OPEN) {
+		pthread_rwlock_unlock(&file->lock);
+		return (NULL);
+	}
+	return (file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_unlock
+// Description  : Unlocks a file locked with file_lock
+//
+// Inputs       : file - the file
+// Outputs      : none
+
+void file_unlock(file_t *file) {
+	pthread_rwlock_unlock(&file->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_open
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t fs3_do_open(char *path) {
+	// declaring the variables that we are using for this function
+	int32_t i = 0;
+	int16_t free_handle = -1;
+	uint32_t hash = path_hash(path);
+	file_t *file = NULL;
+
+	pthread_mutex_lock(&fs3_open_lock);
+	// check whether file exists in the file system
+	if (-1 != (i = path_index_find(path, hash))) {
+		file = FILE_HANDLER(i);
+		pthread_rwlock_wrlock(&file->lock);
+		pthread_mutex_unlock(&fs3_open_lock);
+		//if the file is open, we return -1 
+		if (file->file_state == FILE_OPEN) { 
+			pthread_rwlock_unlock(&file->lock);
+			return(-1);
+		}
+		// otherwise reset the read/write pointer and file state
+		file->pos = 0; 
+		file->file_state = FILE_OPEN;
+		fs3_readahead_reset(i);
+		pthread_rwlock_unlock(&file->lock);
+		//return filehandler as output
+		return(i); 
+	}
+	// returns -1 if no free file handler is found (handles have to fit the int16_t)
+	if ((next_free_handle >= MAX_FILES) || (next_free_handle > INT16_MAX)) {
+		pthread_mutex_unlock(&fs3_open_lock);
 		return(-1);
 	}
-	// reset count if the data to be written is more than the free space in the sector 
-	if (count > (file_handlers[fd].len - file_handlers[fd].pos)) {
-		count = file_handlers[fd].len - file_handlers[fd].pos + 1;
+	// add a chunk to the handle table when it is full
+	free_handle = next_free_handle;
+	if (NULL == file_chunks[free_handle / FILE_HANDLERS_START]) {
+		file_chunks[free_handle / FILE_HANDLERS_START] = calloc(FILE_HANDLERS_START, sizeof(file_t));
+		if (NULL == file_chunks[free_handle / FILE_HANDLERS_START]) {
+			pthread_mutex_unlock(&fs3_open_lock);
+			return(-1);
+		}
 	}
-	// initializing the variables used 
-    uint32_t cur_pos = file_handlers[fd].pos;
-    uint32_t remaining_count = count;
-    uint32_t read_index = 0;
-    uint8_t sector_buf[FS3_SECTOR_SIZE];
-    int16_t sector_index = 0;
-	uint32_t bytes_to_read = 0;
-    void* cache_data = NULL;
-	uint16_t track = 0, sector = 0;
 
-	// checking if there is any more bytes to read
-    while (remaining_count > 0) {
-		// checking if there is enough space in the sector to write to cache
-        if (((cur_pos % FS3_SECTOR_SIZE) + remaining_count) > FS3_SECTOR_SIZE) {
-            bytes_to_read = FS3_SECTOR_SIZE - (cur_pos % FS3_SECTOR_SIZE);
-        } else {
-            bytes_to_read = remaining_count; // holds the remaining bytes
-        }
-		// calculates the final index in sector
-        sector_index = cur_pos / FS3_SECTOR_SIZE; 
-		// calculating the track and sector based on file_handlers
- 		track = file_handlers[fd].sector_id[sector_index] / FS3_TRACK_SIZE;
- 		sector = file_handlers[fd].sector_id[sector_index] % FS3_TRACK_SIZE;
-
-		//check whether pre-existing cache data
-        if (NULL != (cache_data = fs3_get_cache(track, sector))) 
-		{	
-			// we store the cache in temp buffer
-    	    memcpy(&temp_buf[read_index], cache_data, bytes_to_read);\
-			// remove the read portion to remaining count
-            remaining_count -= bytes_to_read;
-			// add to current position/read index
-            cur_pos += bytes_to_read;
-            read_index += bytes_to_read;
-            continue;
-        }
+	//saving the details of the file in the file handlers array and reset the position/length of the file
+	file = FILE_HANDLER(free_handle);
+	file->num_sectors = 0;
+	file->len = 0;
+	file->pos = 0;
+	file->path = calloc(strlen(path)+1, sizeof(char));
+	strcpy(file->path, path);
+	file->path_hash = hash;
+	file->file_state = FILE_OPEN;
+	fs3_readahead_reset(free_handle);
+	if (-1 == path_index_add(free_handle)) {
+		free(file->path);
+		file->path = NULL;
+		pthread_mutex_unlock(&fs3_open_lock);
+		return(-1);
+	}
+	pthread_rwlock_init(&file->lock, NULL);
+	pthread_mutex_init(&file->meta, NULL);
 
-    	// constructs command block to seek to the sector/track of the given file
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_TSEEK, 0, track, 0);
-    
-    	// passing command block to fs3syscall 
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, NULL);
-    
-    	//deconstruct the return values from the command block after passing through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fs3syscall failed
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-    	//constructs command block to read from the given track/sector
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_RDSECT, sector, 0, 0);
-    	
-    	//passes the command block to fs3 syscall
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, sector_buf);
-    
-    	// deconstructs the return values from the command block after it is passed through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    	
-    	// returns -1 if fs3syscall fails
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-		// store the sector index as a buffer
-    	memcpy(&temp_buf[read_index], &(sector_buf[cur_pos % FS3_SECTOR_SIZE]),bytes_to_read);
-
-		// inputting current track/sector/sector buffer to cache
-        fs3_put_cache(track, sector, sector_buf);
-		// modifying our cache counts based on read values
-        remaining_count -= bytes_to_read;
-        cur_pos += bytes_to_read;
-        read_index += bytes_to_read;
-    }
+	// the handle can be used from other threads once it is counted
+	__atomic_store_n(&next_free_handle, free_handle + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fs3_open_lock);
+
+	//returns the file handle 
+	return (free_handle);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_by_start
+// Description  : Orders extents by where they are on the disk (for qsort)
+//
+// Inputs       : a, b - the extents
+// Outputs      : <0, 0 or >0 as a is before, at or after b
 
-    // extract data based on what is returned by fs3syscall 
-    memcpy(buf, temp_buf, count);
+int extent_by_start(const void *a, const void *b) {
+	uint32_t sa = ((const file_extent *) a)->start, sb = ((const file_extent *) b)->start;
 
-    file_handlers[fd].pos += count;
-	// returns the number of bytes that has been read
-	return (count);
+	return ((sa > sb) - (sa < sb));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_write
-// Description  : Writes "count" bytes to the file handle "fh" from the 
-//                buffer  "buf"
+// Function     : file_flush
+// Description  : Writes back the parts of a file held dirty in the cache,
+//                the caller has the file locked
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs       : file - the file
+// Outputs      : 0 if successful, -1 if failure
 
-int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
-	//initialising the variables of the function
+int file_flush(file_t *file) {
+	uint32_t i = 0, id = 0;
+	file_extent *exts = file->extents;
+	int ret = 0;
+
+	// write back each sector of the file in disk order, a track at a time
+	if (file->num_extents > 1) {
+		if (NULL == (exts = malloc(file->num_extents * sizeof(file_extent)))) {
+			return(-1);
+		}
+		memcpy(exts, file->extents, file->num_extents * sizeof(file_extent));
+		qsort(exts, file->num_extents, sizeof(file_extent), extent_by_start);
+	}
+	for (i = 0; (i < file->num_extents) && (ret == 0); i++) {
+		for (id = exts[i].start; (id < exts[i].start + exts[i].length) && (ret == 0); id++) {
+			ret = fs3_flush_cache_sector(id / FS3_TRACK_SIZE, id % FS3_TRACK_SIZE);
+		}
+	}
+	if (exts != file->extents) {
+		free(exts);
+	}
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_close
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_do_close(int16_t fd) {
+	file_t *file = NULL;
+
+	// check if file handle is valid and the file is open
+	if (NULL == (file = file_lock(fd, TRUE))) {
+		return(-1);
+	}
+	// write back the buffered writes and the file contents held dirty in the cache
+	if ((-1 == file_buffer_flush(fd, file)) || (-1 == file_flush(file))) {
+		file_unlock(file);
+		return(-1);
+	}
+	//resets file read/write pointer and file state
+	file->pos = 0;
+	file->file_state = FILE_CLOSE;
+	file_unlock(file);
+
+	//return 0 if function is successful
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_net_begin
+// Description  : Gets the connection to the controller for a thread. A
+//                connection that takes commands from any thread is shared
+//                and the thread keeps its own track; any other one is
+//                locked for the thread until fs3_net_end.
+//
+// Inputs       : none
+// Outputs      : the track the controller is on for the thread
+
+int32_t *fs3_net_begin(void) {
+	uint32_t mount = 0;
+
+	if (network_fs3_concurrent()) {
+		mount = __atomic_load_n(&fs3_mount_count, __ATOMIC_ACQUIRE);
+		if (fs3_thread_mount != mount) {
+			fs3_thread_mount = mount;
+			fs3_thread_track = -1;
+		}
+		return (&fs3_thread_track);
+	}
+	pthread_mutex_lock(&fs3_net_lock);
+	return (&fs3_cur_track);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_net_end
+// Description  : Gives back the connection got with fs3_net_begin
+//
+// Inputs       : head - the track returned by fs3_net_begin
+// Outputs      : none
+
+void fs3_net_end(int32_t *head) {
+	if (head == &fs3_cur_track) {
+		pthread_mutex_unlock(&fs3_net_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_net_seek
+// Description  : Moves the controller to a track, the TSEEK is skipped if
+//                the controller is already there
+//
+// Inputs       : head - the track the controller is on (from fs3_net_begin)
+//                track - the track to seek to
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_net_seek(int32_t *head, uint16_t track) {
+	uint16_t sec = 0;
+	uint8_t op = 0, ret = 0;
 	FS3CmdBlk cmd_blk = 0;
 	FS3CmdBlk ret_cmd_blk = 0;
 	uint32_t trk = 0;
-	uint8_t op = 0, ret = 0;
+
+	if (*head == track) {
+		DRIVER_COUNT(fs3_seeks_elided, 1);
+		return (0);
+	}
+
+	//creates command block to seek to the given track
+	cmd_blk = construct_fs3_cmdblock(FS3_OP_TSEEK, 0, track, 0);
+	DRIVER_COUNT(fs3_seeks_issued, 1);
+	if (-1 == network_fs3_syscall(cmd_blk, &ret_cmd_blk, NULL)) {
+		*head = -1;
+		return (-1);
+	}
+	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
+	if (ret==FAIL) {
+		// no telling where a failed seek left the controller
+		*head = -1;
+		return (-1);
+	}
+	*head = track;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_net_rdsect
+// Description  : Reads a sector of the track the controller is on
+//
+// Inputs       : head - the track the controller is on (from fs3_net_begin)
+//                sector - the sector in the track
+//                buf - buffer for the sector contents
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_net_rdsect(int32_t *head, uint16_t sector, void *buf) {
 	uint16_t sec = 0;
-	//initialising the temp buffer
-	uint8_t temp_buf[FS3_SECTOR_SIZE];
-	uint16_t copy_count;
+	uint8_t op = 0, ret = 0;
+	FS3CmdBlk cmd_blk = 0;
+	FS3CmdBlk ret_cmd_blk = 0;
+	uint32_t trk = 0;
 
-	// check if file handle is valid
-	if ((fd < 0) || (fd >= MAX_FILES)) {
-		return(-1);
+	// constructs command block to read from given sector
+	cmd_blk = construct_fs3_cmdblock(FS3_OP_RDSECT, sector, 0, 0);
+	if (-1 == network_fs3_syscall(cmd_blk, &ret_cmd_blk, buf)) {
+		*head = -1;
+		return (-1);
 	}
-	// checking whether the file is open
-	if (file_handlers[fd].file_state != FILE_OPEN) {
-		return(-1);
+	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
+	if (ret==FAIL) {
+		*head = -1;
+		return (-1);
 	}
+	return (0);
+}
 
-	// checking if there is not enough space in sector
-	//if (file_handlers[fd].pos + count > FS3_SECTOR_SIZE*10) {
-	//	return(-1);
-	//}
-	// initializing variables used
-    uint32_t cur_count = count;
-    int16_t sector_index = 0;
-    uint16_t copy_index = 0, read_index = 0;
-    uint16_t track = 0, sector_id = 0,sector = 0,vacancy = 0;
+uint32_t fs3_net_read( uint16_t track, uint16_t sector, void *buf) {
+	int32_t *head = fs3_net_begin();
+	uint32_t ret = 1;
 
+	//seek to the track then read the sector
+	if ((-1 == fs3_net_seek(head, track)) || (-1 == fs3_net_rdsect(head, sector, buf))) {
+		ret = -1;
+	}
+	fs3_net_end(head);
+	return (ret);
+}
 
-	// loop through bytes to write 
-    while (cur_count > 0) {
-		//checking if space is available to write in sector
-        sector_index = (file_handlers[fd].pos)/FS3_SECTOR_SIZE;
-		// if there is not enough space, we write in next sector the remaining bytes
-        if (sector_index+1 > file_handlers[fd].num_sectors) {
-            if (FALSE == get_free_sector(&track, &sector)) {
-                return(-1);
-            }
-			// we copy the sector id/track id to file_handlers so we can write remaining bytes
-			sector_usage[track][sector] = TRUE;
-            file_handlers[fd].num_sectors++;
-	        sector_id = ((track)*FS3_TRACK_SIZE) + sector;
-            file_handlers[fd].sector_id[(file_handlers[fd].num_sectors)-1] = sector_id;
-        } else {
-           sector_id = file_handlers[fd].sector_id[sector_index];
-        }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sched_sort
+// Description  : Puts sector operations in C-LOOK order, one sweep up the
+//                tracks from the one the controller is on, wrapping around
+//                to the lowest, in sector order on each track. The sort is
+//                stable so operations on the same sector keep their order
+//                (a read after a write sees it).
+//
+// Inputs       : ops - the operations
+//                n - number of operations
+//                head - the track the controller is on, -1 if not known
+// Outputs      : number of operations that moved
+
+uint16_t sched_sort(sched_op *ops, uint16_t n, int32_t head) {
+	uint16_t i = 0, j = 0, moved = 0;
+	uint32_t start = (head < 0) ? 0 : head, track = 0;
+	sched_op op;
+
+	for (i = 0; i < n; i++) {
+		track = ops[i].sector_id / FS3_TRACK_SIZE;
+		ops[i].key = (((uint64_t) ((track + FS3_MAX_TRACKS - start) % FS3_MAX_TRACKS)) << 16) |
+		             (ops[i].sector_id % FS3_TRACK_SIZE);
+	}
+	// insertion sort, a batch is short and mostly in order already
+	for (i = 1; i < n; i++) {
+		op = ops[i];
+		for (j = i; (j > 0) && (ops[j - 1].key > op.key); j--) {
+			ops[j] = ops[j - 1];
+		}
+		if (j != i) {
+			ops[j] = op;
+			moved++;
+		}
+	}
+	return (moved);
+}
 
- 	track = sector_id / FS3_TRACK_SIZE;
- 	sector = sector_id % FS3_TRACK_SIZE;
-	//calculating the remaining bytes available in the sector
-        vacancy = FS3_SECTOR_SIZE - ((file_handlers[fd].pos) % FS3_SECTOR_SIZE);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_sched_dispatch
+// Description  : Issues sector operations in one pipelined batch, in C-LOOK
+//                order with one TSEEK per track visited. If the controller
+//                has the multi-sector commands, operations of the same kind
+//                on sectors next to each other on the disk and in memory go
+//                in one RDSECTS or WRSECTS. RDTRACK is never issued, a
+//                batch is at most BATCH_SECTORS sectors and never covers a
+//                track; only the controllers serve it.
+//
+// Inputs       : ops - the operations, they are reordered
+//                n - number of operations (at most BATCH_SECTORS)
+// Outputs      : 0 if successful, -1 if failure
 
-	// we check if vacancy is enough to copy the remaining code 
-	// decrementing current count to check how much space is left in sector
-        if (cur_count > vacancy) {
-            copy_count = vacancy;
-        } else {
-            copy_count = cur_count;
-        }
-        cur_count -= copy_count;
+int fs3_sched_dispatch(sched_op *ops, uint16_t n) {
+	FS3CmdBlk cmds[BATCH_SECTORS * 2], rets[BATCH_SECTORS * 2];
+	void *cmd_bufs[BATCH_SECTORS * 2];
+	int32_t *head = NULL, track = -1;
+	uint16_t i = 0, cnt = 0, run = 0, seeks = 0, moved = 0;
+	uint32_t depth = 0;
+	uint8_t multi_op = 0;
 
-    	//creates command block to seek to the given track/sector
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_TSEEK, 0, track, 0);
-    
-    	// passes the command block to the fs3syscall
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, NULL);
-    
-    	//deconstructs the return value from command block after being passed through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fail
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-    	// constructs command block to read from given sector associated with the file
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_RDSECT, sector, 0, 0);
-    
-    	// passes the command block to fs3syscall 
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, temp_buf);
-    
-    	// deconstructs the command block to get the return values after passed through fs3syscall
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fail
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-		uint8_t *dummy_buffer = (uint8_t *)buf;
-    	memcpy(&(temp_buf[(file_handlers[fd].pos) % FS3_SECTOR_SIZE]),
-               &dummy_buffer[copy_index],
-               copy_count);
-        copy_index += copy_count;
+	if (n > BATCH_SECTORS) {
+		return (-1);
+	}
+	head = fs3_net_begin();
+	track = *head;
+	moved = sched_sort(ops, n, track);
+	for (i = 0; i < n; i++) {
+		multi_op = (ops[i].op == FS3_OP_RDSECT) ? FS3_OP_RDSECTS : FS3_OP_WRSECTS;
+		// the next sector of the same track, right after the last in memory
+		if ((fs3_multisector) && (i > 0) && (ops[i].op == ops[i - 1].op) &&
+		    (ops[i].sector_id == ops[i - 1].sector_id + 1) && (ops[i].sector_id % FS3_TRACK_SIZE != 0) &&
+		    (ops[i].buf == (uint8_t *) ops[i - 1].buf + FS3_SECTOR_SIZE)) {
+			run++;
+			cmds[cnt - 1] = construct_fs3_cmdblock(multi_op, (ops[i].sector_id - run + 1) % FS3_TRACK_SIZE, 0, 0) | run;
+			DRIVER_COUNT(fs3_multi_sectors, (run == 2) ? 2 : 1);
+			DRIVER_COUNT(fs3_multi_cmds, (run == 2) ? 1 : 0);
+			continue;
+		}
+		run = 1;
+		if ((int32_t) (ops[i].sector_id / FS3_TRACK_SIZE) != track) {
+			track = ops[i].sector_id / FS3_TRACK_SIZE;
+			cmds[cnt] = construct_fs3_cmdblock(FS3_OP_TSEEK, 0, track, 0);
+			cmd_bufs[cnt++] = NULL;
+			seeks++;
+		} else {
+			DRIVER_COUNT(fs3_seeks_elided, 1);
+		}
+		cmds[cnt] = construct_fs3_cmdblock(ops[i].op, ops[i].sector_id % FS3_TRACK_SIZE, 0, 0);
+		cmd_bufs[cnt++] = ops[i].buf;
+	}
 
-    	// constructs command block to write based on the sector/track
-    	cmd_blk = construct_fs3_cmdblock(FS3_OP_WRSECT, sector, 0, 0);
-    
-    	// passes the command block to fs3syscall 
-    	network_fs3_syscall(cmd_blk, &ret_cmd_blk, temp_buf);
-    
-    	// deconstructs the command block after passing it through fs3syscall 
-    	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
-    
-    	//returns -1 if fail
-    	if (ret==FAIL) {
-    		return (-1);
-    	}
-
-        if (1 == fs3_put_cache(track, sector, &temp_buf[read_index])) {
-            return(-1);
-        }
+	DRIVER_COUNT(fs3_seeks_issued, seeks);
+	DRIVER_COUNT(fs3_sched_seeks, seeks);
+	DRIVER_COUNT(fs3_sched_batches, 1);
+	DRIVER_COUNT(fs3_sched_ops, n);
+	DRIVER_COUNT(fs3_sched_reordered, moved);
+	depth = __atomic_load_n(&fs3_sched_depth_max, __ATOMIC_RELAXED);
+	while ((n > depth) &&
+	       (!__atomic_compare_exchange_n(&fs3_sched_depth_max, &depth, n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)));
+
+	if (-1 == network_fs3_syscall_batch(cmds, rets, cmd_bufs, cnt)) {
+		*head = -1;
+		fs3_net_end(head);
+		return (-1);
+	}
+	*head = track;
+	fs3_net_end(head);
+	return (0);
+}
 
-    	// adjusts file length if the file length increases based on the write pointer
-    	if (((file_handlers[fd].pos) + copy_count) > file_handlers[fd].len)
-    	{	
-    		file_handlers[fd].len = file_handlers[fd].pos + copy_count;
-    	}
-	
-        file_handlers[fd].pos += copy_count;
-    }
-	return (count);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_net_sectors
+// Description  : Reads or writes a list of sectors in one batch through the
+//                scheduler
+//
+// Inputs       : op - FS3_OP_RDSECT or FS3_OP_WRSECT
+//                ids - the sector ids
+//                bufs - the sector buffers
+//                n - number of sectors (at most BATCH_SECTORS)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_net_sectors(uint8_t op, uint32_t *ids, void **bufs, uint16_t n) {
+	sched_op ops[BATCH_SECTORS];
+	uint16_t i = 0;
+
+	if (n > BATCH_SECTORS) {
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		ops[i].sector_id = ids[i];
+		ops[i].op = op;
+		ops[i].buf = bufs[i];
+	}
+	return (fs3_sched_dispatch(ops, n));
 }
 
-// return ???
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_net_writeback
+// Description  : Writes a batch of whole sectors to the controller (this is
+//                the batch write back function of the cache)
+//
+// Inputs       : ids - the sector ids
+//                bufs - the sector contents
+//                n - number of sectors (at most BATCH_SECTORS)
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_net_writeback(uint32_t *ids, void **bufs, uint16_t n) {
+	return (fs3_net_sectors(FS3_OP_WRSECT, ids, bufs, n));
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : fs3_seek
-// Description  : Seek to specific point in the file
+// Function     : fs3_net_write
+// Description  : Writes a whole sector to the controller (this is the write
+//                back function of the cache)
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
+// Inputs       : track - the track of the sector
+//                sector - the sector in the track
+//                buf - the sector contents
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t fs3_seek(int16_t fd, uint32_t loc) {
-	//checks if the file handler is valid
-	if ((fd < 0) || (fd >= MAX_FILES)) {
-		return(-1);
+int fs3_net_write(FS3TrackIndex track, FS3SectorIndex sector, void *buf) {
+	uint16_t sec = 0;
+	uint8_t op = 0, ret = 0;
+	FS3CmdBlk cmd_blk = 0;
+	FS3CmdBlk ret_cmd_blk = 0;
+	uint32_t trk = 0;
+	int32_t *head = fs3_net_begin();
+
+	// get on the track first
+	if (-1 == fs3_net_seek(head, track)) {
+		fs3_net_end(head);
+		return (-1);
 	}
-	// checks if the given file is open
-	if (file_handlers[fd].file_state != FILE_OPEN) {
-		return(-1);
+
+	// constructs command block to write the sector
+	cmd_blk = construct_fs3_cmdblock(FS3_OP_WRSECT, sector, 0, 0);
+	if (-1 == network_fs3_syscall(cmd_blk, &ret_cmd_blk, buf)) {
+		*head = -1;
+		fs3_net_end(head);
+		return (-1);
 	}
-	//checks if the file is big enough to seek
-	if (loc > file_handlers[fd].len) {
-		return(-1);
+	deconstruct_fs3_cmdblock(ret_cmd_blk, &op, &sec, &trk, &ret);
+	if (ret==FAIL) {
+		*head = -1;
+		fs3_net_end(head);
+		return (-1);
 	}
-	// set read/write pointer at the seek position 
-	file_handlers[fd].pos = loc;
-	//returns 0 if successful
+
+	fs3_net_end(head);
 	return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_flush
+// Description  : Writes back the parts of a file held dirty in the cache
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_do_flush(int16_t fd) {
+	file_t *file = NULL;
+	int32_t ret = 0;
+
+	// check if file handle is valid and the file is open
+	if (NULL == (file = file_lock(fd, FALSE))) {
+		return(-1);
+	}
+	// buffered writes go to the cache first, that needs the file alone
+	if (file->wb_len > 0) {
+		file_unlock(file);
+		if ((-1 == file_buffer_sync(fd)) || (NULL == (file = file_lock(fd, FALSE)))) {
+			return(-1);
+		}
+	}
+	ret = file_flush(file);
+	file_unlock(file);
+	return (ret);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readahead_reset
+// Description  : Forgets the read pattern of a file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : none
+
+void fs3_readahead_reset(int16_t fd) {
+	FILE_HANDLER(fd)->ra_end = 0;
+	FILE_HANDLER(fd)->ra_gap = -1;
+	FILE_HANDLER(fd)->ra_len = 0;
+	FILE_HANDLER(fd)->ra_window = 0;
+	FILE_HANDLER(fd)->ra_start = 0;
+	FILE_HANDLER(fd)->ra_next = 0;
+	FILE_HANDLER(fd)->ra_used = 0;
+	FILE_HANDLER(fd)->ra_missed = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readahead_stream
+// Description  : Checks if a read continues the sequential or strided
+//                pattern of the reads before it, and remembers the read
+//                (the caller holds the file's meta lock)
+//
+// Inputs       : fd - the file descriptor
+//                at - the position of the read
+//                count - number of bytes being read
+// Outputs      : 1 if the read is part of a stream, 0 otherwise
+
+int fs3_readahead_stream(int16_t fd, uint64_t at, uint32_t count) {
+	file_t *file = FILE_HANDLER(fd);
+	int64_t gap = (int64_t) at - (int64_t) file->ra_end;
+	int stream = 0;
+
+	// same gap as last time, and the same length if the reads are strided
+	stream = (fs3_readahead_max > 0) && (count > 0) && (file->ra_gap >= 0) &&
+	         (gap == file->ra_gap) && ((gap == 0) || (count == file->ra_len));
+	if (!stream) {
+		// the pattern broke, start over with the next read
+		file->ra_window = 0;
+		file->ra_start = 0;
+		file->ra_next = 0;
+		file->ra_used = 0;
+		file->ra_missed = 0;
+	}
+
+	file->ra_gap = (gap >= 0) ? gap : -1;
+	file->ra_len = count;
+	file->ra_end = at + count;
+	return (stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readahead
+// Description  : Prefetches the sectors the next reads of a stream will
+//                need into the cache. The window doubles while the read-ahead
+//                sectors get used and halves when they are evicted unread.
+//                The window is planned under the file's meta lock, and
+//                read without it.
+//
+// Inputs       : fd - the file descriptor
+//                used - sectors of the window the read found cached
+//                missed - sectors of the window the read found evicted
+// Outputs      : none (read-ahead is only a hint, failures are ignored)
+
+void fs3_readahead(int16_t fd, uint16_t used, uint16_t missed) {
+	file_t *file = FILE_HANDLER(fd);
+	uint64_t stride = 0;
+	uint64_t next = 0; // where the next read starts
+	uint64_t start = 0;
+	uint32_t first = 0, last = 0, i = 0, k = 0;
+	uint16_t ahead = 0, fetch = 0, j = 0;
+	uint32_t ids[FS3_MAX_READAHEAD];
+	void *bufs[FS3_MAX_READAHEAD];
+	int32_t id = 0;
+
+	pthread_mutex_lock(&file->meta);
+	file->ra_used += used;
+	file->ra_missed += missed;
+	stride = file->ra_len + file->ra_gap;
+	next = file->ra_end + file->ra_gap;
+
+	// only issue more once half of the window has been read
+	if ((file->ra_window > 0) && (SECTOR_INDEX_NUMBER(next) + file->ra_window / 2 < file->ra_next)) {
+		pthread_mutex_unlock(&file->meta);
+		return;
+	}
+
+	// size the window on how the last one went
+	if (file->ra_window == 0) {
+		file->ra_window = READAHEAD_START_WINDOW;
+	} else if (file->ra_missed > 0) {
+		file->ra_window = file->ra_window / 2;
+	} else if (file->ra_used > 0) {
+		file->ra_window = file->ra_window * 2;
+	}
+	if (file->ra_window > fs3_readahead_max) {
+		file->ra_window = fs3_readahead_max;
+	}
+	if (file->ra_window == 0) {
+		file->ra_window = 1;
+	}
+	file->ra_used = 0;
+	file->ra_missed = 0;
+
+	// walk the sectors of the predicted reads that have not been read ahead
+	for (k = 0; ahead < file->ra_window; k++) {
+		start = next + k * stride;
+		first = SECTOR_INDEX_NUMBER(start);
+		last = SECTOR_INDEX_NUMBER(start + file->ra_len - 1);
+		if (first >= file->num_sectors) {
+			break;
+		}
+		if (first < file->ra_next) {
+			first = file->ra_next;
+		}
+		for (i = first; (i <= last) && (i < file->num_sectors) && (ahead < file->ra_window); i++) {
+			if (ahead == 0) {
+				file->ra_start = i;
+			}
+			ahead++;
+			file->ra_next = i + 1;
+			id = file_sector_id(fd, i);
+			if (!fs3_cache_contains(id / FS3_TRACK_SIZE, id % FS3_TRACK_SIZE)) {
+				ids[fetch++] = id;
+			}
+		}
+	}
+	pthread_mutex_unlock(&file->meta);
+	if (ahead == 0) {
+		return;
+	}
+	fs3_cache_readahead_window(ahead);
+
+	// read the sectors in one batch first, putting them in the cache can
+	// write back dirty lines
+	for (j = 0; j < fetch; j++) {
+		bufs[j] = batch_buf[j];
+	}
+	if ((fetch == 0) || (-1 == fs3_net_sectors(FS3_OP_RDSECT, ids, bufs, fetch))) {
+		return;
+	}
+	for (j = 0; j < fetch; j++) {
+		fs3_put_cache_prefetch(ids[j] / FS3_TRACK_SIZE, ids[j] % FS3_TRACK_SIZE, batch_buf[j]);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_read_sectors
+// Description  : Reads the sectors of a read that were not cached in one
+//                batch, copies them out and caches them
+//
+// Inputs       : buf - the caller's buffer
+//                pieces - the pieces of the read
+//                n - number of pieces
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_read_sectors(uint8_t *buf, read_piece *pieces, uint16_t n) {
+	uint32_t ids[BATCH_SECTORS];
+	void *bufs[BATCH_SECTORS];
+	uint16_t i = 0;
+
+	// whole sectors go straight into the caller's buffer
+	for (i = 0; i < n; i++) {
+		ids[i] = pieces[i].sector_id;
+		bufs[i] = (pieces[i].len == FS3_SECTOR_SIZE) ? (void *) &buf[pieces[i].to] : (void *) batch_buf[i];
+	}
+	if (-1 == fs3_net_sectors(FS3_OP_RDSECT, ids, bufs, n)) {
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		if (bufs[i] == batch_buf[i]) {
+			memcpy(&buf[pieces[i].to], &batch_buf[i][pieces[i].from], pieces[i].len);
+		}
+		fs3_put_cache_fill(ids[i] / FS3_TRACK_SIZE, ids[i] % FS3_TRACK_SIZE, bufs[i]);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_read
+// Description  : Reads "count" bytes of a file at a position, the caller
+//                has the file locked (shared is enough) and no buffered
+//                bytes are in the range
+//
+// Inputs       : fd - the file handle
+//                file - the file
+//                at - the position to read at
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : 0 if successful, -1 if failure
+
+int file_read(int16_t fd, file_t *file, uint64_t at, uint8_t *buf, uint32_t count) {
+	// initializing the variables used 
+    uint64_t cur_pos = at;
+    uint32_t remaining_count = count;
+    uint32_t read_index = 0;
+    uint32_t sector_index = 0;
+	uint32_t bytes_to_read = 0;
+    const uint8_t *cache_data = NULL;
+	uint16_t track = 0, sector = 0;
+	int32_t sector_id = 0;
+	int stream = 0, in_window = 0;
+	uint32_t ra_start = 0, ra_next = 0;
+	uint16_t ra_used = 0, ra_missed = 0;
+	// the sectors missing from the cache, read in batches
+	read_piece pieces[BATCH_SECTORS];
+	uint16_t pending = 0;
+
+	// see if this read continues a stream worth reading ahead on
+	pthread_mutex_lock(&file->meta);
+	stream = fs3_readahead_stream(fd, at, count);
+	ra_start = file->ra_start;
+	ra_next = file->ra_next;
+	pthread_mutex_unlock(&file->meta);
+
+	// checking if there is any more bytes to read
+    while (remaining_count > 0) {
+		// checking if there is enough space in the sector to write to cache
+        if (((cur_pos % FS3_SECTOR_SIZE) + remaining_count) > FS3_SECTOR_SIZE) {
+            bytes_to_read = FS3_SECTOR_SIZE - (cur_pos % FS3_SECTOR_SIZE);
+        } else {
+            bytes_to_read = remaining_count; // holds the remaining bytes
+        }
+		// calculates the final index in sector
+        sector_index = cur_pos / FS3_SECTOR_SIZE; 
+		// calculating the track and sector based on the file's sector map
+		sector_id = file_sector_id(fd, sector_index);
+ 		track = sector_id / FS3_TRACK_SIZE;
+ 		sector = sector_id % FS3_TRACK_SIZE;
+		in_window = (sector_index >= ra_start) && (sector_index < ra_next);
+
+		if (sector_id == -1) {
+			// past the last sector of the file there is nothing to read
+			memset(&((uint8_t *)buf)[read_index], 0x0, bytes_to_read);
+		} else if (NULL != (cache_data = fs3_cache_pin(track, sector))) {
+			// copy straight out of the pinned cache line if the sector is cached
+            memcpy(&((uint8_t *)buf)[read_index], &cache_data[cur_pos % FS3_SECTOR_SIZE], bytes_to_read);
+            fs3_cache_unpin(cache_data);
+            if (in_window) {
+                ra_used++;
+            }
+        } else {
+            if (in_window) {
+                ra_missed++;
+            }
+			// otherwise read it from the controller with the other missing sectors
+			pieces[pending].sector_id = sector_id;
+			pieces[pending].to = read_index;
+			pieces[pending].from = cur_pos % FS3_SECTOR_SIZE;
+			pieces[pending].len = bytes_to_read;
+			if (++pending == BATCH_SECTORS) {
+				if (-1 == fs3_read_sectors(buf, pieces, pending)) {
+					return (-1);
+				}
+				pending = 0;
+			}
+        }
+
+		// modifying our counts based on read values
+        remaining_count -= bytes_to_read;
+        cur_pos += bytes_to_read;
+        read_index += bytes_to_read;
+    }
+	if ((pending > 0) && (-1 == fs3_read_sectors(buf, pieces, pending))) {
+		return (-1);
+	}
+
+	// get the sectors the next reads of the stream will want
+	if (stream) {
+		fs3_readahead(fd, ra_used, ra_missed);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_buffer_overlaps
+// Description  : Checks if a range of a file has bytes in its write buffer,
+//                the caller has the file locked
+//
+// Inputs       : file - the file
+//                at - the start of the range
+//                count - the length of the range
+// Outputs      : 1 if they overlap, 0 otherwise
+
+int file_buffer_overlaps(file_t *file, uint64_t at, uint32_t count) {
+	return ((file->wb_len > 0) && (at + count > file->wb_pos) && (at < file->wb_pos + file->wb_len));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_claim_read
+// Description  : Locks a file shared and claims the bytes of a read at its
+//                position, moving the position past them
+//
+// Inputs       : fd - the file handle
+//                count - the bytes wanted, set to the bytes claimed
+//                at - set to where the claimed bytes start
+// Outputs      : the file locked shared, NULL if failure
+
+file_t *file_claim_read(int16_t fd, int32_t *count, uint64_t *at) {
+	file_t *file = NULL;
+
+	while (1) {
+		// check if file handle is valid and the file is open, reads share it
+		if (NULL == (file = file_lock(fd, FALSE))) {
+			return(NULL);
+		}
+
+		// claim the bytes at the position, readers of one handle each get their own
+		pthread_mutex_lock(&file->meta);
+		// nothing is read past the end of the file
+		if (*count > (file->len - file->pos)) {
+			*count = file->len - file->pos;
+		}
+		if (!file_buffer_overlaps(file, file->pos, *count)) {
+			break;
+		}
+		// the read wants buffered bytes, write them out and claim again
+		pthread_mutex_unlock(&file->meta);
+		file_unlock(file);
+		if (-1 == file_buffer_sync(fd)) {
+			return(NULL);
+		}
+	}
+	*at = file->pos;
+	file->pos += *count;
+	pthread_mutex_unlock(&file->meta);
+	return(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_read
+// Description  : Reads "count" bytes from the file handle "fh" into the 
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_do_read(int16_t fd, void *buf, int32_t count) {
+	file_t *file = NULL;
+	uint64_t at = 0;
+	int ret = 0;
+
+	if (NULL == (file = file_claim_read(fd, &count, &at))) {
+		return(-1);
+	}
+	ret = (count > 0) ? file_read(fd, file, at, buf, count) : 0;
+	file_unlock(file);
+	// returns the number of bytes that has been read
+	return ((ret == -1) ? -1 : count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_pread
+// Description  : Reads "count" bytes of a file at an offset, the file
+//                position is neither used nor moved
+//
+// Inputs       : fd - the file handle
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                offset - the position in the file to read at
+// Outputs      : bytes read (fewer at the end of the file) if successful,
+//                -1 if failure
+
+int32_t fs3_do_pread(int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	file_t *file = NULL;
+	int ret = 0;
+
+	if (count < 0) {
+		return(-1);
+	}
+	while (1) {
+		if (NULL == (file = file_lock(fd, FALSE))) {
+			return(-1);
+		}
+		// nothing is read past the end of the file
+		if (offset >= file->len) {
+			count = 0;
+		} else if (count > file->len - offset) {
+			count = file->len - offset;
+		}
+		if (!file_buffer_overlaps(file, offset, count)) {
+			break;
+		}
+		// the read wants buffered bytes, write them out and look again
+		file_unlock(file);
+		if (-1 == file_buffer_sync(fd)) {
+			return(-1);
+		}
+	}
+	ret = (count > 0) ? file_read(fd, file, offset, buf, count) : 0;
+	file_unlock(file);
+	return ((ret == -1) ? -1 : count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iov_total
+// Description  : Adds up the lengths of the buffers of a vector
+//
+// Inputs       : iov - the buffers
+//                iovcnt - number of buffers
+// Outputs      : the total length, -1 if the vector is bad or too long
+
+int32_t iov_total(const struct iovec *iov, int iovcnt) {
+	uint64_t total = 0;
+	int i = 0;
+
+	if ((iov == NULL) || (iovcnt < 0)) {
+		return (-1);
+	}
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	return ((total > INT32_MAX) ? -1 : (int32_t) total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_readv
+// Description  : Reads from the file position into several buffers in one
+//                read, filling each before the next. The bytes are claimed
+//                at once and each buffer is read into directly.
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers to read into
+//                iovcnt - number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_do_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t total = iov_total(iov, iovcnt), done = 0, take = 0;
+	file_t *file = NULL;
+	uint64_t at = 0;
+	int ret = 0, i = 0;
+
+	if ((total == -1) || (NULL == (file = file_claim_read(fd, &total, &at)))) {
+		return (-1);
+	}
+	for (i = 0; (i < iovcnt) && (done < total) && (ret != -1); i++) {
+		take = ((int32_t) iov[i].iov_len < total - done) ? (int32_t) iov[i].iov_len : total - done;
+		if (take > 0) {
+			ret = file_read(fd, file, at + done, iov[i].iov_base, take);
+		}
+		done += take;
+	}
+	file_unlock(file);
+	return ((ret == -1) ? -1 : done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : engine_write_held
+// Description  : Sends the sectors the engine's group holds dirty in one
+//                batch; if it fails, every request that held one fails
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int engine_write_held(void) {
+	uint16_t i = 0;
+	int ret = 0;
+
+	ret = fs3_flush_cache_sectors(engine_held, engine_held_count);
+	fs3_engine_batched += engine_held_count;
+	engine_held_count = 0;
+	for (i = 0; i < engine_group_size; i++) {
+		if ((ret == -1) && (engine_group_state[i] & ENGINE_HELD)) {
+			engine_group_state[i] |= ENGINE_FAILED;
+		}
+		engine_group_state[i] &= ~ENGINE_HELD;
+	}
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : engine_hold_sectors
+// Description  : Puts written sectors in the cache dirty for the engine to
+//                send with the rest of its group, a full batch is sent first
+//
+// Inputs       : ids - the sector ids
+//                bufs - the sector contents
+//                n - number of sectors
+// Outputs      : 0 if successful, -1 if failure
+
+int engine_hold_sectors(uint32_t *ids, void **bufs, uint16_t n) {
+	uint16_t i = 0;
+
+	for (i = 0; i < n; i++) {
+		if ((engine_held_count == BATCH_SECTORS) && (-1 == engine_write_held())) {
+			return (-1);
+		}
+		if (-1 == fs3_put_cache_dirty(ids[i] / FS3_TRACK_SIZE, ids[i] % FS3_TRACK_SIZE, bufs[i])) {
+			return (-1);
+		}
+		engine_held[engine_held_count++] = ids[i];
+		engine_group_state[engine_group_cur] |= ENGINE_HELD;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_write_sectors
+// Description  : Merges the pieces of a write into their sectors. The old
+//                contents are only read from the controller for a partial
+//                piece of a sector that is neither new nor cached, and those
+//                reads go in one batch. In write-through mode the sectors
+//                are then written in one batch (the engine holds them for
+//                the batch of its group); in write-back mode the cached
+//                lines are updated and held dirty. Other threads
+//                can evict a line between the check and its use, it is
+//                pinned while it is copied and read again if it went.
+//
+// Inputs       : pieces - the pieces of the write
+//                n - number of pieces
+// Outputs      : 0 if successful, -1 if failure
+
+int fs3_write_sectors(write_piece *pieces, uint16_t n) {
+	uint32_t ids[BATCH_SECTORS], read_ids[BATCH_SECTORS];
+	void *bufs[BATCH_SECTORS], *read_bufs[BATCH_SECTORS];
+	uint16_t i = 0, reads = 0, track = 0, sector = 0;
+	const void *cache_data = NULL;
+
+	// read the old contents that are needed and not cached
+	for (i = 0; i < n; i++) {
+		track = pieces[i].source / FS3_TRACK_SIZE;
+		sector = pieces[i].source % FS3_TRACK_SIZE;
+		pieces[i].read = (!pieces[i].fresh) && (pieces[i].len != FS3_SECTOR_SIZE) && (!fs3_cache_contains(track, sector));
+		if (pieces[i].read) {
+			read_ids[reads] = pieces[i].source;
+			read_bufs[reads++] = batch_buf[i];
+		}
+	}
+	if ((reads > 0) && (-1 == fs3_net_sectors(FS3_OP_RDSECT, read_ids, read_bufs, reads))) {
+		return (-1);
+	}
+	DRIVER_COUNT(fs3_write_reads, reads);
+
+	// merge every sector before touching the cache, a put can evict the line
+	// another piece starts from (the cached copy is never older than the
+	// controller one)
+	for (i = 0; i < n; i++) {
+		track = pieces[i].source / FS3_TRACK_SIZE;
+		sector = pieces[i].source % FS3_TRACK_SIZE;
+		ids[i] = pieces[i].sector_id;
+		if (pieces[i].len == FS3_SECTOR_SIZE) {
+			// a whole sector is written straight from the caller's buffer
+			bufs[i] = pieces[i].data;
+			DRIVER_COUNT(fs3_write_reads_avoided, 1);
+			continue;
+		}
+		bufs[i] = batch_buf[i];
+		if (pieces[i].fresh) {
+			memset(batch_buf[i], 0x0, FS3_SECTOR_SIZE);
+			DRIVER_COUNT(fs3_write_reads_avoided, 1);
+		} else if (!pieces[i].read) {
+			if (NULL != (cache_data = fs3_cache_pin(track, sector))) {
+				memcpy(batch_buf[i], cache_data, FS3_SECTOR_SIZE);
+				fs3_cache_unpin(cache_data);
+				DRIVER_COUNT(fs3_write_reads_avoided, 1);
+			} else if (-1 == (int32_t) fs3_net_read(track, sector, batch_buf[i])) {
+				return (-1);
+			} else {
+				DRIVER_COUNT(fs3_write_reads, 1);
+			}
+		}
+		if (pieces[i].len > 0) {
+			memcpy(&batch_buf[i][pieces[i].offset], pieces[i].data, pieces[i].len);
+		}
+	}
+
+	// the engine sends them with the rest of its group, or right away if
+	// the cache cannot hold them
+	if ((engine_hold_writes) && (0 == engine_hold_sectors(ids, bufs, n))) {
+		return (0);
+	}
+	if (fs3_cache_write_through) {
+		// write the sectors back right away
+		if (-1 == fs3_net_sectors(FS3_OP_WRSECT, ids, bufs, n)) {
+			return (-1);
+		}
+		for (i = 0; i < n; i++) {
+			fs3_put_cache(ids[i] / FS3_TRACK_SIZE, ids[i] % FS3_TRACK_SIZE, bufs[i]);
+		}
+		return (0);
+	}
+
+	// the lines go to the controller on eviction or flush
+	for (i = 0; i < n; i++) {
+		if (-1 == fs3_put_cache_dirty(ids[i] / FS3_TRACK_SIZE, ids[i] % FS3_TRACK_SIZE, bufs[i])) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_write_commit
+// Description  : Moves a write position past written bytes, growing the
+//                file length if the write went past the end
+//
+// Inputs       : file - the file
+//                at - the write position to move
+//                pos - the new position
+// Outputs      : none
+
+void fs3_write_commit(file_t *file, uint64_t *at, uint64_t pos) {
+	*at = pos;
+	// adjusts file length if the file length increases based on the write pointer
+	if (pos > file->len) {
+		file->len = pos;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_write_log
+// Description  : Writes "count" bytes to a file at a position in
+//                log-structured mode. Every sector written goes to the head
+//                of the log and the old copy is freed, so the controller
+//                only sees writes in a row. The caller has the file locked
+//                alone.
+//
+// Inputs       : fd - the file handle
+//                file - the file
+//                at - the position to write at, moved past the bytes written
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int file_write_log(int16_t fd, file_t *file, uint64_t *at, uint8_t *buf, uint32_t count) {
+	write_piece pieces[BATCH_SECTORS];
+	int32_t old[BATCH_SECTORS];
+	uint64_t cur_pos = *at;
+	uint32_t done = 0, first = 0, want = 0, start = 0, moved = 0;
+	uint16_t run = 0, i = 0, copy_count = 0;
+
+	while (done < count) {
+		// the sectors the rest of the write falls in, a batch at a time
+		first = cur_pos / FS3_SECTOR_SIZE;
+		want = (cur_pos + (count - done) + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE - first;
+		if (want > BATCH_SECTORS) {
+			want = BATCH_SECTORS;
+		}
+		if (0 == (run = log_alloc(want, &start))) {
+			return (-1);
+		}
+
+		for (i = 0; i < run; i++) {
+			copy_count = FS3_SECTOR_SIZE - (cur_pos % FS3_SECTOR_SIZE);
+			if (copy_count > count - done) {
+				copy_count = count - done;
+			}
+			old[i] = file_sector_id(fd, first + i);
+			pieces[i].sector_id = start + i;
+			pieces[i].source = old[i];
+			pieces[i].data = &buf[done];
+			pieces[i].offset = cur_pos % FS3_SECTOR_SIZE;
+			pieces[i].len = copy_count;
+			pieces[i].fresh = (old[i] == -1);
+			done += copy_count;
+			cur_pos += copy_count;
+		}
+		if (-1 == fs3_write_sectors(pieces, run)) {
+			return (-1);
+		}
+
+		// the map points at the new copies and the old ones are dead
+		moved = (first < file->num_sectors) ? file->num_sectors - first : 0;
+		if (moved > run) {
+			moved = run;
+		}
+		if ((moved > 0) && (-1 == file_remap_sectors(fd, first, start, moved))) {
+			return (-1);
+		}
+		if ((run > moved) && (-1 == file_add_sectors(fd, start + moved, run - moved))) {
+			return (-1);
+		}
+		for (i = 0; i < moved; i++) {
+			release_sector(old[i]);
+		}
+		DRIVER_COUNT(fs3_log_written, run);
+		fs3_write_commit(file, at, cur_pos);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_write
+// Description  : Writes "count" bytes to a file at a position, the caller
+//                has the file locked alone
+//
+// Inputs       : fd - the file handle
+//                file - the file
+//                at - the position to write at, moved past the bytes written
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int file_write(int16_t fd, file_t *file, uint64_t *at, uint8_t *buf, uint32_t count) {
+	//initialising the variables of the function
+	uint16_t copy_count;
+
+	// initializing variables used
+    uint32_t cur_count = count;
+    uint64_t cur_pos = *at;
+    uint32_t sector_index = 0;
+    uint32_t copy_index = 0;
+    uint16_t track = 0, sector = 0, vacancy = 0;
+    uint32_t want = 0;
+    uint16_t run = 0;
+    // sectors from here on in the map are allocated by this write
+    uint32_t first_new = file->num_sectors;
+    // the pieces of the write, merged in batches
+    write_piece pieces[BATCH_SECTORS];
+    uint16_t pending = 0;
+
+	if (fs3_log_structured) {
+		return (file_write_log(fd, file, at, buf, count));
+	}
+
+	// loop through bytes to write 
+    while (cur_count > 0) {
+		//checking if space is available to write in sector
+        sector_index = cur_pos / FS3_SECTOR_SIZE;
+		// if there is not enough space, we write in next sector the remaining bytes
+        if (sector_index+1 > file->num_sectors) {
+			// allocate a run for the rest of the write in one go (a run stays on one track)
+			want = (cur_count + FS3_SECTOR_SIZE - 1) / FS3_SECTOR_SIZE;
+			if (want > FS3_TRACK_SIZE) {
+				want = FS3_TRACK_SIZE;
+			}
+			run = get_free_sectors(file_sector_id(fd, file->num_sectors - 1), want, &track, &sector);
+            if (run == 0) {
+                return(-1);
+            }
+			// we add the run to the file's sector map so we can write remaining bytes
+			if (-1 == file_add_sectors(fd, ((track)*FS3_TRACK_SIZE) + sector, run)) {
+				return(-1);
+			}
+        }
+
+	//calculating the remaining bytes available in the sector
+        vacancy = FS3_SECTOR_SIZE - (cur_pos % FS3_SECTOR_SIZE);
+
+	// we check if vacancy is enough to copy the remaining code 
+	// decrementing current count to check how much space is left in sector
+        if (cur_count > vacancy) {
+            copy_count = vacancy;
+        } else {
+            copy_count = cur_count;
+        }
+        cur_count -= copy_count;
+
+		// queue the bytes for their sector
+		pieces[pending].sector_id = file_sector_id(fd, sector_index);
+		pieces[pending].source = pieces[pending].sector_id;
+		pieces[pending].data = &((uint8_t *)buf)[copy_index];
+		pieces[pending].offset = cur_pos % FS3_SECTOR_SIZE;
+		pieces[pending].len = copy_count;
+		pieces[pending].fresh = (sector_index >= first_new);
+        copy_index += copy_count;
+        cur_pos += copy_count;
+
+		// merge a full batch into its sectors, on the controller or in the cache
+		if (++pending == BATCH_SECTORS) {
+			if (-1 == fs3_write_sectors(pieces, pending)) {
+				return (-1);
+			}
+			fs3_write_commit(file, at, cur_pos);
+			pending = 0;
+		}
+    }
+	if (pending > 0) {
+		if (-1 == fs3_write_sectors(pieces, pending)) {
+			return (-1);
+		}
+		fs3_write_commit(file, at, cur_pos);
+	}
+	return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_now_us
+// Description  : Reads the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in microseconds
+
+uint64_t fs3_now_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_now_ms
+// Description  : Reads the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in milliseconds
+
+uint64_t fs3_now_ms(void) {
+	return (fs3_now_us() / 1000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_buffer_flush
+// Description  : Writes out the write buffer of a file, the caller has the
+//                file locked alone
+//
+// Inputs       : fd - the file handle
+//                file - the file
+// Outputs      : 0 if successful, -1 if failure
+
+int file_buffer_flush(int16_t fd, file_t *file) {
+	uint64_t at = file->wb_pos;
+	uint16_t len = file->wb_len;
+
+	if (len == 0) {
+		return (0);
+	}
+	// the bytes are gone from the buffer either way
+	file->wb_len = 0;
+	__atomic_sub_fetch(&fs3_buffered_files, 1, __ATOMIC_RELAXED);
+	DRIVER_COUNT(fs3_coalesce_flushes, 1);
+	DRIVER_COUNT(fs3_coalesced_bytes, len);
+	return (file_write(fd, file, &at, file->wb, len));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_buffer_sync
+// Description  : Writes out the write buffer of a file not yet locked
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+
+int file_buffer_sync(int16_t fd) {
+	file_t *file = NULL;
+	int ret = 0;
+
+	if (NULL == (file = file_lock(fd, TRUE))) {
+		return(-1);
+	}
+	ret = file_buffer_flush(fd, file);
+	file_unlock(file);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_buffer_background
+// Description  : A pass of the buffer flusher, it writes out the write
+//                buffers older than fs3_write_coalesce_ms. A file that is
+//                locked is being used, the next pass looks at it again.
+//
+// Inputs       : none
+// Outputs      : none
+
+void file_buffer_background(void) {
+	uint32_t fd = 0, handles = __atomic_load_n(&next_free_handle, __ATOMIC_ACQUIRE);
+	uint64_t now = 0;
+	file_t *file = NULL;
+
+	if (0 == __atomic_load_n(&fs3_buffered_files, __ATOMIC_RELAXED)) {
+		return;
+	}
+	now = fs3_now_ms();
+	for (fd = 0; fd < handles; fd++) {
+		file = FILE_HANDLER(fd);
+		if (0 != pthread_rwlock_trywrlock(&file->lock)) {
+			continue;
+		}
+		if ((file->file_state == FILE_OPEN) && (file->wb_len > 0) && (now - file->wb_time >= fs3_write_coalesce_ms)) {
+			file_buffer_flush(fd, file);
+		}
+		pthread_rwlock_unlock(&file->lock);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_buffer_write
+// Description  : Writes "count" bytes at the file position through the write
+//                buffer. A small write right after the buffered bytes joins
+//                them, and the buffer goes out once its sector is done, it
+//                is full or it is old. A sector or more with nothing
+//                buffered is written straight away.
+//
+// Inputs       : fd - the file handle
+//                file - the file, locked alone
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : 0 if successful, -1 if failure
+
+int file_buffer_write(int16_t fd, file_t *file, uint8_t *buf, uint32_t count) {
+	uint32_t done = 0, take = 0;
+	uint64_t now = fs3_now_ms();
+
+	// buffered bytes waited long enough
+	if ((file->wb_len > 0) && (fs3_write_coalesce_ms > 0) &&
+			(now - file->wb_time >= fs3_write_coalesce_ms) && (-1 == file_buffer_flush(fd, file))) {
+		return (-1);
+	}
+	while (done < count) {
+		// only a write that carries on from the buffered bytes joins them
+		if ((file->wb_len > 0) && (file->pos != file->wb_pos + file->wb_len) &&
+				(-1 == file_buffer_flush(fd, file))) {
+			return (-1);
+		}
+		if ((file->wb_len == 0) && (count - done >= FS3_SECTOR_SIZE)) {
+			return (file_write(fd, file, &file->pos, &buf[done], count - done));
+		}
+		if ((NULL == file->wb) && (NULL == (file->wb = malloc(FS3_SECTOR_SIZE)))) {
+			return (-1);
+		}
+
+		// buffer up to the end of the sector
+		take = FS3_SECTOR_SIZE - (file->pos % FS3_SECTOR_SIZE);
+		if (take > count - done) {
+			take = count - done;
+		}
+		if (file->wb_len == 0) {
+			file->wb_pos = file->pos;
+			file->wb_time = now;
+			__atomic_add_fetch(&fs3_buffered_files, 1, __ATOMIC_RELAXED);
+		} else if (done == 0) {
+			DRIVER_COUNT(fs3_coalesced_writes, 1);
+		}
+		memcpy(&file->wb[file->wb_len], &buf[done], take);
+		file->wb_len += take;
+		done += take;
+		fs3_write_commit(file, &file->pos, file->pos + take);
+
+		if (((file->pos % FS3_SECTOR_SIZE) == 0) || (file->wb_len >= fs3_write_coalesce)) {
+			if (-1 == file_buffer_flush(fd, file)) {
+				return (-1);
+			}
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_write
+// Description  : Writes "count" bytes to the file handle "fh" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_do_write(int16_t fd, void *buf, int32_t count) {
+	file_t *file = NULL;
+	int ret = 0;
+
+	// check if file handle is valid and the file is open, a write has it alone
+	if (NULL == (file = file_lock(fd, TRUE))) {
+		return(-1);
+	}
+	if (fs3_write_coalesce > 0) {
+		ret = file_buffer_write(fd, file, buf, count);
+	} else {
+		ret = file_write(fd, file, &file->pos, buf, count);
+	}
+	file_unlock(file);
+	return ((ret == -1) ? -1 : count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_pwrite
+// Description  : Writes "count" bytes to a file at an offset, the file
+//                position is neither used nor moved. The write is not
+//                buffered, buffered bytes in its range go out first.
+//
+// Inputs       : fd - the file handle
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                offset - the position in the file to write at, at most
+//                         the length of the file
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_do_pwrite(int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	file_t *file = NULL;
+	uint64_t at = offset;
+	int ret = 0;
+
+	if (count < 0) {
+		return(-1);
+	}
+	if (NULL == (file = file_lock(fd, TRUE))) {
+		return(-1);
+	}
+	// like a seek, a write cannot start past the end of the file
+	if (offset > file->len) {
+		file_unlock(file);
+		return(-1);
+	}
+	if (file_buffer_overlaps(file, offset, count)) {
+		ret = file_buffer_flush(fd, file);
+	}
+	if ((ret != -1) && (count > 0)) {
+		ret = file_write(fd, file, &at, buf, count);
+	}
+	file_unlock(file);
+	return ((ret == -1) ? -1 : count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_writev
+// Description  : Writes several buffers one after the other at the file
+//                position in one write, each straight from its buffer with
+//                the file held alone
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers to write from
+//                iovcnt - number of buffers
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_do_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t total = iov_total(iov, iovcnt);
+	file_t *file = NULL;
+	int ret = 0, i = 0;
+
+	if ((total == -1) || (NULL == (file = file_lock(fd, TRUE)))) {
+		return (-1);
+	}
+	// small buffers in a row gather in the write buffer like small writes
+	for (i = 0; (i < iovcnt) && (ret != -1); i++) {
+		if (iov[i].iov_len == 0) {
+			continue;
+		}
+		if (fs3_write_coalesce > 0) {
+			ret = file_buffer_write(fd, file, iov[i].iov_base, iov[i].iov_len);
+		} else {
+			ret = file_write(fd, file, &file->pos, iov[i].iov_base, iov[i].iov_len);
+		}
+	}
+	file_unlock(file);
+	return ((ret == -1) ? -1 : total);
+}
+
+// return ???
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_driver_metrics
+// Description  : Log the metrics for the driver
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_log_driver_metrics(void) {
+    printf("fs3_write sector reads count: %d, reads avoided count: %d \n",
+           fs3_write_reads, fs3_write_reads_avoided);
+    printf("fs3_driver seeks issued count: %d, seeks elided count: %d \n",
+           fs3_seeks_issued, fs3_seeks_elided);
+    printf("fs3_driver multi-sector commands count: %d, sectors count: %d \n",
+           fs3_multi_cmds, fs3_multi_sectors);
+    printf("fs3_driver async requests count: %d, most queued count: %d \n",
+           fs3_async_requests, fs3_queue_depth_max);
+    printf("fs3_driver request groups count: %d, sectors batched count: %d \n",
+           fs3_engine_groups, fs3_engine_batched);
+    printf("fs3_driver coalesced writes count: %d, buffer flushes count: %d, bytes per flush: %.2f \n",
+           fs3_coalesced_writes, fs3_coalesce_flushes,
+           (fs3_coalesce_flushes > 0) ? (double)fs3_coalesced_bytes / fs3_coalesce_flushes : 0.0);
+    // the cleaner can still be running
+    printf("fs3_log segments opened count: %d, cleaned count: %d, sectors moved count: %d \n",
+           __atomic_load_n(&fs3_log_segments, __ATOMIC_RELAXED), __atomic_load_n(&fs3_log_cleaned, __ATOMIC_RELAXED),
+           __atomic_load_n(&fs3_log_moved, __ATOMIC_RELAXED));
+    printf("fs3_log cleaner time: %.2f ms, write amplification: %.2f \n",
+           __atomic_load_n(&fs3_log_clean_us, __ATOMIC_RELAXED) / 1000.0,
+           (fs3_log_written > 0) ? (double) (fs3_log_written + __atomic_load_n(&fs3_log_moved, __ATOMIC_RELAXED)) / fs3_log_written : 0.0);
+    printf("fs3_sched batches count: %d, average depth: %.2f, most depth: %d, reordered count: %d, seeks per op: %.3f \n",
+           fs3_sched_batches, (fs3_sched_batches > 0) ? (double) fs3_sched_ops / fs3_sched_batches : 0.0,
+           fs3_sched_depth_max, fs3_sched_reordered,
+           (fs3_sched_ops > 0) ? (double) fs3_sched_seeks / fs3_sched_ops : 0.0);
+    // of the files moved, as they were just before and after
+    printf("fs3_defrag files moved count: %d, sectors moved count: %d \n",
+           fs3_defrag_files, fs3_defrag_sectors);
+    printf("fs3_defrag tracks per file: %.2f before, %.2f after, seeks per file read: %.2f before, %.2f after \n",
+           (fs3_defrag_files > 0) ? (double) fs3_defrag_tracks_before / fs3_defrag_files : 0.0,
+           (fs3_defrag_files > 0) ? (double) fs3_defrag_tracks_after / fs3_defrag_files : 0.0,
+           (fs3_defrag_files > 0) ? (double) fs3_defrag_seeks_before / fs3_defrag_files : 0.0,
+           (fs3_defrag_files > 0) ? (double) fs3_defrag_seeks_after / fs3_defrag_files : 0.0);
+    printf("fs3_network syscalls count: %d, sectors count: %d \n",
+           fs3_network_syscalls, fs3_network_sectors);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_do_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_do_seek(int16_t fd, uint32_t loc) {
+	file_t *file = NULL;
+
+	//checks if the file handler is valid and the given file is open
+	if (NULL == (file = file_lock(fd, TRUE))) {
+		return(-1);
+	}
+	// buffered writes go out before the position moves
+	if (-1 == file_buffer_flush(fd, file)) {
+		file_unlock(file);
+		return(-1);
+	}
+	//checks if the file is big enough to seek
+	if (loc > file->len) {
+		file_unlock(file);
+		return(-1);
+	}
+	// set read/write pointer at the seek position 
+	file->pos = loc;
+	file_unlock(file);
+	//returns 0 if successful
+	return (0);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : worker_main
+// Description  : The loop of a background thread
+//
+// Inputs       : arg - the worker
+// Outputs      : NULL
+
+void *worker_main(void *arg) {
+	fs3_worker *w = arg;
+	struct timespec wake;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += w->interval * 1000000L;
+		wake.tv_sec += wake.tv_nsec / 1000000000L;
+		wake.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&w->work, &w->lock, &wake);
+		if (w->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&w->lock);
+		w->pass();
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : worker_start
+// Description  : Starts a background thread
+//
+// Inputs       : w - the worker
+// Outputs      : 0 if successful, -1 if failure
+
+int worker_start(fs3_worker *w) {
+	pthread_mutex_lock(&w->lock);
+	if ((!w->running) && (0 != pthread_create(&w->thread, NULL, worker_main, w))) {
+		pthread_mutex_unlock(&w->lock);
+		return (-1);
+	}
+	w->running = 1;
+	pthread_mutex_unlock(&w->lock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : worker_wake
+// Description  : Wakes a background thread for a pass
+//
+// Inputs       : w - the worker
+// Outputs      : none
+
+void worker_wake(fs3_worker *w) {
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : worker_finish
+// Description  : Stops a background thread, after the pass it is making
+//
+// Inputs       : w - the worker
+// Outputs      : none
+
+void worker_finish(fs3_worker *w) {
+	pthread_mutex_lock(&w->lock);
+	if (!w->running) {
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	w->stop = 1;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_mutex_lock(&w->lock);
+	w->running = 0;
+	w->stop = 0;
+	pthread_mutex_unlock(&w->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_relocate
+// Description  : Moves a run of a file's sectors to the head of the log.
+//                The file may have moved or dropped them since the cleaner
+//                looked, only the ones still in place are moved.
+//
+// Inputs       : fd - the file handle (the file can be closed)
+//                index - the index in the file of the first sector
+//                id - the sector id of the first sector
+//                n - the length of the run
+// Outputs      : sectors looked at (at least 1), -1 if failure
+
+int32_t log_relocate(int16_t fd, uint32_t index, uint32_t id, uint16_t n) {
+	file_t *file = FILE_HANDLER(fd);
+	write_piece pieces[BATCH_SECTORS];
+	uint32_t start = 0;
+	uint16_t i = 0, run = 0;
+
+	pthread_rwlock_wrlock(&file->lock);
+	for (i = 0; i < n; i++) {
+		if (file_sector_id(fd, index + i) != (int32_t) (id + i)) {
+			break;
+		}
+	}
+	if ((i == 0) || (0 == (run = log_alloc(i, &start)))) {
+		pthread_rwlock_unlock(&file->lock);
+		return ((i == 0) ? 1 : -1);
+	}
+
+	// an empty piece of a moving sector is its old contents
+	for (i = 0; i < run; i++) {
+		pieces[i].sector_id = start + i;
+		pieces[i].source = id + i;
+		pieces[i].data = NULL;
+		pieces[i].offset = 0;
+		pieces[i].len = 0;
+		pieces[i].fresh = 0;
+	}
+	if ((-1 == fs3_write_sectors(pieces, run)) || (-1 == file_remap_sectors(fd, index, start, run))) {
+		pthread_rwlock_unlock(&file->lock);
+		return (-1);
+	}
+	for (i = 0; i < run; i++) {
+		release_sector(id + i);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	DRIVER_COUNT(fs3_log_moved, run);
+	return (run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_clean_segment
+// Description  : Moves the live sectors of a segment to the head of the
+//                log, runs of a file's sectors in a row move together
+//
+// Inputs       : track - the segment
+// Outputs      : 0 if successful, -1 if failure
+
+int log_clean_segment(uint16_t track) {
+	uint64_t used[BITMAP_WORDS], owner = 0;
+	uint16_t sector = 0, n = 0;
+	int32_t moved = 0;
+	int ret = 0;
+
+	// the victim is not opened for the log while it is cleaned
+	pthread_mutex_lock(&fs3_log_lock);
+	if (fs3_log_track == track) {
+		pthread_mutex_unlock(&fs3_log_lock);
+		return (0);
+	}
+	fs3_log_victim = track;
+	pthread_mutex_unlock(&fs3_log_lock);
+
+	pthread_mutex_lock(&track_locks[track]);
+	memcpy(used, sector_bitmap[track], sizeof(used));
+	pthread_mutex_unlock(&track_locks[track]);
+	for (sector = 0; sector < FS3_TRACK_SIZE; sector += moved) {
+		if (!(used[sector / 64] & (((uint64_t) 1) << (sector % 64)))) {
+			moved = 1;
+			continue;
+		}
+		owner = __atomic_load_n(&sector_owner[track * FS3_TRACK_SIZE + sector], __ATOMIC_RELAXED);
+		for (n = 1; (sector + n < FS3_TRACK_SIZE) && (n < BATCH_SECTORS); n++) {
+			if ((!(used[(sector + n) / 64] & (((uint64_t) 1) << ((sector + n) % 64)))) ||
+			    (__atomic_load_n(&sector_owner[track * FS3_TRACK_SIZE + sector + n], __ATOMIC_RELAXED) != owner + n)) {
+				break;
+			}
+		}
+		if (-1 == (moved = log_relocate(owner >> 32, (uint32_t) owner, track * FS3_TRACK_SIZE + sector, n))) {
+			ret = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&fs3_log_lock);
+	fs3_log_victim = -1;
+	pthread_mutex_unlock(&fs3_log_lock);
+	if ((ret == 0) && (track_free(track) == FS3_TRACK_SIZE)) {
+		DRIVER_COUNT(fs3_log_cleaned, 1);
+	}
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_clean_pass
+// Description  : Cleans the segments with the fewest live sectors, as long
+//                as they are mostly dead (at most fs3_log_clean_live percent
+//                live). The cleaner stops once enough segments are clean.
+//
+// Inputs       : all - clean every mostly dead segment
+// Outputs      : segments cleaned, -1 if failure
+
+int32_t log_clean_pass(int all) {
+	int32_t cleaned = 0, victim = 0, head = 0;
+	uint16_t i = 0, used = 0, fewest = 0, clean = 0;
+	uint64_t start = fs3_now_us();
+
+	pthread_mutex_lock(&fs3_clean_lock);
+	while (1) {
+		victim = -1;
+		fewest = (fs3_log_clean_live * FS3_TRACK_SIZE) / 100 + 1;
+		clean = 0;
+		pthread_mutex_lock(&fs3_log_lock);
+		head = fs3_log_track;
+		pthread_mutex_unlock(&fs3_log_lock);
+		for (i = 0; i < FS3_MAX_TRACKS; i++) {
+			used = __atomic_load_n(&track_used[i], __ATOMIC_RELAXED);
+			if (used == 0) {
+				clean++;
+			} else if ((used < fewest) && ((int32_t) i != head)) {
+				fewest = used;
+				victim = i;
+			}
+		}
+		if ((victim == -1) || ((!all) && (clean > LOG_FREE_SEGMENTS))) {
+			break;
+		}
+		if (-1 == log_clean_segment(victim)) {
+			cleaned = -1;
+			break;
+		}
+		cleaned++;
+	}
+	pthread_mutex_unlock(&fs3_clean_lock);
+	DRIVER_COUNT(fs3_log_clean_us, fs3_now_us() - start);
+	return (cleaned);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_clean_background
+// Description  : A pass of the segment cleaner thread, it is woken when the
+//                log opens a segment with few clean ones left and runs every
+//                LOG_CLEAN_MS in case it missed one
+//
+// Inputs       : none
+// Outputs      : none
+
+void log_clean_background(void) {
+	log_clean_pass(FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_log_clean
+// Description  : Cleans every mostly dead segment of the log now
+//
+// Inputs       : none
+// Outputs      : segments cleaned, -1 if failure
+
+int32_t fs3_log_clean(void) {
+	return (log_clean_pass(TRUE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_layout
+// Description  : Measures how a file is laid out, the caller has the file
+//                locked
+//
+// Inputs       : file - the file
+//                tracks - set to the number of tracks the file is on
+//                seeks - set to the TSEEKs a read of the whole file needs
+// Outputs      : none
+
+void file_layout(file_t *file, uint32_t *tracks, uint32_t *seeks) {
+	uint64_t seen = 0;
+	int32_t last = -1;
+	uint32_t i = 0, t = 0;
+	file_extent *ext = NULL;
+
+	*seeks = 0;
+	for (i = 0; i < file->num_extents; i++) {
+		ext = &file->extents[i];
+		// a run that continues over the end of a track is on both
+		for (t = ext->start / FS3_TRACK_SIZE; t <= (ext->start + ext->length - 1) / FS3_TRACK_SIZE; t++) {
+			seen |= ((uint64_t) 1) << t;
+			if ((int32_t) t != last) {
+				(*seeks)++;
+				last = t;
+			}
+		}
+	}
+	*tracks = __builtin_popcountll(seen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : file_frag_score
+// Description  : Scores how fragmented a file is, the extents it has over
+//                the fewest it could have (a run per track's worth of
+//                sectors). The caller has the file locked.
+//
+// Inputs       : file - the file
+// Outputs      : the score, 0 if the file is not fragmented or no better
+//                layout was found for it as it is
+
+uint32_t file_frag_score(file_t *file) {
+	uint32_t best = (file->num_sectors + FS3_TRACK_SIZE - 1) / FS3_TRACK_SIZE;
+
+	if ((file->num_extents <= best) || (file->num_extents == file->frag_checked)) {
+		return (0);
+	}
+	return (file->num_extents - best);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_best_run
+// Description  : Allocates the longest free run it can find up to "want"
+//                sectors, on any track
+//
+// Inputs       : want - the run length wanted
+//                id - set to the sector id of the first sector of the run
+// Outputs      : number of sectors allocated (0 if the disk is full)
+
+uint16_t alloc_best_run(uint16_t want, uint32_t *id) {
+	uint16_t i = 0, run = 0, best = 0, best_track = 0, sector = 0, best_sector = 0;
+
+	for (i = 0; (i < FS3_MAX_TRACKS) && (best < want); i++) {
+		if (track_free(i) <= best) {
+			continue;
+		}
+		pthread_mutex_lock(&track_locks[i]);
+		run = find_free_run(i, want, &sector);
+		pthread_mutex_unlock(&track_locks[i]);
+		if (run > best) {
+			best = run;
+			best_track = i;
+			best_sector = sector;
+		}
+	}
+	// another thread can take part of the run in between
+	if ((best == 0) || (0 == (run = alloc_on_track(best_track, best_sector, best, &sector)))) {
+		return (0);
+	}
+	*id = best_track * FS3_TRACK_SIZE + sector;
+	return (run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : defrag_cancel
+// Description  : Drops the plan of the defragmenter, the sectors not moved
+//                to yet are given back
+//
+// Inputs       : none
+// Outputs      : none
+
+void defrag_cancel(void) {
+	defrag_plan *plan = &fs3_defrag_plan;
+	file_extent *run = NULL;
+	uint32_t i = 0, id = 0;
+
+	if (plan->fd == -1) {
+		return;
+	}
+	for (i = plan->cur_run; i < plan->num_runs; i++) {
+		run = &plan->runs[i];
+		id = (i == plan->cur_run) ? run->start + (plan->next - run->first) : run->start;
+		for (; id < run->start + run->length; id++) {
+			release_sector(id);
+		}
+	}
+	free(plan->runs);
+	plan->runs = NULL;
+	plan->fd = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : defrag_plan_file
+// Description  : Allocates a new layout for a fragmented file, fewer runs
+//                than it has extents now, as long runs as can be found
+//
+// Inputs       : fd - the file handle
+// Outputs      : 1 if the file has a plan, 0 if it needs none or no better
+//                one was found, -1 if failure
+
+int defrag_plan_file(int16_t fd) {
+	file_t *file = FILE_HANDLER(fd);
+	defrag_plan *plan = &fs3_defrag_plan;
+	uint32_t remaining = 0, want = 0, start = 0;
+	uint16_t run = 0;
+
+	pthread_rwlock_rdlock(&file->lock);
+	if (0 == file_frag_score(file)) {
+		pthread_rwlock_unlock(&file->lock);
+		return (0);
+	}
+	if (NULL == (plan->runs = malloc(file->num_extents * sizeof(file_extent)))) {
+		pthread_rwlock_unlock(&file->lock);
+		return (-1);
+	}
+	plan->num_runs = 0;
+	remaining = file->num_sectors;
+	while ((remaining > 0) && (plan->num_runs + 1 < file->num_extents)) {
+		want = (remaining < FS3_TRACK_SIZE) ? remaining : FS3_TRACK_SIZE;
+		if (0 == (run = alloc_best_run(want, &start))) {
+			break;
+		}
+		plan->runs[plan->num_runs].first = file->num_sectors - remaining;
+		plan->runs[plan->num_runs].start = start;
+		plan->runs[plan->num_runs++].length = run;
+		remaining -= run;
+	}
+
+	plan->fd = fd;
+	plan->cur_run = 0;
+	plan->next = 0;
+
+	// no better than it is, give the sectors back and leave the file be
+	// until its layout changes
+	if (remaining > 0) {
+		file->frag_checked = file->num_extents;
+		pthread_rwlock_unlock(&file->lock);
+		defrag_cancel();
+		return (0);
+	}
+	file_layout(file, &plan->tracks, &plan->seeks);
+	pthread_rwlock_unlock(&file->lock);
+	return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : defrag_move
+// Description  : Moves the next sectors of the planned file to their new
+//                place, at most a batch. The file is locked alone only
+//                while they move.
+//
+// Inputs       : budget - most sectors to move
+//                wait - wait for the file if it is busy
+// Outputs      : sectors moved, 0 if the file was busy, -1 if failure
+
+int32_t defrag_move(uint32_t budget, int wait) {
+	defrag_plan *plan = &fs3_defrag_plan;
+	file_t *file = FILE_HANDLER(plan->fd);
+	file_extent *run = &plan->runs[plan->cur_run];
+	write_piece pieces[BATCH_SECTORS];
+	int32_t old[BATCH_SECTORS];
+	uint32_t start = run->start + (plan->next - run->first);
+	uint32_t n = run->first + run->length - plan->next, i = 0, tracks = 0, seeks = 0;
+
+	if (n > BATCH_SECTORS) {
+		n = BATCH_SECTORS;
+	}
+	if (n > budget) {
+		n = budget;
+	}
+	if (wait) {
+		pthread_rwlock_wrlock(&file->lock);
+	} else if (0 != pthread_rwlock_trywrlock(&file->lock)) {
+		return (0);
+	}
+
+	// an empty piece of a moving sector is its old contents, wherever the
+	// file has it now
+	for (i = 0; i < n; i++) {
+		old[i] = file_sector_id(plan->fd, plan->next + i);
+		pieces[i].sector_id = start + i;
+		pieces[i].source = old[i];
+		pieces[i].data = NULL;
+		pieces[i].offset = 0;
+		pieces[i].len = 0;
+		pieces[i].fresh = 0;
+	}
+	if ((-1 == fs3_write_sectors(pieces, n)) || (-1 == file_remap_sectors(plan->fd, plan->next, start, n))) {
+		pthread_rwlock_unlock(&file->lock);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		release_sector(old[i]);
+	}
+	DRIVER_COUNT(fs3_defrag_sectors, n);
+
+	// on to the next run, or the file is done
+	plan->next += n;
+	if ((plan->next == run->first + run->length) && (++plan->cur_run == plan->num_runs)) {
+		file_layout(file, &tracks, &seeks);
+		DRIVER_COUNT(fs3_defrag_tracks_before, plan->tracks);
+		DRIVER_COUNT(fs3_defrag_seeks_before, plan->seeks);
+		DRIVER_COUNT(fs3_defrag_tracks_after, tracks);
+		DRIVER_COUNT(fs3_defrag_seeks_after, seeks);
+		DRIVER_COUNT(fs3_defrag_files, 1);
+		free(plan->runs);
+		plan->runs = NULL;
+		plan->fd = -1;
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return (n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : defrag_background
+// Description  : A pass of the background defragmenter, it moves up to its
+//                share of fs3_defrag_rate for a tick, starting on the most
+//                fragmented file when it has none, and skips a busy file
+//                rather than wait on it
+//
+// Inputs       : none
+// Outputs      : none
+
+void defrag_background(void) {
+	uint32_t budget = (fs3_defrag_rate * DEFRAG_TICK_MS) / 1000, score = 0, most = 0;
+	uint32_t fd = 0, handles = __atomic_load_n(&next_free_handle, __ATOMIC_ACQUIRE);
+	int32_t pick = -1, moved = 0;
+	file_t *file = NULL;
+
+	if (budget == 0) {
+		budget = 1;
+	}
+	pthread_mutex_lock(&fs3_defrag_lock);
+	while (budget > 0) {
+		if (fs3_defrag_plan.fd == -1) {
+			pick = -1;
+			most = 0;
+			for (fd = 0; fd < handles; fd++) {
+				file = FILE_HANDLER(fd);
+				if (0 == pthread_rwlock_tryrdlock(&file->lock)) {
+					score = file_frag_score(file);
+					pthread_rwlock_unlock(&file->lock);
+					if (score > most) {
+						most = score;
+						pick = fd;
+					}
+				}
+			}
+			if (pick == -1) {
+				break;
+			}
+			if (1 != defrag_plan_file(pick)) {
+				continue;
+			}
+		}
+		if (0 >= (moved = defrag_move(budget, FALSE))) {
+			break;
+		}
+		budget -= moved;
+	}
+	pthread_mutex_unlock(&fs3_defrag_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_defrag
+// Description  : Moves every fragmented file into as few runs as it can,
+//                a batch of sectors at a time
+//
+// Inputs       : none
+// Outputs      : files moved, -1 if failure
+
+int32_t fs3_defrag(void) {
+	uint32_t fd = 0, handles = __atomic_load_n(&next_free_handle, __ATOMIC_ACQUIRE);
+	int32_t files = 0, ret = 0;
+
+	pthread_mutex_lock(&fs3_defrag_lock);
+	// the file the background mode is on is finished first
+	while ((fs3_defrag_plan.fd != -1) && (ret != -1)) {
+		ret = defrag_move(BATCH_SECTORS, TRUE);
+	}
+	for (fd = 0; (fd < handles) && (ret != -1); fd++) {
+		if (1 != (ret = defrag_plan_file(fd))) {
+			continue;
+		}
+		while ((fs3_defrag_plan.fd != -1) && (ret != -1)) {
+			ret = defrag_move(BATCH_SECTORS, TRUE);
+		}
+		files++;
+	}
+	pthread_mutex_unlock(&fs3_defrag_lock);
+	return ((ret == -1) ? -1 : files);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_engine_on_thread
+// Description  : Checks if the caller is the engine thread (a callback), the
+//                caller holds the queue lock
+//
+// Inputs       : none
+// Outputs      : 1 if it is, 0 if not
+
+int fs3_engine_on_thread(void) {
+	return ((fs3_engine_running) && (pthread_equal(pthread_self(), fs3_engine_thread)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_engine_wait
+// Description  : Waits for the requests up to a ticket to be done, the
+//                caller holds the queue lock. A callback does not wait, its
+//                calls go ahead of the requests still in the queue.
+//
+// Inputs       : ticket - the last request to wait for
+// Outputs      : none
+
+void fs3_engine_wait(uint64_t ticket) {
+	while ((fs3_queue_done_ticket < ticket) && (!fs3_engine_on_thread())) {
+		pthread_cond_wait(&fs3_queue_done, &fs3_queue_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_engine_enter
+// Description  : Waits for every request queued before a call to be done.
+//                Calls from different threads run at the same time, the
+//                files keep them apart.
+//
+// Inputs       : none
+// Outputs      : none
+
+void fs3_engine_enter(void) {
+	// nothing queued or running, which is always so without async requests
+	if (0 == __atomic_load_n(&fs3_engine_pending, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&fs3_queue_lock);
+	fs3_engine_wait(fs3_queue_tickets);
+	pthread_mutex_unlock(&fs3_queue_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_engine_enter_file
+// Description  : Waits for the requests queued before a call on the same
+//                file to be done, requests on other files carry on
+//
+// Inputs       : fd - the file handle
+// Outputs      : none
+
+void fs3_engine_enter_file(int16_t fd) {
+	if (0 == __atomic_load_n(&fs3_engine_pending, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&fs3_queue_lock);
+	// a bad handle has nothing queued, the call fails on its own
+	if ((fd >= 0) && ((uint32_t) fd < __atomic_load_n(&next_free_handle, __ATOMIC_ACQUIRE))) {
+		fs3_engine_wait(FILE_HANDLER(fd)->last_ticket);
+	}
+	pthread_mutex_unlock(&fs3_queue_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_request_execute
+// Description  : Runs a request
+//
+// Inputs       : req - the request
+// Outputs      : none
+
+void fs3_request_execute(fs3_request *req) {
+	switch (req->op) {
+	case FS3_REQ_READ:
+		req->result = fs3_do_read(req->fd, req->buf, req->count);
+		break;
+	case FS3_REQ_WRITE:
+		req->result = fs3_do_write(req->fd, req->buf, req->count);
+		break;
+	case FS3_REQ_FLUSH:
+		req->result = fs3_do_flush(req->fd);
+		break;
+	default:
+		req->result = -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_request_run
+// Description  : Runs a request on the calling thread, in its place after
+//                the requests queued on its file (the synchronous calls
+//                come here)
+//
+// Inputs       : req - the request
+// Outputs      : the result of the request
+
+int32_t fs3_request_run(fs3_request *req) {
+	fs3_engine_enter_file(req->fd);
+	fs3_request_execute(req);
+	req->done = 1;
+	return (req->result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : engine_group_prefetch
+// Description  : Reads the sectors the reads of a group want and the cache
+//                does not have in one batch. The reads start where the
+//                requests before them on the file leave its position; the
+//                files are locked in handle order while the map is used.
+//
+// Inputs       : group - the requests
+//                n - number of requests
+// Outputs      : none
+
+void engine_group_prefetch(fs3_request **group, uint16_t n) {
+	int16_t fds[ENGINE_GROUP];
+	file_t *files[ENGINE_GROUP];
+	uint64_t pos[ENGINE_GROUP], end = 0;
+	uint32_t ids[BATCH_SECTORS];
+	void *bufs[BATCH_SECTORS];
+	uint32_t index = 0;
+	uint16_t nfds = 0, want = 0, readers = 0, added = 0, i = 0, j = 0, k = 0;
+	int32_t id = 0;
+
+	// the files read from, in handle order
+	for (i = 0; i < n; i++) {
+		if (group[i]->op != FS3_REQ_READ) {
+			continue;
+		}
+		for (j = 0; (j < nfds) && (fds[j] < group[i]->fd); j++);
+		if ((j < nfds) && (fds[j] == group[i]->fd)) {
+			continue;
+		}
+		memmove(&fds[j + 1], &fds[j], (nfds - j) * sizeof(int16_t));
+		fds[j] = group[i]->fd;
+		nfds++;
+	}
+	if (nfds == 0) {
+		return;
+	}
+	for (j = 0; j < nfds; j++) {
+		if (NULL != (files[j] = file_lock(fds[j], FALSE))) {
+			pthread_mutex_lock(&files[j]->meta);
+			pos[j] = files[j]->pos;
+			pthread_mutex_unlock(&files[j]->meta);
+		}
+	}
+
+	for (i = 0; (i < n) && (want < BATCH_SECTORS); i++) {
+		if ((group[i]->op == FS3_REQ_FLUSH) || (group[i]->count <= 0)) {
+			continue;
+		}
+		for (j = 0; (j < nfds) && (fds[j] != group[i]->fd); j++);
+		if ((j == nfds) || (files[j] == NULL)) {
+			continue;
+		}
+		// a write moves the position of the reads after it
+		end = pos[j] + group[i]->count;
+		if (group[i]->op == FS3_REQ_READ) {
+			added = 0;
+			for (index = pos[j] / FS3_SECTOR_SIZE;
+			     (index <= (end - 1) / FS3_SECTOR_SIZE) && (want < BATCH_SECTORS); index++) {
+				if ((-1 == (id = file_sector_id(fds[j], index))) ||
+				    (fs3_cache_contains(id / FS3_TRACK_SIZE, id % FS3_TRACK_SIZE))) {
+					continue;
+				}
+				for (k = 0; (k < want) && (ids[k] != (uint32_t) id); k++);
+				if (k == want) {
+					bufs[want] = batch_buf[want];
+					ids[want++] = id;
+					added = 1;
+				}
+			}
+			readers += added;
+		}
+		pos[j] = end;
+	}
+
+	// one read would fetch its own sectors in a batch just the same
+	if ((readers > 1) && (0 == fs3_net_sectors(FS3_OP_RDSECT, ids, bufs, want))) {
+		for (k = 0; k < want; k++) {
+			fs3_put_cache_prefetch(ids[k] / FS3_TRACK_SIZE, ids[k] % FS3_TRACK_SIZE, bufs[k]);
+		}
+		fs3_engine_batched += want;
+	}
+	for (j = 0; j < nfds; j++) {
+		if (files[j] != NULL) {
+			file_unlock(files[j]);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : engine_run_group
+// Description  : Runs a group of requests in order. The sectors their reads
+//                want are read in one batch first and, with write-through,
+//                the sectors they write are held dirty and sent in one
+//                batch at the end, before any of them is done.
+//
+// Inputs       : group - the requests
+//                n - number of requests
+// Outputs      : none
+
+void engine_run_group(fs3_request **group, uint16_t n) {
+	uint16_t i = 0;
+
+	engine_group_size = n;
+	memset(engine_group_state, 0, sizeof(engine_group_state));
+	if (n > 1) {
+		fs3_engine_groups++;
+		engine_group_prefetch(group, n);
+		engine_hold_writes = fs3_cache_write_through;
+	}
+	for (i = 0; i < n; i++) {
+		engine_group_cur = i;
+		fs3_request_execute(group[i]);
+	}
+	engine_hold_writes = 0;
+	if (engine_held_count > 0) {
+		engine_write_held();
+	}
+	for (i = 0; i < n; i++) {
+		if (engine_group_state[i] & ENGINE_FAILED) {
+			group[i]->result = -1;
+		}
+	}
+	engine_group_size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_engine_main
+// Description  : The engine thread. It takes the queued requests a group at
+//                a time and runs them in order, batching their sector
+//                operations to the controller while the submitting threads
+//                carry on. Only one group is in flight (see fs3_request).
+//
+// Inputs       : arg - not used
+// Outputs      : NULL
+
+void *fs3_engine_main(void *arg) {
+	fs3_request *group[ENGINE_GROUP], *calls[ENGINE_GROUP];
+	uint16_t n = 0, ncalls = 0, i = 0;
+
+	pthread_mutex_lock(&fs3_queue_lock);
+	while (1) {
+		while ((fs3_queue_head == NULL) && (!fs3_engine_stop)) {
+			pthread_cond_wait(&fs3_queue_work, &fs3_queue_lock);
+		}
+		// stopping only once the queue is empty
+		if (fs3_queue_head == NULL) {
+			break;
+		}
+		for (n = 0; (n < ENGINE_GROUP) && (fs3_queue_head != NULL); n++) {
+			group[n] = fs3_queue_head;
+			fs3_queue_head = group[n]->next;
+			fs3_queue_depth--;
+		}
+		if (fs3_queue_head == NULL) {
+			fs3_queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&fs3_queue_lock);
+
+		engine_run_group(group, n);
+
+		// a request with a callback is the driver's to free, the callback
+		// can queue more requests; the others are the waiters' once done
+		pthread_mutex_lock(&fs3_queue_lock);
+		fs3_queue_done_ticket = group[n - 1]->ticket;
+		__atomic_sub_fetch(&fs3_engine_pending, n, __ATOMIC_RELEASE);
+		for (i = 0, ncalls = 0; i < n; i++) {
+			if (group[i]->callback != NULL) {
+				calls[ncalls++] = group[i];
+			} else {
+				__atomic_store_n(&group[i]->done, 1, __ATOMIC_RELEASE);
+			}
+		}
+		pthread_cond_broadcast(&fs3_queue_done);
+		pthread_mutex_unlock(&fs3_queue_lock);
+		for (i = 0; i < ncalls; i++) {
+			calls[i]->done = 1;
+			calls[i]->callback(calls[i]);
+			free(calls[i]);
+		}
+		pthread_mutex_lock(&fs3_queue_lock);
+	}
+	pthread_mutex_unlock(&fs3_queue_lock);
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_engine_finish
+// Description  : Runs what is left in the queue and stops the engine thread
+//
+// Inputs       : none
+// Outputs      : none
+
+void fs3_engine_finish(void) {
+	pthread_mutex_lock(&fs3_queue_lock);
+	if ((!fs3_engine_running) || (fs3_engine_on_thread())) {
+		pthread_mutex_unlock(&fs3_queue_lock);
+		return;
+	}
+	fs3_engine_stop = 1;
+	pthread_cond_signal(&fs3_queue_work);
+	pthread_mutex_unlock(&fs3_queue_lock);
+	pthread_join(fs3_engine_thread, NULL);
+	pthread_mutex_lock(&fs3_queue_lock);
+	fs3_engine_running = 0;
+	fs3_engine_stop = 0;
+	pthread_mutex_unlock(&fs3_queue_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_request_submit
+// Description  : Makes a request and queues it for the engine, starting the
+//                engine thread on the first one
+//
+// Inputs       : op - what to do
+//                fd - the file handle
+//                buf - the caller's buffer
+//                count - number of bytes
+//                callback - called when done, NULL to poll or wait instead
+//                arg - for the caller
+// Outputs      : the request, NULL if failure
+
+fs3_request *fs3_request_submit(FS3RequestOp op, int16_t fd, void *buf, int32_t count,
+                                void (*callback)(fs3_request *req), void *arg) {
+	fs3_request *req = NULL;
+
+	if (NULL == (req = malloc(sizeof(fs3_request)))) {
+		return (NULL);
+	}
+	req->op = op;
+	req->fd = fd;
+	req->buf = buf;
+	req->count = count;
+	req->result = -1;
+	req->done = 0;
+	req->callback = callback;
+	req->arg = arg;
+	req->next = NULL;
+	req->ticket = 0;
+
+	pthread_mutex_lock(&fs3_queue_lock);
+	if ((!fs3_engine_running) && (0 != pthread_create(&fs3_engine_thread, NULL, fs3_engine_main, NULL))) {
+		pthread_mutex_unlock(&fs3_queue_lock);
+		free(req);
+		return (NULL);
+	}
+	fs3_engine_running = 1;
+	// the synchronous calls on the file wait for it
+	req->ticket = ++fs3_queue_tickets;
+	if ((fd >= 0) && ((uint32_t) fd < __atomic_load_n(&next_free_handle, __ATOMIC_ACQUIRE))) {
+		FILE_HANDLER(fd)->last_ticket = req->ticket;
+	}
+	if (fs3_queue_tail != NULL) {
+		fs3_queue_tail->next = req;
+	} else {
+		fs3_queue_head = req;
+	}
+	fs3_queue_tail = req;
+	__atomic_add_fetch(&fs3_engine_pending, 1, __ATOMIC_RELEASE);
+	fs3_async_requests++;
+	if (++fs3_queue_depth > fs3_queue_depth_max) {
+		fs3_queue_depth_max = fs3_queue_depth;
+	}
+	pthread_cond_signal(&fs3_queue_work);
+	pthread_mutex_unlock(&fs3_queue_lock);
+	return (req);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_read_async
+// Description  : Queues a read of "count" bytes at the file position
+//
+// Inputs       : fd - the file handle
+//                buf - buffer to read into
+//                count - number of bytes to read
+//                callback - called when done, NULL to poll or wait instead
+//                arg - for the caller
+// Outputs      : the request, NULL if failure
+
+fs3_request *fs3_read_async(int16_t fd, void *buf, int32_t count, void (*callback)(fs3_request *req), void *arg) {
+	return (fs3_request_submit(FS3_REQ_READ, fd, buf, count, callback, arg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_write_async
+// Description  : Queues a write of "count" bytes at the file position
+//
+// Inputs       : fd - the file handle
+//                buf - buffer to write from
+//                count - number of bytes to write
+//                callback - called when done, NULL to poll or wait instead
+//                arg - for the caller
+// Outputs      : the request, NULL if failure
+
+fs3_request *fs3_write_async(int16_t fd, void *buf, int32_t count, void (*callback)(fs3_request *req), void *arg) {
+	return (fs3_request_submit(FS3_REQ_WRITE, fd, buf, count, callback, arg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush_async
+// Description  : Queues a write back of the cached data of a file
+//
+// Inputs       : fd - the file handle
+//                callback - called when done, NULL to poll or wait instead
+//                arg - for the caller
+// Outputs      : the request, NULL if failure
+
+fs3_request *fs3_flush_async(int16_t fd, void (*callback)(fs3_request *req), void *arg) {
+	return (fs3_request_submit(FS3_REQ_FLUSH, fd, NULL, 0, callback, arg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_request_poll
+// Description  : Checks if a request without a callback is done
+//
+// Inputs       : req - the request
+// Outputs      : 1 if done, 0 if not
+
+int fs3_request_poll(fs3_request *req) {
+	return (__atomic_load_n(&req->done, __ATOMIC_ACQUIRE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_request_wait
+// Description  : Waits for a request without a callback and frees it
+//
+// Inputs       : req - the request
+// Outputs      : the result of the request
+
+int32_t fs3_request_wait(fs3_request *req) {
+	int32_t result = -1;
+
+	if (req == NULL) {
+		return (-1);
+	}
+	pthread_mutex_lock(&fs3_queue_lock);
+	while (!req->done) {
+		pthread_cond_wait(&fs3_queue_done, &fs3_queue_lock);
+	}
+	pthread_mutex_unlock(&fs3_queue_lock);
+	result = req->result;
+	free(req);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_mount_disk
+// Description  : FS3 interface, mount/initialize filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_mount_disk(void) {
+	int32_t ret = 0;
+
+	fs3_engine_enter();
+	ret = fs3_do_mount_disk();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_unmount_disk
+// Description  : FS3 interface, unmount the disk once the queued requests
+//                are done
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_unmount_disk(void) {
+	int32_t ret = 0;
+
+	fs3_engine_finish();
+	fs3_engine_enter();
+	ret = fs3_do_unmount_disk();
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_open
+// Description  : This function opens a file and returns a file handle
+//
+// Inputs       : path - the path of the file
+// Outputs      : the file handle, -1 if failure
+
+int16_t fs3_open(char *path) {
+	int16_t fd = 0;
+
+	fs3_engine_enter();
+	fd = fs3_do_open(path);
+	return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_close
+// Description  : This function closes the file once the requests queued
+//                on it are done
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t fs3_close(int16_t fd) {
+	int16_t ret = 0;
+
+	fs3_engine_enter_file(fd);
+	ret = fs3_do_close(fd);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_read
+// Description  : Reads "count" bytes from the file handle "fh" into the
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_read(int16_t fd, void *buf, int32_t count) {
+	fs3_request req = { FS3_REQ_READ, fd, buf, count, -1, 0, NULL, NULL, NULL };
+
+	return (fs3_request_run(&req));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_write
+// Description  : Writes "count" bytes to the file handle "fh" from the
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_write(int16_t fd, void *buf, int32_t count) {
+	fs3_request req = { FS3_REQ_WRITE, fd, buf, count, -1, 0, NULL, NULL, NULL };
+
+	return (fs3_request_run(&req));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pread
+// Description  : Reads "count" bytes at an offset, after the requests
+//                queued on the file are done; the file position stays
+//                where it is
+//
+// Inputs       : fd - the file handle
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                offset - the position in the file to read at
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_pread(int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	int32_t ret = 0;
+
+	fs3_engine_enter_file(fd);
+	ret = fs3_do_pread(fd, buf, count, offset);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_pwrite
+// Description  : Writes "count" bytes at an offset, after the requests
+//                queued on the file are done; the file position stays
+//                where it is
+//
+// Inputs       : fd - the file handle
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                offset - the position in the file to write at
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_pwrite(int16_t fd, void *buf, int32_t count, uint32_t offset) {
+	int32_t ret = 0;
+
+	fs3_engine_enter_file(fd);
+	ret = fs3_do_pwrite(fd, buf, count, offset);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_readv
+// Description  : Reads from the file position into several buffers, after
+//                the requests queued on the file are done
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers to read into
+//                iovcnt - number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t fs3_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t ret = 0;
+
+	fs3_engine_enter_file(fd);
+	ret = fs3_do_readv(fd, iov, iovcnt);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_writev
+// Description  : Writes several buffers at the file position, after the
+//                requests queued on the file are done
+//
+// Inputs       : fd - the file handle
+//                iov - the buffers to write from
+//                iovcnt - number of buffers
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t fs3_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t ret = 0;
+
+	fs3_engine_enter_file(fd);
+	ret = fs3_do_writev(fd, iov, iovcnt);
+	return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_flush
+// Description  : Writes back the parts of a file held dirty in the cache
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_flush(int16_t fd) {
+	fs3_request req = { FS3_REQ_FLUSH, fd, NULL, 0, -1, 0, NULL, NULL, NULL };
+
+	return (fs3_request_run(&req));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_seek
+// Description  : Seek to specific point in the file, after the requests
+//                queued on it are done
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t fs3_seek(int16_t fd, uint32_t loc) {
+	int32_t ret = 0;
+
+	fs3_engine_enter_file(fd);
+	ret = fs3_do_seek(fd, loc);
+	return (ret);
+}
@@ -13,19 +13,76 @@
 
 // Include files
 #include <stdint.h>
+#include <sys/uio.h>
 #include <fs3_controller.h>
 
 // Defines
 #define FS3_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define FS3_MAX_PATH_LENGTH 128 // Maximum length of filename length
+#define FS3_MAX_READAHEAD 64 // Largest read-ahead window (in sectors)
+#define FS3_DEFAULT_READAHEAD 32 // Default maximum read-ahead window
+#define FS3_DEFAULT_COALESCE FS3_SECTOR_SIZE // Default bytes buffered of small writes
+#define FS3_DEFAULT_COALESCE_MS 100 // Default age at which buffered writes go out
+#define FS3_DEFAULT_CLEAN_LIVE 50 // Default live percent of a segment the cleaner takes
 
 // we use 0 to reprsent success so we make code easier to read
 #define SUCCESS 0 
 // we cannot define fail as (-1) since we cannot store -1 as a bit so we just 1 to represent fail 
 #define FAIL 1 
 
+// The kinds of asynchronous request
+typedef enum {
+	FS3_REQ_READ  = 0, // fs3_read at the file position
+	FS3_REQ_WRITE = 1, // fs3_write at the file position
+	FS3_REQ_FLUSH = 2, // fs3_flush
+} FS3RequestOp;
+
+// An asynchronous request. Requests run one after the other in the order
+// they were submitted, so reads and writes use the file position left by
+// the requests before them. The engine takes the queued requests a group at
+// a time and sends the sectors they write to the controller in one batch.
+// A synchronous call waits only for the requests queued before it on the
+// same file (open and mount wait for every request queued before them).
+// One engine thread runs a group's requests one after another and one group
+// is in flight at a time: the reads of a group are fetched together only
+// when more than one of them misses the cache, and its writes are held for
+// one batch only in write-through mode. Write-back writes and the reads of
+// a single file gain nothing over calling fs3_read and fs3_write in turn.
+typedef struct fs3_request {
+	FS3RequestOp op;
+	int16_t fd;
+	void *buf;
+	int32_t count;
+	int32_t result; // bytes read or written (0 for a flush), -1 on failure
+	int done;       // set once the result is in
+	void (*callback)(struct fs3_request *req); // called on the engine thread, the request is freed after it
+	void *arg;      // for the caller
+	struct fs3_request *next; // link in the engine queue
+	uint64_t ticket; // place in the queue, set when submitted
+} fs3_request;
+
+// the maximum read-ahead window in sectors, 0 turns read-ahead off
+extern uint16_t fs3_readahead_max;
+// ask the controller for the multi-sector commands at mount
+extern uint8_t fs3_use_multisector;
+// small writes are buffered until this many bytes are (at most a sector, 0
+// turns it off) or the first of them is this many ms old, a background
+// thread writes out the buffers that get old (0 leaves them until the next
+// use of the file)
+extern uint16_t fs3_write_coalesce;
+extern uint32_t fs3_write_coalesce_ms;
+// log-structured mode, every sector written goes to the head of a log of
+// track segments; the cleaner takes segments at most this percent live
+extern uint8_t fs3_log_structured;
+extern uint8_t fs3_log_clean_live;
+// the background defragmenter moves at most this many sectors a second (0
+// turns it off)
+extern uint32_t fs3_defrag_rate;
+
 //
-// Interface functions
+// Interface functions, they can be called from any number of threads once
+// the disk is mounted (and until it is unmounted). Reads and flushes of a
+// file run side by side, writes, seeks and closes have the file alone.
 
 int32_t fs3_mount_disk(void);
 	// FS3 interface, mount/initialize filesystem
@@ -48,6 +105,45 @@ int32_t fs3_write(int16_t fd, void *buf, int32_t count);
 int32_t fs3_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t fs3_pread(int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Reads "count" bytes at "offset" without using or moving the file position
+
+int32_t fs3_pwrite(int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Writes "count" bytes at "offset" (at most the file length) without using or moving the file position
+
+int32_t fs3_readv(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Reads from the file position into several buffers in one read
+
+int32_t fs3_writev(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Writes several buffers at the file position in one write
+
+int32_t fs3_flush(int16_t fd);
+	// Write back any cached data of the file to the controller
+
+fs3_request *fs3_read_async(int16_t fd, void *buf, int32_t count, void (*callback)(fs3_request *req), void *arg);
+	// Queues a read, the handle is for fs3_request_poll and fs3_request_wait if there is no callback
+
+fs3_request *fs3_write_async(int16_t fd, void *buf, int32_t count, void (*callback)(fs3_request *req), void *arg);
+	// Queues a write, buf must stay valid until it is done
+
+fs3_request *fs3_flush_async(int16_t fd, void (*callback)(fs3_request *req), void *arg);
+	// Queues a write back of the cached data of the file
+
+int fs3_request_poll(fs3_request *req);
+	// Checks if a request is done, without waiting
+
+int32_t fs3_request_wait(fs3_request *req);
+	// Waits for a request, frees it and returns its result
+
+int32_t fs3_log_clean(void);
+	// Cleans every mostly dead segment of the log now, gives the number cleaned
+
+int32_t fs3_defrag(void);
+	// Moves every fragmented file into contiguous track runs now, gives the number moved
+
+int32_t fs3_log_driver_metrics(void);
+	// Log the metrics for the driver
+
 int deconstruct_fs3_cmdblock(FS3CmdBlk cmdblock, uint8_t *op, uint16_t *sec, uint32_t *trk, uint8_t *ret);
 	// Deconstruct the command block
 
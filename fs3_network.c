@@ -11,15 +11,48 @@
 // header files
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <string.h>
 #include <cmpsc311_log.h>
 #include <fs3_driver.h>
 #include <fs3_network.h>
 #include <netinet/in.h>
+#include <linux/io_uring.h>
 
 #define SA struct sockaddr
+// the track field of a command block
+#define CMD_TRK_MASK (((FS3CmdBlk) 0xffffffff) << 12)
+
+// a caller waiting on tagged requests, the last one done wakes it
+typedef struct tagged_waiter {
+    sem_t sem;
+    int left;
+} tagged_waiter;
+
+// the submission and completion rings shared with the kernel
+typedef struct uring_ring {
+    int fd;
+    uint8_t *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_ring;
+#define URING_ENTRIES 8
+#define URING_SEND 1 // user data of the send of a window
+#define URING_RECV 2 // user data of a read of its replies
 // defining types to convert signals
 #define htonll64(x) ((1==htonl(1)) ? (x) : ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
 #define ntohll64(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
@@ -28,7 +61,66 @@
 //  Global data
 unsigned char     *fs3_network_address = NULL; // Address of FS3 server
 unsigned short     fs3_network_port = 0;       // Port of FS3 serve
-int socket_fd = -1;                             // socket FD
+uint16_t fs3_network_connections = 1;           // connections in the pool, striped by track
+int socket_fds[FS3_MAX_CONNECTIONS];            // socket FD of each connection
+uint32_t socket_tracks[FS3_MAX_CONNECTIONS];    // track the head of each connection is on
+int socket_count = 0;                           // connections open
+int socket_cur = 0;                             // connection of the last seek
+uint8_t fs3_network_tagged = 0;                 // ask for tagged commands
+// the tagged connection, the dispatcher thread owns the socket and the tags
+int tagged_running = 0;                         // the dispatcher is up
+int tagged_stop = 0;                            // tell the dispatcher to finish
+int tagged_wake = -1;                           // eventfd waking the dispatcher
+pthread_t tagged_thread;
+fs3_net_request *tagged_head = NULL;            // newest submission, producers swap in here
+fs3_net_request *tagged_tail = NULL;            // oldest submission, the dispatcher pops here
+fs3_net_request tagged_stub;                    // keeps the submission queue from being empty
+fs3_net_request *tagged_inflight[FS3_MAX_TAGS]; // request of each tag on the wire
+uint16_t tagged_free[FS3_MAX_TAGS];             // tags not on the wire
+uint16_t tagged_nfree = 0;
+fs3_net_request *tagged_held = NULL;            // popped, waiting for room for its reply
+size_t tagged_reply_bytes = 0;                  // reply bytes of the requests on the wire
+__thread uint32_t tagged_track = FS3_NO_TRACK;  // track of the last seek of this thread
+FS3Transport fs3_network_transport = FS3_TRANSPORT_TCP; // transport used to reach the controller
+FS3ControllerContext local_context;             // state of the in-process controller
+uint32_t fs3_network_syscalls = 0;              // system calls moving commands and sectors
+uint32_t fs3_network_sectors = 0;               // sectors moved
+// the io_uring transport, the replies land in a registered staging buffer
+uring_ring uring;
+int uring_ready = 0;                            // the ring is up, else fall back to tcp
+int uring_fixed = 0;                            // the staging buffer is registered
+uint8_t *uring_staging = NULL;
+
+//
+// Functional Prototypes
+
+int tcp_connect(void);
+int tcp_close(void);
+int tcp_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
+int tcp_send_on(int conn, FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
+int tcp_route(FS3CmdBlk cmd, int *seek_done);
+int tcp_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n);
+int local_connect(void);
+int local_close(void);
+int local_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
+int local_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n);
+int network_read_all(int fd, void *buf, size_t len);
+int network_writev_all(int fd, struct iovec *iov, int cnt);
+int tagged_start(void);
+void tagged_finish(void);
+int tagged_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
+int tagged_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n);
+int uring_connect(void);
+int uring_close(void);
+int uring_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
+int uring_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n);
+
+// the transports, in FS3Transport order
+const fs3_transport transports[FS3_MAXTRANSPORT] = {
+    { "tcp", tcp_connect, tcp_send, tcp_send_batch, tcp_close },
+    { "local", local_connect, local_send, local_send_batch, local_close },
+    { "uring", uring_connect, uring_send, uring_send_batch, uring_close },
+};
 
 
 //
@@ -36,60 +128,183 @@ int socket_fd = -1;                             // socket FD
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : network_fs3_syscall
-// Description  : Perform a system call over the network
+// Function     : tcp_connect
+// Description  : Opens the pool of connections to the controller server
 //
-// Inputs       : cmd - the command block to send
-//                ret - the returned command block
-//                buf - the buffer to place received data in
+// Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+int tcp_connect(void)
+{
+    struct sockaddr_in server_address;
+    int socket_fd = -1;
+
+    // Set the IP and port numnber
+    if (NULL == fs3_network_address) {
+        fs3_network_address = (unsigned char *) FS3_DEFAULT_IP;
+    }
+    if (0 == fs3_network_port) {
+        fs3_network_port = FS3_DEFAULT_PORT;
+    }
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = inet_addr((char *) fs3_network_address);
+    server_address.sin_port = htons(fs3_network_port);
+
+    if ((fs3_network_connections == 0) || (fs3_network_connections > FS3_MAX_CONNECTIONS)) {
+        return(-1);
+    }
+    // tagged commands and the ring share one connection
+    for (socket_count = 0; socket_count < (((fs3_network_tagged) || (fs3_network_transport != FS3_TRANSPORT_TCP)) ? 1 : fs3_network_connections); socket_count++) {
+        // create socket and connect to server
+        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if ((-1 == socket_fd) || (connect(socket_fd, (SA*)&server_address, sizeof(server_address)) != 0)) {
+            if (-1 != socket_fd) {
+                close(socket_fd);
+            }
+            tcp_close();
+            return(-1);
+        }
+
+        // commands are small and answered one by one, so don't let them wait to be coalesced
+        int nodelay = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        socket_fds[socket_count] = socket_fd;
+        socket_tracks[socket_count] = FS3_NO_TRACK;
+    }
+    socket_cur = 0;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tcp_close
+// Description  : Closes the connections to the controller server
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int tcp_close(void)
+{
+    if (0 == socket_count) {
+        return(-1);
+    }
+    tagged_finish();
+    while (socket_count > 0) {
+        close(socket_fds[--socket_count]);
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tcp_route
+// Description  : Picks the connection of a command. A track always goes
+//                to the same connection, so each connection keeps its own
+//                head position; a seek to where that head already is can
+//                be skipped. Sector commands follow the last seek.
+//
+// Inputs       : cmd - the command block
+//                seek_done - set if the command is a seek that is not needed
+// Outputs      : the connection
+
+int tcp_route(FS3CmdBlk cmd, int *seek_done)
 {
     uint8_t op = 0, retval = 0;
     uint16_t sec = 0;
     uint32_t trk = 0;
-    
-    // deconstruct the command block
+
     deconstruct_fs3_cmdblock(cmd, &op, &sec, &trk, &retval);
+    *seek_done = 0;
+    if ((op == FS3_OP_TSEEK) || (op == FS3_OP_RDTRACK)) {
+        socket_cur = trk % socket_count;
+        *seek_done = (op == FS3_OP_TSEEK) && (socket_tracks[socket_cur] == trk);
+        socket_tracks[socket_cur] = trk;
+    }
+    return(socket_cur);
+}
 
-    // if this is mount operation, open a socket and connect to server.
-    if (FS3_OP_MOUNT == op) {
-        struct sockaddr_in server_address;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tcp_send
+// Description  : Sends a command to the controller server over the
+//                connection of its track. MOUNT and UMOUNT go to all of
+//                the connections.
+//
+// Inputs       : cmd - the command block to send
+//                ret - the returned command block
+//                buf - the buffer to place received data in
+// Outputs      : 0 if successful, -1 if failure
 
-        // create socket
-        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+int tcp_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+{
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+    int i = 0, result = 0, seek_done = 0;
+    FS3CmdBlk conn_ret = 0;
 
-        // check if socket is already created
-        if (-1 == socket_fd) {
-            return(-1);
-        }
+    // Fail if the sockets are not created
+    if (socket_count == 0) {
+        return (-1);
+    }
 
-        // Set the IP and port numnber
-        if (NULL == fs3_network_address) {
-            fs3_network_address = (unsigned char *) FS3_DEFAULT_IP;
-        }
-        if (0 == fs3_network_port) {
-            fs3_network_port = FS3_DEFAULT_PORT;
+    deconstruct_fs3_cmdblock(cmd, &op, &sec, &trk, &retval);
+    if (tagged_running) {
+        return(tagged_send(cmd, ret, buf));
+    }
+    if (op == FS3_OP_MOUNT) {
+        // ask for tags, the commands after a MOUNT that got them are tagged
+        socket_tracks[0] = FS3_NO_TRACK;
+        result = tcp_send_on(0, cmd | ((fs3_network_tagged) ? FS3_MOUNT_TAGGED : 0), ret, buf);
+        if ((result == 0) && (fs3_network_tagged) && (*ret & FS3_MOUNT_TAGGED)) {
+            *ret &= ~(FS3CmdBlk) FS3_MOUNT_TAGGED;
+            return(tagged_start());
         }
-        server_address.sin_family = AF_INET;
-        server_address.sin_addr.s_addr = inet_addr((char *) fs3_network_address);
-        server_address.sin_port = htons(fs3_network_port);
-
-        // connect to server
-        if (connect(socket_fd, (SA*)&server_address, sizeof(server_address)) != 0) {
-            return(-1);
+        *ret &= ~(FS3CmdBlk) FS3_MOUNT_TAGGED;
+    }
+    if ((op == FS3_OP_MOUNT) || (op == FS3_OP_UMOUNT)) {
+        // the reply of the first connection stands for all of them
+        for (i = (op == FS3_OP_MOUNT) ? 1 : 0; i < socket_count; i++) {
+            socket_tracks[i] = FS3_NO_TRACK;
+            if (-1 == tcp_send_on(i, cmd, (i == 0) ? ret : &conn_ret, buf)) {
+                result = -1;
+            }
         }
+        return(result);
     }
 
-    // Fail if the socket is not created
-    if (socket_fd == -1) {
-        return (-1);
+    i = tcp_route(cmd, &seek_done);
+    if (seek_done) {
+        *ret = cmd;
+        return(0);
     }
+    if (-1 == tcp_send_on(i, cmd, ret, buf)) {
+        socket_tracks[i] = FS3_NO_TRACK;
+        return(-1);
+    }
+    return(0);
+}
 
-    uint64_t temp_write = htonll64(cmd);
-    // write command block to the socket
-    write(socket_fd, &temp_write, sizeof(FS3CmdBlk));
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tcp_send_on
+// Description  : Sends a command on one connection and reads the reply
+//
+// Inputs       : conn - the connection
+//                cmd - the command block to send
+//                ret - the returned command block
+//                buf - the buffer to place received data in
+// Outputs      : 0 if successful, -1 if failure
+
+int tcp_send_on(int conn, FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+{
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+    int socket_fd = socket_fds[conn];
+    
+    // deconstruct the command block
+    deconstruct_fs3_cmdblock(cmd, &op, &sec, &trk, &retval);
 
     // check if write buffer or read buffer is valid
     uint8_t write_buf = 0;
@@ -102,12 +317,15 @@ int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
             read_buf = 0;
             break;
         }
-        case FS3_OP_RDSECT: {
+        case FS3_OP_RDSECT:
+        case FS3_OP_RDSECTS:
+        case FS3_OP_RDTRACK: {
             write_buf = 0;
             read_buf = 1;
             break;
         }
-        case FS3_OP_WRSECT: {
+        case FS3_OP_WRSECT:
+        case FS3_OP_WRSECTS: {
             write_buf = 1;
             read_buf = 0;
             break;
@@ -117,14 +335,19 @@ int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
         }
     }
 
-    // send write_buf to server if required
-    if (write_buf) {
-        write(socket_fd, buf, FS3_SECTOR_SIZE);
+    // write command block to the socket, with write_buf behind it if required
+    uint64_t temp_write = htonll64(cmd);
+    struct iovec iov[2] = { { &temp_write, sizeof(FS3CmdBlk) },
+                            { buf, fs3_controller_cmd_sectors(cmd) * FS3_SECTOR_SIZE } };
+    if (-1 == network_writev_all(socket_fd, iov, (write_buf) ? 2 : 1)) {
+        return(-1);
     }
 
     FS3CmdBlk temp_read = 0;
     // Read the return command block from server
-    read(socket_fd, &temp_read, sizeof(FS3CmdBlk));
+    if (-1 == network_read_all(socket_fd, &temp_read, sizeof(FS3CmdBlk))) {
+        return(-1);
+    }
     *ret = (FS3CmdBlk) ntohll64((uint64_t) temp_read);
 
     
@@ -137,19 +360,1201 @@ int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
     }
 
     // read the return buffer if required
-    if (read_buf) {
-        read(socket_fd, buf, FS3_SECTOR_SIZE);
+    if ((read_buf) && (-1 == network_read_all(socket_fd, buf, fs3_controller_cmd_sectors(cmd) * FS3_SECTOR_SIZE))) {
+        return(-1);
     }
 
-    // close the socket if the operation is unmount
-    if (FS3_OP_UMOUNT == op) {
-        if (-1 != socket_fd) {
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_read_all
+// Description  : Reads exactly len bytes from a socket
+//
+// Inputs       : fd - the socket
+//                buf - where to put the bytes
+//                len - number of bytes to read
+// Outputs      : 0 if successful, -1 if failure
+
+int network_read_all(int fd, void *buf, size_t len)
+{
+    ssize_t got = 0;
+
+    while (len > 0) {
+        got = read(fd, buf, len);
+        fs3_network_syscalls++;
+        if (got <= 0) {
+            if ((got == -1) && (errno == EINTR)) {
+                continue;
+            }
+            return(-1);
+        }
+        buf = (uint8_t *) buf + got;
+        len -= got;
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_writev_all
+// Description  : Writes all of an io vector to a socket
+//
+// Inputs       : fd - the socket
+//                iov - the io vector (it is modified)
+//                cnt - number of entries
+// Outputs      : 0 if successful, -1 if failure
+
+int network_writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t sent = 0;
+
+    while (cnt > 0) {
+        sent = writev(fd, iov, cnt);
+        fs3_network_syscalls++;
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        // step over what went out
+        while ((cnt > 0) && ((size_t) sent >= iov->iov_len)) {
+            sent -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tcp_send_batch
+// Description  : Sends a batch of commands to the controller server. Each
+//                command goes to the connection of its track, and the
+//                command blocks and write payloads of every connection go
+//                out before any reply is read, so the connections work in
+//                parallel and the batch costs about one round trip. At
+//                most FS3_NET_BATCH_WINDOW commands are outstanding at a
+//                time so neither side can block on a full socket. Only
+//                TSEEK and the sector reads and writes can be batched. The
+//                commands behind a seek go out before its reply is in; if
+//                the seek fails the controller fails them as well (it is
+//                on no track until the next seek), so none of them lands
+//                on the wrong track.
+//
+// Inputs       : cmds - the command blocks to send
+//                rets - the returned command blocks
+//                bufs - the sector buffer of each command (NULL for TSEEK)
+//                n - number of commands
+// Outputs      : 0 if successful, -1 if any command failed (the commands
+//                after a failure are not known to have been done)
+
+int tcp_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n)
+{
+    struct iovec iov[FS3_NET_BATCH_WINDOW * 2];
+    uint64_t wire[FS3_NET_BATCH_WINDOW];
+    int sent[FS3_MAX_CONNECTIONS][FS3_NET_BATCH_WINDOW]; // commands sent on each connection, in order
+    int sent_cnt[FS3_MAX_CONNECTIONS];
+    uint64_t temp_read = 0;
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+    int i = 0, j = 0, c = 0, k = 0, done = 0, cnt = 0, iovcnt = 0, failed = 0, seek_done = 0;
+    int quickack = 1;
+
+    // Fail if the sockets are not created
+    if (socket_count == 0) {
+        return (-1);
+    }
+    if (tagged_running) {
+        return(tagged_send_batch(cmds, rets, bufs, n));
+    }
+
+    for (done = 0; done < n; done += cnt) {
+        cnt = ((n - done) < FS3_NET_BATCH_WINDOW) ? (n - done) : FS3_NET_BATCH_WINDOW;
+
+        // split the commands over the connections, a seek to where the head
+        // already is needs no sending
+        memset(sent_cnt, 0x0, sizeof(sent_cnt));
+        for (i = 0; i < cnt; i++) {
+            deconstruct_fs3_cmdblock(cmds[done + i], &op, &sec, &trk, &retval);
+            if ((op == FS3_OP_MOUNT) || (op == FS3_OP_UMOUNT) || (op >= FS3_OP_MAXVAL)) {
+                return(-1);
+            }
+            c = tcp_route(cmds[done + i], &seek_done);
+            if (seek_done) {
+                rets[done + i] = cmds[done + i];
+                continue;
+            }
+            sent[c][sent_cnt[c]++] = done + i;
+        }
+
+        // the command blocks with the write payloads behind them
+        for (c = 0; c < socket_count; c++) {
+            iovcnt = 0;
+            for (j = 0; j < sent_cnt[c]; j++) {
+                k = sent[c][j];
+                deconstruct_fs3_cmdblock(cmds[k], &op, &sec, &trk, &retval);
+                wire[j] = htonll64(cmds[k]);
+                iov[iovcnt].iov_base = &wire[j];
+                iov[iovcnt++].iov_len = sizeof(FS3CmdBlk);
+                if ((op == FS3_OP_WRSECT) || (op == FS3_OP_WRSECTS)) {
+                    iov[iovcnt].iov_base = bufs[k];
+                    iov[iovcnt++].iov_len = fs3_controller_cmd_sectors(cmds[k]) * FS3_SECTOR_SIZE;
+                }
+            }
+            if ((iovcnt > 0) && (-1 == network_writev_all(socket_fds[c], iov, iovcnt))) {
+                socket_tracks[c] = FS3_NO_TRACK;
+                return(-1);
+            }
+        }
+
+        // drain the replies, a failed reply has no payload
+        for (c = 0; c < socket_count; c++) {
+            for (j = 0; j < sent_cnt[c]; j++) {
+                k = sent[c][j];
+                // ack each reply right away, the server holds back the next
+                // small reply until the last one is acked
+                setsockopt(socket_fds[c], IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+                fs3_network_syscalls++;
+                if (-1 == network_read_all(socket_fds[c], &temp_read, sizeof(FS3CmdBlk))) {
+                    socket_tracks[c] = FS3_NO_TRACK;
+                    return(-1);
+                }
+                rets[k] = (FS3CmdBlk) ntohll64(temp_read);
+                deconstruct_fs3_cmdblock(rets[k], &op, &sec, &trk, &retval);
+                if (retval == FAIL) {
+                    // no telling where the head of the connection is now
+                    socket_tracks[c] = FS3_NO_TRACK;
+                    failed = 1;
+                    continue;
+                }
+                deconstruct_fs3_cmdblock(cmds[k], &op, &sec, &trk, &retval);
+                if (((op == FS3_OP_RDSECT) || (op == FS3_OP_RDSECTS) || (op == FS3_OP_RDTRACK)) &&
+                    (-1 == network_read_all(socket_fds[c], bufs[k], fs3_controller_cmd_sectors(cmds[k]) * FS3_SECTOR_SIZE))) {
+                    socket_tracks[c] = FS3_NO_TRACK;
+                    return(-1);
+                }
+            }
+        }
+
+        // nothing after a failure can be trusted, so stop sending
+        if (failed) {
             return(-1);
         }
-        close(socket_fd);
-        socket_fd = -1;
     }
 
     // Return successfully
     return (0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_push
+// Description  : Adds a request to the submission queue. This is a lock-free
+//                multi-producer single-consumer queue: any thread can push
+//                with one atomic swap, and only the dispatcher pops.
+//
+// Inputs       : req - the request
+// Outputs      : none
+
+void tagged_push(fs3_net_request *req)
+{
+    fs3_net_request *prev = NULL;
+
+    __atomic_store_n(&req->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&tagged_head, req, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, req, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_pop
+// Description  : Takes the oldest request off the submission queue (only the
+//                dispatcher calls this)
+//
+// Inputs       : none
+// Outputs      : the request, NULL if there is none (or one is half pushed,
+//                its producer wakes the dispatcher once it is in)
+
+fs3_net_request *tagged_pop(void)
+{
+    fs3_net_request *tail = tagged_tail;
+    fs3_net_request *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    // step over the stub
+    if (tail == &tagged_stub) {
+        if (next == NULL) {
+            return(NULL);
+        }
+        tagged_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        tagged_tail = next;
+        return(tail);
+    }
+
+    // the tail is the last request, put the stub behind it to take it
+    if (tail != __atomic_load_n(&tagged_head, __ATOMIC_ACQUIRE)) {
+        return(NULL);
+    }
+    tagged_push(&tagged_stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        tagged_tail = next;
+        return(tail);
+    }
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_reply_size
+// Description  : Gives the size of the reply to a tagged command, a read
+//                has its sectors behind the reply
+//
+// Inputs       : cmd - the command block
+// Outputs      : the size in bytes
+
+size_t tagged_reply_size(FS3CmdBlk cmd)
+{
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+
+    deconstruct_fs3_cmdblock(cmd, &op, &sec, &trk, &retval);
+    if ((op == FS3_OP_RDSECT) || (op == FS3_OP_RDSECTS) || (op == FS3_OP_RDTRACK)) {
+        return(FS3_NET_TAG_SIZE + FS3_NET_HEADER_SIZE + fs3_controller_cmd_sectors(cmd) * FS3_SECTOR_SIZE);
+    }
+    return(FS3_NET_TAG_SIZE + FS3_NET_HEADER_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_fail
+// Description  : Completes the requests on the wire and in the submission
+//                queue as failed, after the connection broke or on shutdown
+//
+// Inputs       : none
+// Outputs      : none
+
+void tagged_fail(void)
+{
+    fs3_net_request *req = NULL;
+    int i = 0;
+
+    for (i = 0; i < FS3_MAX_TAGS; i++) {
+        if (NULL != (req = tagged_inflight[i])) {
+            tagged_inflight[i] = NULL;
+            tagged_free[tagged_nfree++] = i;
+            req->ret = req->cmd | (((FS3CmdBlk) FAIL) << 11);
+            req->result = -1;
+            req->done(req);
+        }
+    }
+    tagged_reply_bytes = 0;
+    if (NULL != (req = tagged_held)) {
+        tagged_held = NULL;
+        req->ret = req->cmd | (((FS3CmdBlk) FAIL) << 11);
+        req->result = -1;
+        req->done(req);
+    }
+    while (NULL != (req = tagged_pop())) {
+        req->ret = req->cmd | (((FS3CmdBlk) FAIL) << 11);
+        req->result = -1;
+        req->done(req);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_receive
+// Description  : Reads one reply off the tagged connection and completes
+//                the request with its tag, in whatever order they come
+//
+// Inputs       : socket_fd - the socket
+// Outputs      : 0 if successful, -1 if the connection failed
+
+int tagged_receive(int socket_fd)
+{
+    uint64_t reply[2];
+    fs3_net_request *req = NULL;
+    uint64_t tag = 0;
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+
+    if (-1 == network_read_all(socket_fd, reply, sizeof(reply))) {
+        return(-1);
+    }
+    tag = ntohll64(reply[0]);
+    if ((tag >= FS3_MAX_TAGS) || (NULL == (req = tagged_inflight[tag]))) {
+        return(-1);
+    }
+    req->ret = (FS3CmdBlk) ntohll64(reply[1]);
+    deconstruct_fs3_cmdblock(req->ret, &op, &sec, &trk, &retval);
+    req->result = (retval == FAIL) ? -1 : 0;
+
+    // a read that worked has its sectors behind the reply
+    deconstruct_fs3_cmdblock(req->cmd, &op, &sec, &trk, &retval);
+    if ((req->result == 0) && ((op == FS3_OP_RDSECT) || (op == FS3_OP_RDSECTS) || (op == FS3_OP_RDTRACK)) &&
+        (-1 == network_read_all(socket_fd, req->buf, fs3_controller_cmd_sectors(req->cmd) * FS3_SECTOR_SIZE))) {
+        return(-1);
+    }
+
+    tagged_inflight[tag] = NULL;
+    tagged_free[tagged_nfree++] = tag;
+    tagged_reply_bytes -= tagged_reply_size(req->cmd);
+    req->done(req);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_dispatcher
+// Description  : The thread that owns the tagged connection. It tags the
+//                submitted requests and writes them out while there are
+//                free tags, and completes requests as their replies come in.
+//                The socket write blocks, and the server stops reading a
+//                client with a lot of replies unsent, so the replies on the
+//                wire are kept under FS3_TAGGED_REPLY_MAX; the server then
+//                always reads on and the write always finishes.
+//
+// Inputs       : arg - not used
+// Outputs      : NULL
+
+void *tagged_dispatcher(void *arg)
+{
+    struct pollfd fds[2];
+    struct iovec iov[FS3_MAX_TAGS * 2];
+    uint64_t wire[FS3_MAX_TAGS][2];
+    uint64_t count = 0;
+    fs3_net_request *req = NULL;
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0, tag = 0;
+    uint32_t trk = 0;
+    size_t reply = 0;
+    int iovcnt = 0, sending = 0, failed = 0, quickack = 1;
+    int socket_fd = socket_fds[0];
+
+    while (!__atomic_load_n(&tagged_stop, __ATOMIC_ACQUIRE)) {
+        // put the new requests on the wire while there are tags for them
+        // and room for their replies (one always goes if none is out)
+        iovcnt = 0;
+        sending = 0;
+        while ((!failed) && (tagged_nfree > 0) &&
+               (NULL != (req = (NULL != tagged_held) ? tagged_held : tagged_pop()))) {
+            reply = tagged_reply_size(req->cmd);
+            if ((tagged_reply_bytes > 0) && (tagged_reply_bytes + reply > FS3_TAGGED_REPLY_MAX)) {
+                tagged_held = req;
+                break;
+            }
+            tagged_held = NULL;
+            tagged_reply_bytes += reply;
+            tag = tagged_free[--tagged_nfree];
+            tagged_inflight[tag] = req;
+            wire[sending][0] = htonll64((uint64_t) tag);
+            wire[sending][1] = htonll64(req->cmd);
+            iov[iovcnt].iov_base = wire[sending++];
+            iov[iovcnt++].iov_len = FS3_NET_TAG_SIZE + FS3_NET_HEADER_SIZE;
+            deconstruct_fs3_cmdblock(req->cmd, &op, &sec, &trk, &retval);
+            if ((op == FS3_OP_WRSECT) || (op == FS3_OP_WRSECTS)) {
+                iov[iovcnt].iov_base = req->buf;
+                iov[iovcnt++].iov_len = fs3_controller_cmd_sectors(req->cmd) * FS3_SECTOR_SIZE;
+            }
+        }
+        if ((iovcnt > 0) && (-1 == network_writev_all(socket_fd, iov, iovcnt))) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 tagged connection failed to send [%s]", strerror(errno));
+            failed = 1;
+        }
+
+        // once the connection is gone every request fails
+        if (failed) {
+            tagged_fail();
+        }
+
+        // wait for a reply or a submission
+        fds[0].fd = (failed) ? -1 : socket_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = tagged_wake;
+        fds[1].events = POLLIN;
+        if (-1 == poll(fds, 2, -1)) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            read(tagged_wake, &count, sizeof(count));
+        }
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            setsockopt(socket_fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+            if (-1 == tagged_receive(socket_fd)) {
+                logMessage(LOG_ERROR_LEVEL, "FS3 tagged connection failed to receive");
+                failed = 1;
+            }
+        }
+    }
+
+    // nobody should be waiting now, but do not leave anyone hanging
+    tagged_fail();
+    return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_start
+// Description  : Starts the dispatcher of the tagged connection, after the
+//                server agreed to tags at mount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int tagged_start(void)
+{
+    int i = 0;
+
+    tagged_stub.next = NULL;
+    tagged_head = &tagged_stub;
+    tagged_tail = &tagged_stub;
+    for (i = 0; i < FS3_MAX_TAGS; i++) {
+        tagged_inflight[i] = NULL;
+        tagged_free[i] = FS3_MAX_TAGS - 1 - i;
+    }
+    tagged_nfree = FS3_MAX_TAGS;
+    tagged_held = NULL;
+    tagged_reply_bytes = 0;
+    tagged_stop = 0;
+
+    if (-1 == (tagged_wake = eventfd(0, 0))) {
+        return(-1);
+    }
+    if (0 != pthread_create(&tagged_thread, NULL, tagged_dispatcher, NULL)) {
+        close(tagged_wake);
+        tagged_wake = -1;
+        return(-1);
+    }
+    __atomic_store_n(&tagged_running, 1, __ATOMIC_RELEASE);
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_finish
+// Description  : Stops the dispatcher of the tagged connection
+//
+// Inputs       : none
+// Outputs      : none
+
+void tagged_finish(void)
+{
+    uint64_t one = 1;
+
+    if (!tagged_running) {
+        return;
+    }
+    __atomic_store_n(&tagged_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&tagged_stop, 1, __ATOMIC_RELEASE);
+    write(tagged_wake, &one, sizeof(one));
+    pthread_join(tagged_thread, NULL);
+    close(tagged_wake);
+    tagged_wake = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_submit
+// Description  : Queues a request on the tagged connection. It can be called
+//                from any thread; req->done is called on the dispatcher
+//                thread when the reply is in, and the replies of different
+//                requests can come back in any order.
+//
+// Inputs       : req - the request (cmd, buf and done set by the caller)
+// Outputs      : 0 if queued, -1 if there is no tagged connection
+
+int network_fs3_submit(fs3_net_request *req)
+{
+    uint64_t one = 1;
+
+    if (!__atomic_load_n(&tagged_running, __ATOMIC_ACQUIRE)) {
+        return(-1);
+    }
+    tagged_push(req);
+    write(tagged_wake, &one, sizeof(one));
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_concurrent
+// Description  : Tells if the connection can take commands from several
+//                threads at once. Only the tagged connection can, each
+//                thread keeps its own track there; the others must be used
+//                by one thread at a time.
+//
+// Inputs       : none
+// Outputs      : 1 if commands can be sent from any thread, 0 if not
+
+int network_fs3_concurrent(void)
+{
+    return(__atomic_load_n(&tagged_running, __ATOMIC_ACQUIRE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_waiter_done
+// Description  : Completion of a request someone is waiting on
+//
+// Inputs       : req - the request
+// Outputs      : none
+
+void tagged_waiter_done(fs3_net_request *req)
+{
+    tagged_waiter *waiter = (tagged_waiter *) req->arg;
+
+    if (0 == __atomic_sub_fetch(&waiter->left, 1, __ATOMIC_ACQ_REL)) {
+        sem_post(&waiter->sem);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_send_batch
+// Description  : Runs a batch of commands on the tagged connection, with up
+//                to FS3_MAX_TAGS of them in flight at once. The requests can
+//                finish in any order, so a TSEEK only sets the track of this
+//                thread and the sector commands after it carry that track.
+//
+// Inputs       : cmds - the command blocks to send
+//                rets - the returned command blocks
+//                bufs - the sector buffer of each command
+//                n - number of commands
+// Outputs      : 0 if successful, -1 if any command failed
+
+int tagged_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n)
+{
+    fs3_net_request reqs[FS3_MAX_TAGS];
+    uint8_t submitted[FS3_MAX_TAGS];
+    tagged_waiter waiter;
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+    int i = 0, done = 0, cnt = 0, failed = 0;
+
+    sem_init(&waiter.sem, 0, 0);
+    for (done = 0; (done < n) && (!failed); done += cnt) {
+        cnt = ((n - done) < FS3_MAX_TAGS) ? (n - done) : FS3_MAX_TAGS;
+
+        // hold the waiter until everything is submitted
+        waiter.left = 1;
+        for (i = 0; i < cnt; i++) {
+            submitted[i] = 0;
+            rets[done + i] = cmds[done + i];
+            if (failed) {
+                continue;
+            }
+            deconstruct_fs3_cmdblock(cmds[done + i], &op, &sec, &trk, &retval);
+            if ((op == FS3_OP_TSEEK) || (op == FS3_OP_RDTRACK)) {
+                if (trk >= FS3_MAX_TRACKS) {
+                    rets[done + i] |= ((FS3CmdBlk) FAIL) << 11;
+                    failed = 1;
+                    continue;
+                }
+                tagged_track = trk;
+                if (op == FS3_OP_TSEEK) {
+                    continue;
+                }
+            }
+
+            reqs[i].cmd = cmds[done + i];
+            if ((op != FS3_OP_RDTRACK) && (fs3_controller_cmd_sectors(cmds[done + i]) > 0)) {
+                reqs[i].cmd = (reqs[i].cmd & ~CMD_TRK_MASK) | (((FS3CmdBlk) tagged_track) << 12);
+            }
+            reqs[i].buf = bufs[done + i];
+            reqs[i].done = tagged_waiter_done;
+            reqs[i].arg = &waiter;
+            __atomic_add_fetch(&waiter.left, 1, __ATOMIC_ACQ_REL);
+            if (-1 == network_fs3_submit(&reqs[i])) {
+                __atomic_sub_fetch(&waiter.left, 1, __ATOMIC_ACQ_REL);
+                failed = 1;
+                continue;
+            }
+            submitted[i] = 1;
+        }
+
+        // let go of the hold, and wait if anything is still out
+        if (0 != __atomic_sub_fetch(&waiter.left, 1, __ATOMIC_ACQ_REL)) {
+            while ((-1 == sem_wait(&waiter.sem)) && (errno == EINTR));
+        }
+        for (i = 0; i < cnt; i++) {
+            if (submitted[i]) {
+                rets[done + i] = reqs[i].ret;
+                failed |= (reqs[i].result == -1);
+            }
+        }
+    }
+    sem_destroy(&waiter.sem);
+    return((failed) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagged_send
+// Description  : Runs one command on the tagged connection and waits for it
+//
+// Inputs       : cmd - the command block to send
+//                ret - the returned command block
+//                buf - the sector buffer
+// Outputs      : 0 if successful, -1 if failure
+
+int tagged_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+{
+    return(tagged_send_batch(&cmd, ret, &buf, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_setup
+// Description  : Sets up the ring and registers the staging buffer the
+//                replies are read into. There is no liburing, so this maps
+//                the rings the way the kernel lays them out.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int uring_setup(void)
+{
+    struct io_uring_params params;
+    struct iovec staging;
+
+    memset(&params, 0x0, sizeof(params));
+    memset(&uring, 0x0, sizeof(uring));
+    if (-1 == (uring.fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params))) {
+        return(-1);
+    }
+
+    // the rings, in one mapping if the kernel can do that
+    uring.sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.sq_len = uring.cq_len = (uring.sq_len > uring.cq_len) ? uring.sq_len : uring.cq_len;
+    }
+    uring.sq_ptr = mmap(NULL, uring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ptr == MAP_FAILED) {
+        uring.sq_ptr = NULL;
+        return(-1);
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ptr = uring.sq_ptr;
+    } else {
+        uring.cq_ptr = mmap(NULL, uring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ptr == MAP_FAILED) {
+            uring.cq_ptr = NULL;
+            return(-1);
+        }
+    }
+    uring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        return(-1);
+    }
+    uring.sq_head = (uint32_t *) (uring.sq_ptr + params.sq_off.head);
+    uring.sq_tail = (uint32_t *) (uring.sq_ptr + params.sq_off.tail);
+    uring.sq_mask = (uint32_t *) (uring.sq_ptr + params.sq_off.ring_mask);
+    uring.sq_array = (uint32_t *) (uring.sq_ptr + params.sq_off.array);
+    uring.cq_head = (uint32_t *) (uring.cq_ptr + params.cq_off.head);
+    uring.cq_tail = (uint32_t *) (uring.cq_ptr + params.cq_off.tail);
+    uring.cq_mask = (uint32_t *) (uring.cq_ptr + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (uring.cq_ptr + params.cq_off.cqes);
+
+    // the staging buffer is pinned once here, not on every read; without
+    // it (locked memory limit) the reads are plain ones into the same buffer
+    uring_staging = mmap(NULL, FS3_URING_STAGING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring_staging == MAP_FAILED) {
+        uring_staging = NULL;
+        return(-1);
+    }
+    staging.iov_base = uring_staging;
+    staging.iov_len = FS3_URING_STAGING_SIZE;
+    uring_fixed = (0 == syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, &staging, 1));
+    if (!uring_fixed) {
+        logMessage(LOG_WARNING_LEVEL, "FS3 io_uring could not register its buffer [%s]", strerror(errno));
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_teardown
+// Description  : Unmaps the ring and the staging buffer
+//
+// Inputs       : none
+// Outputs      : none
+
+void uring_teardown(void)
+{
+    if (uring.sqes != NULL) {
+        munmap(uring.sqes, uring.sqes_len);
+    }
+    if ((uring.cq_ptr != NULL) && (uring.cq_ptr != uring.sq_ptr)) {
+        munmap(uring.cq_ptr, uring.cq_len);
+    }
+    if (uring.sq_ptr != NULL) {
+        munmap(uring.sq_ptr, uring.sq_len);
+    }
+    if (uring.fd > 0) {
+        close(uring.fd);
+    }
+    if (uring_staging != NULL) {
+        munmap(uring_staging, FS3_URING_STAGING_SIZE);
+    }
+    memset(&uring, 0x0, sizeof(uring));
+    uring_staging = NULL;
+    uring_ready = 0;
+    uring_fixed = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_get_sqe
+// Description  : Takes the next submission queue entry, the ring is never
+//                full since at most two entries are out at a time
+//
+// Inputs       : none
+// Outputs      : the cleared entry
+
+struct io_uring_sqe *uring_get_sqe(void)
+{
+    uint32_t tail = *uring.sq_tail;
+    uint32_t idx = tail & *uring.sq_mask;
+
+    uring.sq_array[idx] = idx;
+    memset(&uring.sqes[idx], 0x0, sizeof(struct io_uring_sqe));
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return(&uring.sqes[idx]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_prep_read
+// Description  : Queues a read of replies into the staging buffer
+//
+// Inputs       : off - where in the staging buffer
+//                len - most bytes to read
+// Outputs      : none
+
+void uring_prep_read(size_t off, size_t len)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    sqe->opcode = (uring_fixed) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = socket_fds[0];
+    sqe->addr = (uint64_t) (uintptr_t) (uring_staging + off);
+    sqe->len = (uint32_t) len;
+    sqe->off = (uint64_t) -1;
+    sqe->buf_index = 0;
+    sqe->user_data = URING_RECV;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_connect
+// Description  : Opens the connection to the controller server and sets up
+//                the ring; without io_uring the connection is used the
+//                blocking way. The ring drives one connection, so tracks
+//                are not striped over fs3_network_connections here.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int uring_connect(void)
+{
+    if (-1 == tcp_connect()) {
+        return(-1);
+    }
+    if (-1 == uring_setup()) {
+        logMessage(LOG_WARNING_LEVEL, "FS3 io_uring is not available [%s], using blocking sockets", strerror(errno));
+        uring_teardown();
+        return(0);
+    }
+    uring_ready = 1;
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_close
+// Description  : Tears down the ring and closes the connection
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int uring_close(void)
+{
+    uring_teardown();
+    return(tcp_close());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_send
+// Description  : Sends a command to the controller server through the ring,
+//                MOUNT and UMOUNT go the blocking way
+//
+// Inputs       : cmd - the command block to send
+//                ret - the returned command block
+//                buf - the sector buffer
+// Outputs      : 0 if successful, -1 if failure
+
+int uring_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+{
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+
+    deconstruct_fs3_cmdblock(cmd, &op, &sec, &trk, &retval);
+    if ((op == FS3_OP_MOUNT) || (op == FS3_OP_UMOUNT)) {
+        return(tcp_send(cmd, ret, buf));
+    }
+    return(uring_send_batch(&cmd, ret, &buf, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uring_send_batch
+// Description  : Sends a batch of commands to the controller server through
+//                the ring. Each window is one sendmsg of the command blocks
+//                and write payloads, linked to a read of the replies into
+//                the registered staging buffer, so a window costs one
+//                io_uring_enter when the replies come in one piece. A
+//                window holds at most FS3_NET_BATCH_WINDOW commands whose
+//                replies fit the staging buffer. As with tcp_send_batch,
+//                the controller fails the commands behind a failed seek.
+//
+// Inputs       : cmds - the command blocks to send
+//                rets - the returned command blocks
+//                bufs - the sector buffer of each command (NULL for TSEEK)
+//                n - number of commands
+// Outputs      : 0 if successful, -1 if any command failed
+
+int uring_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n)
+{
+    struct iovec iov[FS3_NET_BATCH_WINDOW * 2];
+    uint64_t wire[FS3_NET_BATCH_WINDOW];
+    int sent[FS3_NET_BATCH_WINDOW];
+    struct msghdr msg;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe = NULL;
+    uint32_t head = 0, tail = 0;
+    size_t expect = 0, reply = 0, got = 0, parsed = 0, len = 0, sendlen = 0;
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+    int i = 0, k = 0, done = 0, cnt = 0, nsent = 0, iovcnt = 0, failed = 0, broken = 0;
+    int submit = 0, inflight = 0, seek_done = 0, quickack = 1;
+    long res = 0;
+
+    if (socket_count == 0) {
+        return (-1);
+    }
+    if ((!uring_ready) || (tagged_running)) {
+        return(tcp_send_batch(cmds, rets, bufs, n));
+    }
+
+    for (done = 0; (done < n) && (!failed); done += cnt) {
+        // take commands while their replies fit the staging buffer
+        expect = 0;
+        sendlen = 0;
+        nsent = 0;
+        iovcnt = 0;
+        for (cnt = 0; (done + cnt < n) && (cnt < FS3_NET_BATCH_WINDOW); cnt++) {
+            deconstruct_fs3_cmdblock(cmds[done + cnt], &op, &sec, &trk, &retval);
+            if ((op == FS3_OP_MOUNT) || (op == FS3_OP_UMOUNT) || (op >= FS3_OP_MAXVAL)) {
+                return(-1);
+            }
+            len = fs3_controller_cmd_sectors(cmds[done + cnt]) * FS3_SECTOR_SIZE;
+            reply = FS3_NET_HEADER_SIZE + (((op == FS3_OP_RDSECT) || (op == FS3_OP_RDSECTS) || (op == FS3_OP_RDTRACK)) ? len : 0);
+            if (expect + reply > FS3_URING_STAGING_SIZE) {
+                break;
+            }
+            i = done + cnt;
+            tcp_route(cmds[i], &seek_done);
+            if (seek_done) {
+                rets[i] = cmds[i];
+                continue;
+            }
+            expect += reply;
+            sent[nsent] = i;
+            wire[nsent] = htonll64(cmds[i]);
+            iov[iovcnt].iov_base = &wire[nsent++];
+            iov[iovcnt++].iov_len = FS3_NET_HEADER_SIZE;
+            sendlen += FS3_NET_HEADER_SIZE;
+            if ((op == FS3_OP_WRSECT) || (op == FS3_OP_WRSECTS)) {
+                iov[iovcnt].iov_base = bufs[i];
+                iov[iovcnt++].iov_len = len;
+                sendlen += len;
+            }
+        }
+        if (nsent == 0) {
+            continue;
+        }
+
+        // the send, and the read of the replies once it is out
+        memset(&msg, 0x0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = socket_fds[0];
+        sqe->addr = (uint64_t) (uintptr_t) &msg;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = URING_SEND;
+        uring_prep_read(0, expect);
+        submit = 2;
+        inflight = 2;
+        got = 0;
+        parsed = 0;
+        k = 0;
+
+        // ack the replies right away, the server holds back the next small
+        // reply until the last one is acked; once a window is enough
+        if (nsent > 1) {
+            setsockopt(socket_fds[0], IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+            fs3_network_syscalls++;
+        }
+
+        while ((inflight > 0) || ((k < nsent) && (!broken))) {
+            if ((k < nsent) && (!broken) && (inflight == 0)) {
+                // the replies came in pieces, read the rest
+                uring_prep_read(got, expect - got);
+                submit = 1;
+                inflight = 1;
+            }
+            // the read only ends once replies are in, so wait for everything out
+            res = syscall(__NR_io_uring_enter, uring.fd, submit, inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+            fs3_network_syscalls++;
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                logMessage(LOG_ERROR_LEVEL, "FS3 io_uring enter failed [%s]", strerror(errno));
+                socket_tracks[0] = FS3_NO_TRACK;
+                return(-1);
+            }
+            submit -= (int) res;
+
+            // reap whatever completed
+            head = *uring.cq_head;
+            tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                cqe = &uring.cqes[head & *uring.cq_mask];
+                inflight--;
+                if (cqe->user_data == URING_SEND) {
+                    broken |= (cqe->res != (int32_t) sendlen);
+                } else if (cqe->res <= 0) {
+                    broken = 1;
+                } else {
+                    got += cqe->res;
+                }
+            }
+            __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+            // take the replies that are all in, a failed reply has no payload
+            while ((k < nsent) && (got - parsed >= FS3_NET_HEADER_SIZE)) {
+                i = sent[k];
+                memcpy(&rets[i], uring_staging + parsed, sizeof(FS3CmdBlk));
+                rets[i] = (FS3CmdBlk) ntohll64((uint64_t) rets[i]);
+                deconstruct_fs3_cmdblock(rets[i], &op, &sec, &trk, &retval);
+                len = 0;
+                if (retval != FAIL) {
+                    deconstruct_fs3_cmdblock(cmds[i], &op, &sec, &trk, &retval);
+                    if ((op == FS3_OP_RDSECT) || (op == FS3_OP_RDSECTS) || (op == FS3_OP_RDTRACK)) {
+                        len = fs3_controller_cmd_sectors(cmds[i]) * FS3_SECTOR_SIZE;
+                    }
+                } else {
+                    // no telling where the head is now
+                    socket_tracks[0] = FS3_NO_TRACK;
+                    failed = 1;
+                }
+                if (got - parsed < FS3_NET_HEADER_SIZE + len) {
+                    break;
+                }
+                if (len > 0) {
+                    memcpy(bufs[i], uring_staging + parsed + FS3_NET_HEADER_SIZE, len);
+                }
+                parsed += FS3_NET_HEADER_SIZE + len;
+                k++;
+            }
+        }
+        if (broken) {
+            logMessage(LOG_ERROR_LEVEL, "FS3 io_uring connection failed");
+            socket_tracks[0] = FS3_NO_TRACK;
+            return(-1);
+        }
+    }
+
+    return((failed) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : local_connect
+// Description  : Maps the disk image of the in-process controller
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int local_connect(void)
+{
+    local_context.mounted = 0;
+    local_context.tagged = 0;
+    local_context.track = FS3_NO_TRACK;
+    return(fs3_controller_open(fs3_controller_image));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : local_close
+// Description  : Unmaps the disk image of the in-process controller
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int local_close(void)
+{
+    return(fs3_controller_close());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : local_send
+// Description  : Runs a command on the in-process controller
+//
+// Inputs       : cmd - the command block to send
+//                ret - the returned command block
+//                buf - the sector buffer
+// Outputs      : 0 if successful, -1 if failure
+
+int local_send(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+{
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+
+    *ret = fs3_controller_execute(&local_context, cmd, buf);
+    deconstruct_fs3_cmdblock(*ret, &op, &sec, &trk, &retval);
+    return((retval == FAIL) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : local_send_batch
+// Description  : Runs a batch of commands on the in-process controller,
+//                stopping at the first failure
+//
+// Inputs       : cmds - the command blocks to send
+//                rets - the returned command blocks
+//                bufs - the sector buffer of each command
+//                n - number of commands
+// Outputs      : 0 if successful, -1 if failure
+
+int local_send_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n)
+{
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        if (-1 == local_send(cmds[i], &rets[i], bufs[i])) {
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fs3_network_transport_by_name
+// Description  : Finds a transport by its name
+//
+// Inputs       : name - the transport name (tcp, local or uring)
+// Outputs      : the transport, -1 if there is no such transport
+
+int fs3_network_transport_by_name(const char *name)
+{
+    int i = 0;
+
+    for (i = 0; i < FS3_MAXTRANSPORT; i++) {
+        if (0 == strcmp(name, transports[i].name)) {
+            return(i);
+        }
+    }
+    return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_syscall
+// Description  : Perform a system call over the selected transport, it is
+//                connected on MOUNT and closed after UMOUNT
+//
+// Inputs       : cmd - the command block to send
+//                ret - the returned command block
+//                buf - the buffer to place received data in
+// Outputs      : 0 if successful, -1 if failure
+
+int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf)
+{
+    const fs3_transport *transport = &transports[fs3_network_transport];
+    uint8_t op = 0, retval = 0;
+    uint16_t sec = 0;
+    uint32_t trk = 0;
+    int result = 0;
+
+    // deconstruct the command block
+    deconstruct_fs3_cmdblock(cmd, &op, &sec, &trk, &retval);
+
+    // if this is mount operation, connect first
+    if ((FS3_OP_MOUNT == op) && (-1 == transport->connect())) {
+        return(-1);
+    }
+
+    result = transport->send(cmd, ret, buf);
+    __atomic_add_fetch(&fs3_network_sectors, fs3_controller_cmd_sectors(cmd), __ATOMIC_RELAXED);
+
+    // close the connection if the operation is unmount
+    if (FS3_OP_UMOUNT == op) {
+        transport->close();
+    }
+    return(result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : network_fs3_syscall_batch
+// Description  : Perform a batch of system calls over the selected transport
+//                (see tcp_send_batch), only TSEEK, RDSECT and WRSECT can be
+//                batched
+//
+// Inputs       : cmds - the command blocks to send
+//                rets - the returned command blocks
+//                bufs - the sector buffer of each command (NULL for TSEEK)
+//                n - number of commands
+// Outputs      : 0 if successful, -1 if any command failed
+
+int network_fs3_syscall_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n)
+{
+    int i = 0;
+
+    for (i = 0; i < n; i++) {
+        __atomic_add_fetch(&fs3_network_sectors, fs3_controller_cmd_sectors(cmds[i]), __ATOMIC_RELAXED);
+    }
+    return(transports[fs3_network_transport].send_batch(cmds, rets, bufs, n));
+}
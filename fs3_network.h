@@ -18,13 +18,52 @@
 // Defines
 #define FS3_MAX_BACKLOG 5
 #define FS3_NET_HEADER_SIZE sizeof(FS3CmdBlk)
+#define FS3_NET_TAG_SIZE sizeof(uint64_t) // Tag in front of a tagged command or reply
 #define FS3_DEFAULT_IP "127.0.0.1"
 #define FS3_DEFAULT_PORT 22887
+#define FS3_NET_BATCH_WINDOW 64 // Commands in flight in a batch before draining replies
+#define FS3_MAX_CONNECTIONS 16  // Most connections in the pool to the controller server
+#define FS3_MAX_TAGS 64         // Most tagged requests in flight on the connection
+#define FS3_TAGGED_REPLY_MAX (512 * 1024) // Reply bytes in flight on the tagged connection, under what the server holds unsent
+#define FS3_URING_STAGING_SIZE (2 * FS3_TRACK_SIZE * FS3_SECTOR_SIZE) // Replies of a window on the io_uring transport
 
 
+// The ways of reaching the controller
+typedef enum {
+	FS3_TRANSPORT_TCP   = 0,  // The controller server over a socket
+	FS3_TRANSPORT_LOCAL = 1,  // The controller in this process, on a disk image
+	FS3_TRANSPORT_URING = 2,  // The controller server over one socket driven by io_uring
+	FS3_MAXTRANSPORT    = 3   // Number of transports
+} FS3Transport;
+
+// A transport, the connection is opened on MOUNT and closed after UMOUNT
+typedef struct fs3_transport {
+	const char *name;
+	int (*connect)(void);
+	int (*send)(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
+	int (*send_batch)(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n);
+	int (*close)(void);
+} fs3_transport;
+
+// A request on the tagged connection, it stays the caller's until done is called
+typedef struct fs3_net_request {
+	FS3CmdBlk cmd;     // The command, sector commands carry their track
+	FS3CmdBlk ret;     // The reply
+	void *buf;         // The sectors to write or to read into
+	int result;        // 0 if the command worked, -1 if not
+	void (*done)(struct fs3_net_request *req); // Called on the dispatcher thread
+	void *arg;         // For the caller
+	struct fs3_net_request *next; // Link in the submission queue
+} fs3_net_request;
+
 // Global data
 extern unsigned char *fs3_network_address;     // Address of FS3 server
 extern unsigned short fs3_network_port;        // Port of FS3 server
+extern FS3Transport fs3_network_transport;     // Transport used to reach the controller
+extern uint16_t fs3_network_connections;       // Connections to the controller server, striped by track (tcp only, uring and tags use one)
+extern uint8_t fs3_network_tagged;             // Ask the server for tagged commands on one connection
+extern uint32_t fs3_network_syscalls;          // System calls moving commands and sectors
+extern uint32_t fs3_network_sectors;           // Sectors moved
 
 //
 // Functional Prototypes
@@ -32,5 +71,17 @@ extern unsigned short fs3_network_port;        // Port of FS3 server
 int network_fs3_syscall(FS3CmdBlk cmd, FS3CmdBlk *ret, void *buf);
 	// This is the client/network system call for communicating with controller
 
+int network_fs3_syscall_batch(FS3CmdBlk *cmds, FS3CmdBlk *rets, void **bufs, int n);
+	// Sends a batch of TSEEK and sector read/write commands pipelined, then reads the replies
+
+int network_fs3_submit(fs3_net_request *req);
+	// Queues a request on the tagged connection, -1 if there is none
+
+int network_fs3_concurrent(void);
+	// Tells if several threads can send commands at once (tagged connection)
+
+int fs3_network_transport_by_name(const char *name);
+	// Find a transport by name (tcp, local or uring), -1 if unknown
+
 
 #endif
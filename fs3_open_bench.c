@@ -0,0 +1,169 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_open_bench.c
+//  Description    : This is a microbenchmark of fs3_open. It creates files
+//                   with distinct paths 10K at a time and, as the file table
+//                   grows, reports the opens per second of new paths and of
+//                   reopening every path after it is closed.
+//
+//  Author         : Sarah Babu
+//  Last Modified  : 11/19/2021
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_driver.h>
+#include <fs3_controller.h>
+#include <fs3_common.h>
+#include <fs3_network.h>
+
+//
+// Defines
+#define FS3_OPEN_BENCH_ARGUMENTS "hn:"
+#define USAGE \
+	"USAGE: fs3_open_bench [-h] [-n <files>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -n - files to create, 10000 at a time (default 30000, at most 32767 as handles are int16_t)\n" \
+	"\n"
+
+#define FS3_OPEN_BENCH_STEP 10000 // files created between reports
+#define FS3_OPEN_BENCH_MAX_FILES INT16_MAX // most handles fs3_open gives out
+
+//
+// Functional Prototypes
+
+double bench_seconds(struct timespec *start);
+	// Gives the seconds since start
+
+void bench_path(char *path, uint32_t i);
+	// Gives the path of a file
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 open benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+	char path[FS3_MAX_PATH_LENGTH];
+	uint32_t most = 30000, files = 0, step = 0, i = 0;
+	struct timespec start;
+	double create = 0, reopen = 0;
+	int ch;
+
+	// the local controller on a disk in memory
+	fs3_network_transport = FS3_TRANSPORT_LOCAL;
+	fs3_controller_image = NULL;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, FS3_OPEN_BENCH_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf(stderr, USAGE);
+			return(-1);
+
+		case 'n': // Set the files to create
+			if ((sscanf(optarg, "%u", &most) != 1) || (most == 0) || (most > FS3_OPEN_BENCH_MAX_FILES)) {
+				fprintf(stderr, "Bad number of files [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return(-1);
+		}
+	}
+	initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+	FS3DriverLLevel = registerLogLevel("FS3_DRIVER", 0);
+
+	if (fs3_mount_disk() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 open benchmark failed to mount.");
+		return(-1);
+	}
+
+	printf("%10s %16s %16s\n", "files", "new opens/sec", "reopens/sec");
+	while (files < most) {
+		step = ((most - files) < FS3_OPEN_BENCH_STEP) ? (most - files) : FS3_OPEN_BENCH_STEP;
+
+		// paths never seen, each adds a handle
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = files; i < files + step; i++) {
+			bench_path(path, i);
+			if (fs3_open(path) != (int16_t) i) {
+				logMessage(LOG_ERROR_LEVEL, "FS3 open benchmark failed creating [%s]", path);
+				fs3_unmount_disk();
+				return(-1);
+			}
+		}
+		create = bench_seconds(&start);
+		files += step;
+
+		// every path so far again, each finds its old handle
+		for (i = 0; i < files; i++) {
+			fs3_close(i);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < files; i++) {
+			bench_path(path, i);
+			if (fs3_open(path) != (int16_t) i) {
+				logMessage(LOG_ERROR_LEVEL, "FS3 open benchmark failed reopening [%s]", path);
+				fs3_unmount_disk();
+				return(-1);
+			}
+		}
+		reopen = bench_seconds(&start);
+
+		printf("%10u %16.0f %16.0f\n", files, (create > 0) ? step / create : 0.0,
+		       (reopen > 0) ? files / reopen : 0.0);
+	}
+
+	if (fs3_unmount_disk() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 open benchmark failed to unmount.");
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_seconds
+// Description  : Gives the seconds since a start time
+//
+// Inputs       : start - the start time
+// Outputs      : the seconds
+
+double bench_seconds(struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return((end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_path
+// Description  : Gives the path of a file of the benchmark
+//
+// Inputs       : path - set to the path
+//                i - the file
+// Outputs      : none
+
+void bench_path(char *path, uint32_t i) {
+	snprintf(path, FS3_MAX_PATH_LENGTH, "bench/dir-%u/file-%u.dat", i % 64, i);
+}
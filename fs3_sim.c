@@ -32,17 +32,33 @@
 // Defines
 #define FS3_WORKLOAD_DIR "workload"
 #define FS3_SIM_MAX_OPEN_FILES 256
-#define FS3_ARGUMENTS "hvc:l:i:p:"
+#define FS3_ARGUMENTS "hvc:e:k:r:b:D:t:d:l:i:p:n:HWSLT"
 #define USAGE \
-	"USAGE: fs3_sim [-h] [-v] [-c <cache size>] [-l <logfile>] <workload-file>\n" \
+	"USAGE: fs3_sim [-h] [-v] [-c <cache size>] [-e <policy>] [-k <shards>] [-r <sectors>] [-b <bytes>] [-D <sectors>] [-H] [-W] [-S] [-L] [-t <transport>] [-d <disk image>] [-i <ip>] [-p <port>] [-n <connections>] [-T] [-l <logfile>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
 	"    -c - set the cache size (in number of sectors)\n" \
+	"    -e - cache replacement policy (lru, 2q or arc)\n" \
+	"    -k - number of cache shards, a power of two (0 sizes them by the cache)\n" \
+	"    -r - maximum read-ahead window in sectors (0 disables read-ahead)\n" \
+	"    -b - bytes of small writes to a file buffered before they go out, at most a\n" \
+	"         sector (0 disables write buffering)\n" \
+	"    -D - sectors a second the background defragmenter moves (default 0, off)\n" \
+	"    -H - back the cache with huge pages\n" \
+	"    -W - write-through cache (default is write-back)\n" \
+	"    -S - only use the single sector controller commands\n" \
+	"    -L - log-structured writes, with a background segment cleaner\n" \
+	"    -t - transport to the controller (tcp, local for an in-process controller, or uring for tcp driven by io_uring)\n" \
+	"    -d - disk image of the local controller (default fs3_disk.img)\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
     "    -i - IP address of server to connect to.\n" \
     "    -p - port number of server to connect to.\n" \
+	"    -n - number of connections to the server, tracks are striped over them\n" \
+	"         (the server must take several clients at once, like fs3_controller_server;\n" \
+	"         tcp only, the uring transport and -T use a single connection)\n" \
+	"    -T - tag the commands so many are in flight on one connection to the server\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -56,7 +72,7 @@ typedef struct {
 //
 // Global Data
 int verbose;
-uint16_t fs3CacheSize = FS3_DEFAULT_CACHE_SIZE; 
+uint32_t fs3CacheSize = FS3_DEFAULT_CACHE_SIZE; 
 
 //
 // Functional Prototypes
@@ -79,7 +95,7 @@ int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesyst
 int main( int argc, char *argv[] ) {
 
 	// Local variables
-	int ch, verbose = 0, log_initialized = 0;
+	int ch, verbose = 0, log_initialized = 0, policy, transport;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, FS3_ARGUMENTS)) != -1) {
@@ -99,12 +115,76 @@ int main( int argc, char *argv[] ) {
 			break;
 
 		case 'c': // Set the cache size
-			if ( sscanf(optarg, "%hu", &fs3CacheSize) != 1) {
+			if ( sscanf(optarg, "%u", &fs3CacheSize) != 1) {
 				logMessage(LOG_ERROR_LEVEL, "Failed parsing cache size [%s]", optarg);
 				return(-1);
 			}
 			break;
 
+		case 'e': // Set the cache replacement policy
+			if ((policy = fs3_cache_policy_by_name(optarg)) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "Unknown cache policy [%s]", optarg);
+				return(-1);
+			}
+			fs3_cache_policy = (FS3CachePolicy) policy;
+			break;
+
+		case 'k': // Set the number of cache shards
+			if ((sscanf(optarg, "%u", &fs3_cache_shards) != 1) || (fs3_cache_shards & (fs3_cache_shards - 1))) {
+				logMessage(LOG_ERROR_LEVEL, "Bad number of cache shards [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'r': // Set the maximum read-ahead window
+			if ((sscanf(optarg, "%hu", &fs3_readahead_max) != 1) || (fs3_readahead_max > FS3_MAX_READAHEAD)) {
+				logMessage(LOG_ERROR_LEVEL, "Bad read-ahead window [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'b': // Set the size of the write buffer
+			if ((sscanf(optarg, "%hu", &fs3_write_coalesce) != 1) || (fs3_write_coalesce > FS3_SECTOR_SIZE)) {
+				logMessage(LOG_ERROR_LEVEL, "Bad write buffer size [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'D': // Set the rate of the background defragmenter
+			if (sscanf(optarg, "%u", &fs3_defrag_rate) != 1) {
+				logMessage(LOG_ERROR_LEVEL, "Bad defragmenter rate [%s]", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'H': // Use huge pages for the cache
+			fs3_cache_huge_pages = 1;
+			break;
+
+		case 'W': // Write through the cache
+			fs3_cache_write_through = 1;
+			break;
+
+		case 'S': // Do not ask the controller for the multi-sector commands
+			fs3_use_multisector = 0;
+			break;
+
+		case 'L': // Write log-structured
+			fs3_log_structured = 1;
+			break;
+
+		case 't': // Set the transport to the controller
+			if ((transport = fs3_network_transport_by_name(optarg)) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "Unknown transport [%s]", optarg);
+				return(-1);
+			}
+			fs3_network_transport = (FS3Transport) transport;
+			break;
+
+		case 'd': // Set the disk image of the local controller
+			fs3_controller_image = strdup(optarg);
+			break;
+
 		case 'i': // Get the IP address
 			if (inet_addr(optarg) == INADDR_NONE) {
 				logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", argv[optind] );
@@ -120,6 +200,18 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
+		case 'T': // Ask the server for tagged commands
+			fs3_network_tagged = 1;
+			break;
+
+		case 'n': // Set the number of connections to the server
+			if ((sscanf(optarg, "%hu", &fs3_network_connections) != 1) || (fs3_network_connections == 0) ||
+			    (fs3_network_connections > FS3_MAX_CONNECTIONS)) {
+				logMessage(LOG_ERROR_LEVEL, "Bad number of connections [%s]", optarg);
+				return(-1);
+			}
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -369,7 +461,7 @@ int simulate_FS3( char *wload ) {
 	}
 
 	// Log cache metrics, shut down the interface
-	if ( fs3_log_cache_metrics() == -1 ) {
+	if ( (fs3_log_cache_metrics() == -1) || (fs3_log_driver_metrics() == -1) ) {
 		logMessage(LOG_ERROR_LEVEL, "FS3 simulation failed, controller metrics failed");
 		return(-1);
 	}
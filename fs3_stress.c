@@ -0,0 +1,340 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : fs3_stress.c
+//  Description    : This is a multi-threaded stress benchmark of the FS3
+//                   driver. For 1, 2, 4 ... up to the given number of
+//                   threads it runs a mix of seeks, reads and writes, with
+//                   each thread on its own files (disjoint) and with all of
+//                   the threads on the same few files (overlapping), and
+//                   reports the throughput of each run.
+//
+//  Author         : Sarah Babu
+//  Last Modified  : 11/19/2021
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <cmpsc311_log.h>
+
+// Project Includes
+#include <fs3_driver.h>
+#include <fs3_controller.h>
+#include <fs3_common.h>
+#include <fs3_cache.h>
+#include <fs3_network.h>
+
+//
+// Defines
+#define FS3_STRESS_ARGUMENTS "hvn:o:w:c:t:d:LT"
+#define USAGE \
+	"USAGE: fs3_stress [-h] [-v] [-n <threads>] [-o <operations>] [-w <percent>] [-c <cache size>] [-t <transport>] [-d <disk image>] [-L] [-T]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -n - most threads to run with (default 8)\n" \
+	"    -o - operations per thread in each run (default 20000)\n" \
+	"    -w - percent of the operations that are writes (default 20)\n" \
+	"    -c - set the cache size (in number of sectors)\n" \
+	"    -t - transport to the controller (tcp, local or uring, default local)\n" \
+	"    -d - disk image of the local controller (default in memory)\n" \
+	"    -L - log-structured writes, with a background segment cleaner\n" \
+	"    -T - ask the server for tagged commands\n" \
+	"\n"
+
+#define FS3_STRESS_MAX_THREADS 64            // most threads in a run
+#define FS3_STRESS_FILES 4                   // files of each thread in a disjoint run
+#define FS3_STRESS_SHARED_FILES 4            // files of all threads in an overlapping run
+#define FS3_STRESS_FILE_SIZE (32*FS3_SECTOR_SIZE) // size each file starts with
+#define FS3_STRESS_IO_SIZE (2*FS3_SECTOR_SIZE)    // bytes of a read or write
+
+// A thread of a run
+typedef struct fs3_stress_thread {
+	pthread_t thread;
+	int16_t *files;     // the files it works on
+	int nfiles;
+	uint32_t ops;       // operations to run
+	uint32_t seed;
+	uint32_t failures;  // operations that failed
+	uint64_t bytes;     // bytes read and written
+} fs3_stress_thread;
+
+//
+// Global data
+uint32_t stress_write_percent = 20;
+unsigned long FS3StressLLevel = 0;
+
+//
+// Functional Prototypes
+
+void *stress_worker(void *arg);
+	// Runs the operations of a thread
+
+int stress_make_files(int16_t *files, int nfiles, int run);
+	// Creates and fills the files of a run
+
+double stress_run(int threads, int overlapping, uint32_t ops, int run, uint64_t *bytes);
+	// Runs one thread count in one mode, returns the operations per second
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the FS3 stress benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char *argv[]) {
+	int ch, verbose = 0, transport = 0, threads = 0, most = 8, overlapping = 0, run = 0;
+	uint32_t cache_size = 0;
+	uint32_t ops = 20000;
+	uint64_t bytes = 0;
+	double rate = 0, base[2] = {0, 0};
+
+	// the local controller on a disk in memory unless told otherwise
+	fs3_network_transport = FS3_TRANSPORT_LOCAL;
+	fs3_controller_image = NULL;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, FS3_STRESS_ARGUMENTS)) != -1) {
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf(stderr, USAGE);
+			return(-1);
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'n': // Set the most threads
+			if ((sscanf(optarg, "%d", &most) != 1) || (most < 1) || (most > FS3_STRESS_MAX_THREADS)) {
+				fprintf(stderr, "Bad number of threads [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'o': // Set the operations per thread
+			if ((sscanf(optarg, "%u", &ops) != 1) || (ops == 0)) {
+				fprintf(stderr, "Bad number of operations [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'w': // Set the share of writes
+			if ((sscanf(optarg, "%u", &stress_write_percent) != 1) || (stress_write_percent > 100)) {
+				fprintf(stderr, "Bad write percentage [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 'c': // Set the cache size
+			if (sscanf(optarg, "%u", &cache_size) != 1) {
+				fprintf(stderr, "Bad cache size [%s]\n", optarg);
+				return(-1);
+			}
+			break;
+
+		case 't': // Set the transport to the controller
+			if ((transport = fs3_network_transport_by_name(optarg)) == -1) {
+				fprintf(stderr, "Unknown transport [%s]\n", optarg);
+				return(-1);
+			}
+			fs3_network_transport = (FS3Transport) transport;
+			break;
+
+		case 'd': // Set the disk image of the local controller
+			fs3_controller_image = optarg;
+			break;
+
+		case 'L': // Write log-structured
+			fs3_log_structured = 1;
+			break;
+
+		case 'T': // Ask the server for tagged commands
+			fs3_network_tagged = 1;
+			break;
+
+		default:  // Default (unknown)
+			fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+			return(-1);
+		}
+	}
+
+	// Setup the log
+	initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+	FS3DriverLLevel = registerLogLevel("FS3_DRIVER", 0);
+	FS3StressLLevel = registerLogLevel("FS3_STRESS", 0);
+	if (verbose) {
+		enableLogLevels(FS3DriverLLevel | FS3StressLLevel);
+	}
+
+	// Startup the interface
+	if ((fs3_mount_disk() == -1) || (fs3_init_cache(cache_size) == -1)) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 stress failed initialization.");
+		return(-1);
+	}
+
+	// each mode from one thread up, doubling to the most
+	printf("%-12s %8s %12s %10s %8s\n", "files", "threads", "ops/sec", "MB/sec", "speedup");
+	for (overlapping = 0; overlapping < 2; overlapping++) {
+		for (threads = 1; ; threads *= 2) {
+			threads = (threads > most) ? most : threads;
+			rate = stress_run(threads, overlapping, ops, run++, &bytes);
+			if (rate < 0) {
+				fs3_unmount_disk();
+				return(-1);
+			}
+			if (threads == 1) {
+				base[overlapping] = rate;
+			}
+			printf("%-12s %8d %12.0f %10.2f %7.2fx\n", (overlapping) ? "overlapping" : "disjoint", threads,
+			       rate, (rate * ((double) bytes / ((double) threads * ops))) / (1024.0 * 1024.0),
+			       (base[overlapping] > 0) ? rate / base[overlapping] : 0.0);
+			if (threads >= most) {
+				break;
+			}
+		}
+	}
+
+	// Shut down and show what the layers saw
+	if (fs3_unmount_disk() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 stress failed to unmount.");
+	}
+	fs3_log_cache_metrics();
+	fs3_log_driver_metrics();
+	fs3_close_cache();
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stress_make_files
+// Description  : Creates the files of a run, each filled to its starting
+//                size
+//
+// Inputs       : files - set to the file handles
+//                nfiles - number of files
+//                run - the run, to name the files
+// Outputs      : 0 if successful, -1 if failure
+
+int stress_make_files(int16_t *files, int nfiles, int run) {
+	char path[FS3_MAX_PATH_LENGTH];
+	uint8_t data[FS3_STRESS_FILE_SIZE];
+	int i = 0;
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "stress-%d-%d", run, i);
+		memset(data, 'a' + (i % 26), sizeof(data));
+		if ((-1 == (files[i] = fs3_open(path))) ||
+		    (FS3_STRESS_FILE_SIZE != fs3_write(files[i], data, FS3_STRESS_FILE_SIZE))) {
+			logMessage(LOG_ERROR_LEVEL, "FS3 stress failed creating file [%s]", path);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stress_worker
+// Description  : Runs the operations of a thread, each a seek to a random
+//                place in one of its files and a read or a write there
+//
+// Inputs       : arg - the thread
+// Outputs      : NULL
+
+void *stress_worker(void *arg) {
+	fs3_stress_thread *t = (fs3_stress_thread *) arg;
+	uint8_t buf[FS3_STRESS_IO_SIZE];
+	uint32_t i = 0, loc = 0;
+	int16_t fd = 0;
+	int32_t ret = 0;
+
+	memset(buf, 'z', sizeof(buf));
+	for (i = 0; i < t->ops; i++) {
+		fd = t->files[rand_r(&t->seed) % t->nfiles];
+		loc = (rand_r(&t->seed) % ((FS3_STRESS_FILE_SIZE - FS3_STRESS_IO_SIZE) / 512)) * 512;
+		// the seek fails if a shared file is not that long yet, the
+		// operation then runs where the file is
+		fs3_seek(fd, loc);
+		if ((uint32_t) (rand_r(&t->seed) % 100) < stress_write_percent) {
+			ret = fs3_write(fd, buf, FS3_STRESS_IO_SIZE);
+		} else {
+			ret = fs3_read(fd, buf, FS3_STRESS_IO_SIZE);
+		}
+		if (ret < 0) {
+			t->failures++;
+		} else {
+			t->bytes += ret;
+		}
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stress_run
+// Description  : Runs one thread count on disjoint or overlapping files
+//
+// Inputs       : threads - the number of threads
+//                overlapping - all threads share the same files
+//                ops - operations per thread
+//                run - the run, to name its files
+//                bytes - set to the bytes moved by all threads
+// Outputs      : operations per second, -1 if failure
+
+double stress_run(int threads, int overlapping, uint32_t ops, int run, uint64_t *bytes) {
+	fs3_stress_thread t[FS3_STRESS_MAX_THREADS];
+	int16_t files[FS3_STRESS_MAX_THREADS * FS3_STRESS_FILES];
+	struct timespec start, end;
+	uint32_t failures = 0;
+	double seconds = 0;
+	int i = 0, nfiles = 0;
+
+	nfiles = (overlapping) ? FS3_STRESS_SHARED_FILES : threads * FS3_STRESS_FILES;
+	if (-1 == stress_make_files(files, nfiles, run)) {
+		return(-1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++) {
+		t[i].files = (overlapping) ? files : &files[i * FS3_STRESS_FILES];
+		t[i].nfiles = (overlapping) ? FS3_STRESS_SHARED_FILES : FS3_STRESS_FILES;
+		t[i].ops = ops;
+		t[i].seed = (run * FS3_STRESS_MAX_THREADS) + i + 1;
+		t[i].failures = 0;
+		t[i].bytes = 0;
+		if (0 != pthread_create(&t[i].thread, NULL, stress_worker, &t[i])) {
+			logMessage(LOG_ERROR_LEVEL, "FS3 stress failed starting thread %d", i);
+			threads = i;
+			break;
+		}
+	}
+	*bytes = 0;
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		failures += t[i].failures;
+		*bytes += t[i].bytes;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < nfiles; i++) {
+		fs3_close(files[i]);
+	}
+	if (failures > 0) {
+		logMessage(LOG_ERROR_LEVEL, "FS3 stress had %u failed operations with %d threads", failures, threads);
+		return(-1);
+	}
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	logMessage(FS3StressLLevel, "FS3 stress run %d, %d threads in %.3f seconds", run, threads, seconds);
+	return((seconds > 0) ? ((double) threads * ops) / seconds : 0.0);
+}